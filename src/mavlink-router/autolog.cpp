@@ -66,7 +66,8 @@ int AutoLog::write_msg(const struct buffer *buffer)
     log_debug("Got autopilot %u from heartbeat", heartbeat->autopilot);
     if (heartbeat->autopilot == MAV_AUTOPILOT_PX4) {
         _logger
-            = std::unique_ptr<LogEndpoint>(new ULog(_logs_dir, _mode, _min_free_space, _max_files, _broadcast_hb));
+            = std::unique_ptr<LogEndpoint>(new ULog(_logs_dir, _mode, _min_free_space, _max_files,
+                                                    _broadcast_hb));
     } else if (heartbeat->autopilot == MAV_AUTOPILOT_ARDUPILOTMEGA) {
         _logger = std::unique_ptr<LogEndpoint>(
             new BinLog(_logs_dir, _mode, _min_free_space, _max_files, _broadcast_hb));
@@ -74,6 +75,9 @@ int AutoLog::write_msg(const struct buffer *buffer)
         log_warning("Unidentified autopilot, cannot start flight stack logging");
     }
 
+    if (_logger)
+        _logger->set_storage_options(_storage);
+
     return buffer->len;
 }
 
@@ -19,10 +19,15 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
+
 #include <common/log.h>
 #include <common/util.h>
 
@@ -52,7 +57,19 @@ bool BinLog::start()
         return false;
     }
 
-    _last_acked_seqno = 0;
+    _next_seqno = 0;
+    _received_blocks.clear();
+    _received_count = 0;
+    _missing_blocks.clear();
+    _pending_acks.clear();
+
+    _status_timeout = Mainloop::get_instance().add_timeout(
+        BINLOG_STATUS_INTERVAL_MS, std::bind(&BinLog::_status_timeout_cb, this), this);
+    if (!_status_timeout) {
+        log_error("Unable to add timeout");
+        LogEndpoint::stop();
+        return false;
+    }
 
     return true;
 }
@@ -64,7 +81,14 @@ void BinLog::stop()
         return;
     }
 
+    Mainloop::get_instance().del_timeout(_status_timeout);
+    _status_timeout = nullptr;
+    for (uint32_t seqno : _pending_acks)
+        _send_block_status(seqno, true);
+    _pending_acks.clear();
+
     _send_stop();
+    _report_missing_blocks();
 
     LogEndpoint::stop();
 }
@@ -166,59 +190,153 @@ int BinLog::write_msg(const struct buffer *buffer)
     return buffer->len;
 }
 
-void BinLog::_send_ack(uint32_t seqno)
+void BinLog::_send_block_status(uint32_t seqno, bool ack)
 {
     mavlink_message_t msg;
 
-    // Message filled a gap, or is duplicated. just send the ack
-    if (seqno < _last_acked_seqno) {
-        mavlink_msg_remote_log_block_status_pack(LOG_ENDPOINT_SYSTEM_ID, MAV_COMP_ID_ALL, &msg,
-                                                 _target_system_id, MAV_COMP_ID_ALL, seqno, 1);
-        _send_msg(&msg, _target_system_id);
+    mavlink_msg_remote_log_block_status_pack(LOG_ENDPOINT_SYSTEM_ID, MAV_COMP_ID_ALL, &msg,
+                                             _target_system_id, MAV_COMP_ID_ALL, seqno, ack);
+    _send_msg(&msg, _target_system_id);
+}
+
+/*
+ * The protocol has no cumulative ack, every block must be acked on its own.
+ * Acks are sent back to back on the next status timeout, so the endpoint
+ * towards the flight stack can send them in as few packets as possible.
+ */
+void BinLog::_queue_ack(uint32_t seqno)
+{
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+
+    _pending_acks.push_back(seqno);
+
+    if (seqno < _next_seqno) {
+        // Message filled a gap, or is duplicated
+        _missing_blocks.erase(seqno);
         return;
     }
 
-    // TODO maybe a threshould of [n]acks to be sent?
-    // TODO send ack to source only?
-    // Send nacks regarding unseen seqno
-    for (uint32_t i = _last_acked_seqno; i < seqno; i++) {
-        mavlink_msg_remote_log_block_status_pack(LOG_ENDPOINT_SYSTEM_ID, MAV_COMP_ID_ALL, &msg,
-                                                 _target_system_id, MAV_COMP_ID_ALL, seqno, 0);
-        _send_msg(&msg, _target_system_id);
+    // Blocks skipped by this one are nacked starting on next status timeout
+    const uint32_t first = std::max(_next_seqno, seqno - std::min(seqno, BINLOG_MAX_MISSING_BLOCKS));
+    for (uint32_t i = first; i < seqno; i++)
+        _missing_blocks[i] = {now_ms, 0};
+    _next_seqno = seqno + 1;
+
+    while (_missing_blocks.size() > BINLOG_MAX_MISSING_BLOCKS)
+        _missing_blocks.erase(_missing_blocks.begin());
+}
+
+bool BinLog::_status_timeout_cb()
+{
+    _send_block_statuses(now_usec() / USEC_PER_MSEC);
+    return true;
+}
+
+void BinLog::_send_block_statuses(uint64_t now_ms)
+{
+    unsigned int nacks = 0;
+
+    for (uint32_t seqno : _pending_acks)
+        _send_block_status(seqno, true);
+    _pending_acks.clear();
+
+    // Nack missing blocks, oldest first, retrying the ones still not resent
+    for (auto it = _missing_blocks.begin();
+         it != _missing_blocks.end() && nacks < BINLOG_MAX_NACKS_PER_INTERVAL;) {
+        if (it->second.next_nack_ms > now_ms) {
+            ++it;
+            continue;
+        }
+
+        if (it->second.retries == BINLOG_NACK_MAX_RETRIES) {
+            log_debug("BinLog block %u not resent after %u nacks, giving up", it->first,
+                      BINLOG_NACK_MAX_RETRIES);
+            it = _missing_blocks.erase(it);
+            continue;
+        }
+
+        _send_block_status(it->first, false);
+        it->second.retries++;
+        it->second.next_nack_ms = now_ms + BINLOG_NACK_RETRY_MS;
+        nacks++;
+        ++it;
     }
+}
 
-    // Send ack to seen seqno
-    mavlink_msg_remote_log_block_status_pack(LOG_ENDPOINT_SYSTEM_ID, MAV_COMP_ID_ALL, &msg, _target_system_id,
-                                             MAV_COMP_ID_ALL, seqno, 1);
-    _send_msg(&msg, _target_system_id);
-    _last_acked_seqno = seqno;
+bool BinLog::_block_received(uint32_t seqno) const
+{
+    return seqno / 64 < _received_blocks.size()
+        && (_received_blocks[seqno / 64] & (1ULL << (seqno % 64)));
 }
 
-void BinLog::_logging_data_process(mavlink_remote_log_data_block_t *msg)
+/*
+ * Log the ranges of blocks that never arrived, leaving holes in the file
+ */
+void BinLog::_report_missing_blocks()
 {
-    ssize_t r;
+    const uint32_t total = _received_blocks.size() * 64;
+    uint32_t missing = 0;
+    std::string ranges;
+    uint32_t i = 0;
+
+    while (i < total) {
+        if (_block_received(i)) {
+            i++;
+            continue;
+        }
+
+        const uint32_t first = i;
+        while (i < total && !_block_received(i))
+            i++;
+        // Bits after the highest block received aren't holes
+        if (i == total)
+            break;
+
+        missing += i - first;
+        if (ranges.size() < 200) {
+            char range[32];
+            if (i - first == 1)
+                snprintf(range, sizeof(range), " %" PRIu32, first);
+            else
+                snprintf(range, sizeof(range), " %" PRIu32 "-%" PRIu32, first, i - 1);
+            ranges += range;
+        }
+    }
+
+    if (missing)
+        log_warning("BinLog: %u of %u blocks missing:%s%s", missing, missing + _received_count,
+                    ranges.c_str(), ranges.size() < 200 ? "" : " ...");
+}
 
-    if (lseek(_file, msg->seqno * MAVLINK_MSG_REMOTE_LOG_DATA_BLOCK_FIELD_DATA_LEN, SEEK_SET) < 0) {
-        log_error("lseek failed (%m)");
-        _restart();
+void BinLog::_logging_data_process(mavlink_remote_log_data_block_t *msg)
+{
+    if (msg->seqno >= BINLOG_MAX_BLOCKS) {
+        log_error("BinLog block %u beyond maximum log size, ignoring it", msg->seqno);
         return;
     }
 
-    r = write(_file, msg->data, MAVLINK_MSG_REMOTE_LOG_DATA_BLOCK_FIELD_DATA_LEN);
-    if (r < 0 && errno != EAGAIN) {
-        log_error("Error writing data (%m)");
-        _restart();
+    // Already written, the ack was probably lost
+    if (_block_received(msg->seqno)) {
+        _queue_ack(msg->seqno);
         return;
     }
-    if (r != MAVLINK_MSG_REMOTE_LOG_DATA_BLOCK_FIELD_DATA_LEN) {
-        // partial writes are handled by not sending ack. Flight stack should resend
-        // msg. We hope that partial writes are rare enough
-        log_error("Log partial write %ld", r);
+
+    /*
+     * Not acking the block when the writer thread is behind makes the
+     * flight stack resend it
+     */
+    if (!_writer.write_at(msg->data, MAVLINK_MSG_REMOTE_LOG_DATA_BLOCK_FIELD_DATA_LEN,
+                          (off_t)msg->seqno * MAVLINK_MSG_REMOTE_LOG_DATA_BLOCK_FIELD_DATA_LEN)) {
+        log_debug("Log writer is full, not acking block %u", msg->seqno);
         return;
     }
 
-    // TODO should we send acks on a different fashion. e.g. queueing and sending?
-    _send_ack(msg->seqno);
+    if (msg->seqno / 64 >= _received_blocks.size())
+        _received_blocks.resize(msg->seqno / 64 + 1);
+    _received_blocks[msg->seqno / 64] |= 1ULL << (msg->seqno % 64);
+    _received_count++;
+
+    _queue_ack(msg->seqno);
 }
 
 void BinLog::_restart()
@@ -17,10 +17,23 @@
  */
 #pragma once
 
+#include <map>
+#include <vector>
+
 #include "logendpoint.h"
 #include "timeout.h"
 
 #define BUFFER_LEN 2048
+/* Blocks of 200 bytes, about 13 GB */
+#define BINLOG_MAX_BLOCKS (1U << 26)
+
+/* Pending acks and nacks are sent in batches at this interval */
+#define BINLOG_STATUS_INTERVAL_MS 20
+#define BINLOG_MAX_NACKS_PER_INTERVAL 10
+#define BINLOG_NACK_RETRY_MS 500
+#define BINLOG_NACK_MAX_RETRIES 10
+/* Missing blocks tracked for retransmission, the oldest are given up */
+#define BINLOG_MAX_MISSING_BLOCKS 4096U
 
 class BinLog : public LogEndpoint {
 public:
@@ -44,14 +57,36 @@ protected:
     bool _stop_timeout() override;
 
     const char *_get_logfile_extension() override { return "bin"; };
+
+    /* Send pending acks and the nacks due at @now_ms */
+    void _send_block_statuses(uint64_t now_ms);
+
 private:
-    uint32_t _last_acked_seqno = 0;
+    /* Next block expected after the highest one received */
+    uint32_t _next_seqno = 0;
+
+    struct missing_block {
+        uint64_t next_nack_ms;
+        unsigned int retries;
+    };
+    std::map<uint32_t, struct missing_block> _missing_blocks;
+    std::vector<uint32_t> _pending_acks;
+    Timeout *_status_timeout = nullptr;
+
+    /* One bit per block received in this log, up to the highest one */
+    std::vector<uint64_t> _received_blocks;
+    uint32_t _received_count = 0;
+
+    bool _block_received(uint32_t seqno) const;
+    void _report_missing_blocks();
 
     bool _logging_seq(uint16_t seq, bool *drop);
     void _logging_data_process(mavlink_remote_log_data_block_t *msg);
     bool _logging_flush();
 
-    void _send_ack(uint32_t seqno);
+    void _queue_ack(uint32_t seqno);
+    void _send_block_status(uint32_t seqno, bool ack);
+    bool _status_timeout_cb();
     void _send_stop();
     void _restart();
 };
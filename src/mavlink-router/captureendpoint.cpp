@@ -0,0 +1,292 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "captureendpoint.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <common/log.h>
+#include <common/util.h>
+
+#include "mainloop.h"
+
+// pcapng block types, see https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng
+#define PCAPNG_SECTION_HEADER_BLOCK 0x0A0D0D0A
+#define PCAPNG_INTERFACE_DESCRIPTION_BLOCK 0x00000001
+#define PCAPNG_ENHANCED_PACKET_BLOCK 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+#define LINKTYPE_USER0 147
+
+#define PCAPNG_PAD(len) (((len) + 3) & ~3U)
+
+struct pcapng_block_header {
+    uint32_t type;
+    uint32_t len;
+};
+
+struct pcapng_section_header {
+    struct pcapng_block_header hdr;
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_len;
+    uint32_t trailer_len;
+} __attribute__((packed));
+
+struct pcapng_interface_header {
+    struct pcapng_block_header hdr;
+    uint16_t link_type;
+    uint16_t reserved;
+    uint32_t snap_len;
+};
+
+struct pcapng_packet_header {
+    struct pcapng_block_header hdr;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t captured_len;
+    uint32_t orig_len;
+};
+
+CaptureEndpoint::CaptureEndpoint(const char *capture_dir,
+                                 const struct log_storage_options &storage)
+    : Endpoint{"Capture"}
+    , _capture_dir{capture_dir}
+    , _storage(storage)
+    , _writer{new LogWriter()}
+{
+}
+
+CaptureEndpoint::~CaptureEndpoint()
+{
+    stop();
+
+    // Wait for all files to be finished
+    _closing.clear();
+}
+
+void CaptureEndpoint::set_msg_filter(const std::vector<uint32_t> &msg_ids)
+{
+    _msg_filter.clear();
+
+    for (uint32_t id : msg_ids) {
+        if (id >= _msg_filter.size())
+            _msg_filter.resize(id + 1);
+        _msg_filter[id] = true;
+    }
+}
+
+bool CaptureEndpoint::start()
+{
+    const struct pcapng_section_header shb = {
+        {PCAPNG_SECTION_HEADER_BLOCK, sizeof(shb)},
+        PCAPNG_BYTE_ORDER_MAGIC,
+        1,
+        0,
+        -1, // section length not known
+        sizeof(shb),
+    };
+    const struct iovec iov = {(void *)&shb, sizeof(shb)};
+
+    if (_file != -1)
+        return true;
+
+    LogWriter::collect(_closing);
+
+    _file = LogWriter::create_file(_capture_dir, "pcapng", _filename, sizeof(_filename));
+    if (_file < 0)
+        return false;
+
+    if (_writer->open(_file, _storage) < 0) {
+        close(_file);
+        _file = -1;
+        return false;
+    }
+
+    // Interfaces are described again in each file
+    _interfaces.clear();
+    _next_interface = 0;
+
+    _flush_timeout = Mainloop::get_instance().add_timeout(
+        _storage.sync_interval ? std::min<unsigned long>(_storage.sync_interval, MSEC_PER_SEC)
+                               : MSEC_PER_SEC,
+        std::bind(&CaptureEndpoint::_flush, this), this);
+
+    if (!_flush_timeout || !_writer->append(&iov, 1)) {
+        log_error("Unable to start capture on %s/%s", _capture_dir, _filename);
+        stop();
+        return false;
+    }
+
+    log_info("Capturing routed messages on %s/%s", _capture_dir, _filename);
+
+    return true;
+}
+
+void CaptureEndpoint::stop()
+{
+    if (_file == -1)
+        return;
+
+    Mainloop::get_instance().del_timeout(_flush_timeout);
+    _flush_timeout = nullptr;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", _capture_dir, _filename) >= (int)sizeof(path))
+        path[0] = '\0';
+
+    _writer->close_async(path);
+    _closing.push_back(std::move(_writer));
+    _writer.reset(new LogWriter());
+    _file = -1;
+
+    log_info("Capture on %s/%s stopped", _capture_dir, _filename);
+}
+
+/*
+ * Append a pcapng option to @block
+ */
+static void put_option(std::vector<uint8_t> &block, uint16_t code, const void *value, uint16_t len)
+{
+    const uint16_t hdr[] = {code, len};
+    const uint8_t *v = (const uint8_t *)value;
+
+    block.insert(block.end(), (const uint8_t *)hdr, (const uint8_t *)hdr + sizeof(hdr));
+    block.insert(block.end(), v, v + len);
+    block.resize(PCAPNG_PAD(block.size()));
+}
+
+bool CaptureEndpoint::_add_interfaces(const Endpoint *e, uint32_t *id)
+{
+    const std::string name = e ? e->name() : "mavlink-router";
+    const uint8_t tsresol = 9; // nanoseconds
+    std::vector<uint8_t> blocks[2];
+    struct iovec iov[2];
+
+    for (int tx = 0; tx < 2; tx++) {
+        const std::string if_name = name + (tx ? " tx" : " rx");
+        const struct pcapng_interface_header hdr = {
+            {PCAPNG_INTERFACE_DESCRIPTION_BLOCK, 0},
+            LINKTYPE_USER0,
+            0,
+            0, // no snapshot length limit
+        };
+        std::vector<uint8_t> &block = blocks[tx];
+        uint32_t len;
+
+        block.assign((const uint8_t *)&hdr, (const uint8_t *)&hdr + sizeof(hdr));
+        put_option(block, PCAPNG_OPT_IF_NAME, if_name.c_str(), if_name.size());
+        put_option(block, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+        put_option(block, PCAPNG_OPT_ENDOFOPT, nullptr, 0);
+
+        len = block.size() + sizeof(len);
+        memcpy(&block[offsetof(struct pcapng_block_header, len)], &len, sizeof(len));
+        block.insert(block.end(), (const uint8_t *)&len, (const uint8_t *)&len + sizeof(len));
+
+        iov[tx] = {block.data(), block.size()};
+    }
+
+    if (!_writer->append(iov, 2))
+        return false;
+
+    *id = _next_interface;
+    _next_interface += 2;
+    _interfaces[e] = *id;
+
+    return true;
+}
+
+void CaptureEndpoint::_capture(const Endpoint *e, bool tx, const struct buffer *pbuf)
+{
+    static const uint8_t padding[3] = {};
+    const uint32_t block_len
+        = sizeof(struct pcapng_packet_header) + PCAPNG_PAD(pbuf->len) + sizeof(uint32_t);
+    struct timespec ts;
+    uint32_t id;
+
+    auto it = _interfaces.find(e);
+    if (it != _interfaces.end()) {
+        id = it->second;
+    } else if (!_add_interfaces(e, &id)) {
+        _dropped++;
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t timestamp = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+    const struct pcapng_packet_header hdr = {
+        {PCAPNG_ENHANCED_PACKET_BLOCK, block_len},
+        id + tx,
+        (uint32_t)(timestamp >> 32),
+        (uint32_t)timestamp,
+        pbuf->len,
+        pbuf->len,
+    };
+    const struct iovec iov[] = {
+        {(void *)&hdr, sizeof(hdr)},
+        {pbuf->data, pbuf->len},
+        {(void *)padding, PCAPNG_PAD(pbuf->len) - pbuf->len},
+        {(void *)&block_len, sizeof(block_len)},
+    };
+
+    if (!_writer->append(iov, 4)) {
+        _dropped++;
+        return;
+    }
+
+    _stat.write.total++;
+    _stat.write.bytes += block_len;
+}
+
+int CaptureEndpoint::write_msg(const struct buffer *pbuf)
+{
+    // Everything is captured by capture(), nothing is routed here
+    return pbuf->len;
+}
+
+bool CaptureEndpoint::_flush()
+{
+    const int err = _writer->get_error();
+
+    if (err)
+        log_error("Unable to write to capture file %s (%s)", _filename, strerror(err));
+
+    _writer->flush();
+    LogWriter::collect(_closing);
+    return true;
+}
+
+void CaptureEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+
+    if (_dropped)
+        printf("EP %s Dropped: %u\n", _name.c_str(), _dropped);
+}
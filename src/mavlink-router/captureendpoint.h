@@ -0,0 +1,112 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "endpoint.h"
+#include "logwriter.h"
+#include "timeout.h"
+
+/*
+ * Captures messages routed by mavlink-router to a pcapng file, with one
+ * interface per endpoint and direction: what mavlink-router received from
+ * the endpoint and what it sent to it. Each message is a packet with a
+ * nanosecond timestamp and LINKTYPE_USER0 link type.
+ *
+ * Like TLogEndpoint, messages are handed over by Mainloop and not routed to
+ * it. Capture may be started and stopped at any time, each start creating a
+ * new file.
+ */
+class CaptureEndpoint : public Endpoint {
+public:
+    CaptureEndpoint(const char *capture_dir, const struct log_storage_options &storage);
+    ~CaptureEndpoint();
+
+    bool start();
+
+    /*
+     * Stop capturing. The file is finished by the writer thread in
+     * background.
+     */
+    void stop();
+    bool is_started() const { return _file >= 0; }
+
+    /*
+     * Capture only messages with the given ids. All are captured if empty.
+     */
+    void set_msg_filter(const std::vector<uint32_t> &msg_ids);
+
+    /*
+     * Capture message received from @e, or sent to it if @tx is set. @e is
+     * nullptr for messages generated by mavlink-router itself.
+     */
+    void capture(const Endpoint *e, bool tx, const struct buffer *pbuf)
+    {
+        if (_file < 0 || (!_msg_filter.empty() && !_should_capture(pbuf)))
+            return;
+        _capture(e, tx, pbuf);
+    }
+
+    /*
+     * Endpoint @e is going away, a new interface is used if another one is
+     * created at the same address.
+     */
+    void forget_endpoint(const Endpoint *e) { _interfaces.erase(e); }
+
+    int write_msg(const struct buffer *pbuf) override;
+    int flush_pending_msgs() override { return -ENOSYS; }
+    void print_statistics() override;
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
+
+private:
+    const char *_capture_dir;
+    struct log_storage_options _storage;
+
+    int _file = -1;
+    char _filename[64];
+    std::unique_ptr<LogWriter> _writer;
+    // Writers of previous files, finishing them in background
+    std::vector<std::unique_ptr<LogWriter>> _closing;
+    std::vector<bool> _msg_filter;
+    uint32_t _dropped = 0;
+    Timeout *_flush_timeout = nullptr;
+
+    // Id of the receive interface of each endpoint, the send one is the next
+    std::unordered_map<const Endpoint *, uint32_t> _interfaces;
+    uint32_t _next_interface = 0;
+
+    bool _should_capture(const struct buffer *pbuf) const
+    {
+        uint32_t msg_id;
+
+        if (pbuf->data[0] == MAVLINK_STX)
+            msg_id = ((const struct mavlink_router_mavlink2_header *)pbuf->data)->msgid;
+        else
+            msg_id = ((const struct mavlink_router_mavlink1_header *)pbuf->data)->msgid;
+
+        return msg_id < _msg_filter.size() && _msg_filter[msg_id];
+    }
+    void _capture(const Endpoint *e, bool tx, const struct buffer *pbuf);
+    bool _add_interfaces(const Endpoint *e, uint32_t *id);
+    bool _flush();
+};
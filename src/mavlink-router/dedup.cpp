@@ -0,0 +1,103 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "dedup.h"
+
+#include <string.h>
+
+#include <common/util.h>
+
+#include "endpoint.h"
+
+void Dedup::set_period(uint32_t period_ms)
+{
+    _period_ms = period_ms;
+    memset(_sources, 0, sizeof(_sources));
+}
+
+/*
+ * Sources live in a small open addressed table. If the probe sequence is
+ * full, the home slot is recycled: losing the history of a source only means
+ * a duplicate may get through.
+ */
+struct Dedup::source *Dedup::_get_source(uint16_t id)
+{
+    const unsigned int home = ((id >> 8) * 31 + (id & 0xff)) % SOURCE_SLOTS;
+
+    for (unsigned int i = 0; i < SOURCE_PROBES; i++) {
+        struct source *s = &_sources[(home + i) % SOURCE_SLOTS];
+
+        if (!s->used) {
+            s->used = true;
+            s->id = id;
+            return s;
+        }
+        if (s->id == id)
+            return s;
+    }
+
+    struct source *s = &_sources[home];
+    memset(s, 0, sizeof(*s));
+    s->used = true;
+    s->id = id;
+    return s;
+}
+
+Dedup::PacketStatus Dedup::check_packet(const struct buffer *buf, uint8_t src_sysid,
+                                        uint8_t src_compid, uint32_t msg_id)
+{
+    struct entry pkt;
+    size_t crc_ofs;
+
+    if (!enabled())
+        return PacketStatus::Disabled;
+
+    if (buf->data[0] == MAVLINK_STX) {
+        const struct mavlink_router_mavlink2_header *hdr
+            = (const struct mavlink_router_mavlink2_header *)buf->data;
+        pkt.seq = hdr->seq;
+        crc_ofs = sizeof(*hdr) + hdr->payload_len;
+    } else {
+        const struct mavlink_router_mavlink1_header *hdr
+            = (const struct mavlink_router_mavlink1_header *)buf->data;
+        pkt.seq = hdr->seq;
+        crc_ofs = sizeof(*hdr) + hdr->payload_len;
+    }
+
+    if (crc_ofs + 2 > buf->len)
+        return PacketStatus::New;
+
+    pkt.crc = buf->data[crc_ofs] | (buf->data[crc_ofs + 1] << 8);
+    pkt.msg_id = msg_id;
+    pkt.time_ms = now_usec() / USEC_PER_MSEC;
+
+    struct source *s = _get_source(((uint16_t)src_sysid << 8) | src_compid);
+
+    for (const struct entry &e : s->window) {
+        // Zeroed entries are never valid as they would need a timestamp of 0
+        if (e.time_ms == 0 || pkt.time_ms - e.time_ms > _period_ms)
+            continue;
+
+        if (e.seq == pkt.seq && e.msg_id == pkt.msg_id && e.crc == pkt.crc)
+            return PacketStatus::Duplicate;
+    }
+
+    s->window[s->next] = pkt;
+    s->next = (s->next + 1) % WINDOW_SIZE;
+
+    return PacketStatus::New;
+}
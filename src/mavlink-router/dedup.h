@@ -0,0 +1,67 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "comm.h"
+
+/*
+ * Detects packets received more than once, e.g. when a vehicle is reachable
+ * through redundant links. Packets are identified by source sysid/compid,
+ * sequence number, message id and CRC and a small window of recently seen
+ * packets is kept per source.
+ */
+class Dedup {
+public:
+    enum class PacketStatus { Disabled, New, Duplicate };
+
+    /*
+     * Set how long a packet is remembered, in milliseconds. 0 disables
+     * duplicate detection.
+     */
+    void set_period(uint32_t period_ms);
+    bool enabled() const { return _period_ms > 0; }
+
+    PacketStatus check_packet(const struct buffer *buf, uint8_t src_sysid, uint8_t src_compid,
+                              uint32_t msg_id);
+
+private:
+    static const unsigned int SOURCE_SLOTS = 64;
+    static const unsigned int SOURCE_PROBES = 8;
+    static const unsigned int WINDOW_SIZE = 16;
+
+    struct entry {
+        uint32_t time_ms;
+        uint32_t msg_id;
+        uint16_t crc;
+        uint8_t seq;
+    };
+
+    struct source {
+        uint16_t id;
+        bool used;
+        uint8_t next;
+        struct entry window[WINDOW_SIZE];
+    };
+
+    uint32_t _period_ms = 0;
+    struct source _sources[SOURCE_SLOTS] = {};
+
+    struct source *_get_source(uint16_t id);
+};
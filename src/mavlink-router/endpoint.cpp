@@ -35,6 +35,7 @@
 #include <common/util.h>
 #include <common/xtermios.h>
 
+#include <linux/filter.h>
 #include <linux/serial.h>
 
 #include "mainloop.h"
@@ -44,6 +45,101 @@
 
 #define UART_BAUD_RETRY_SEC 5
 
+#define SHAPER_QUEUE_MAX_SIZE TX_BUF_MAX_SIZE
+#define SHAPER_BURST_MSEC 100
+
+/*
+ * A route is considered moved to another endpoint when the same
+ * system/component was seen there this long after it was last seen here.
+ * Keeping both routes for a while avoids flapping between redundant links.
+ */
+#define ROUTE_MIGRATE_MSEC 5000
+
+// Previous UDP client must be silent this long before a new one gets the snapshot
+#define SNAPSHOT_SILENCE_MSEC 1000
+
+// Radio link pacing, thresholds are percentages of free radio TX buffer
+#define RADIO_DEFAULT_BITRATE 64000
+#define RADIO_MIN_RATE_DIVISOR 8
+#define RADIO_TXBUF_CRITICAL 10
+#define RADIO_TXBUF_LOW 20
+#define RADIO_TXBUF_HIGH 50
+#define RADIO_TXBUF_FREE 90
+
+/*
+ * Messages that are kept even when a radio link is congested. Everything else
+ * is considered periodic telemetry that will be sent again soon.
+ */
+static const uint32_t radio_high_priority_msgs[] = {
+    MAVLINK_MSG_ID_HEARTBEAT,
+    MAVLINK_MSG_ID_SET_MODE,
+    MAVLINK_MSG_ID_PARAM_REQUEST_READ,
+    MAVLINK_MSG_ID_PARAM_REQUEST_LIST,
+    MAVLINK_MSG_ID_PARAM_VALUE,
+    MAVLINK_MSG_ID_PARAM_SET,
+    MAVLINK_MSG_ID_MISSION_ITEM,
+    MAVLINK_MSG_ID_MISSION_REQUEST,
+    MAVLINK_MSG_ID_MISSION_SET_CURRENT,
+    MAVLINK_MSG_ID_MISSION_REQUEST_LIST,
+    MAVLINK_MSG_ID_MISSION_COUNT,
+    MAVLINK_MSG_ID_MISSION_CLEAR_ALL,
+    MAVLINK_MSG_ID_MISSION_ACK,
+    MAVLINK_MSG_ID_MISSION_REQUEST_INT,
+    MAVLINK_MSG_ID_MISSION_ITEM_INT,
+    MAVLINK_MSG_ID_COMMAND_INT,
+    MAVLINK_MSG_ID_COMMAND_LONG,
+    MAVLINK_MSG_ID_COMMAND_ACK,
+    MAVLINK_MSG_ID_RADIO_STATUS,
+    MAVLINK_MSG_ID_STATUSTEXT,
+};
+
+static uint32_t get_msg_id(const struct buffer *pbuf)
+{
+    if (pbuf->data[0] == MAVLINK_STX) {
+        const struct mavlink_router_mavlink2_header *hdr
+            = (const struct mavlink_router_mavlink2_header *)pbuf->data;
+        return hdr->msgid;
+    }
+
+    return ((const struct mavlink_router_mavlink1_header *)pbuf->data)->msgid;
+}
+
+static bool is_high_priority_msg(uint32_t msg_id)
+{
+    for (uint32_t id : radio_high_priority_msgs) {
+        if (id == msg_id)
+            return true;
+    }
+
+    return false;
+}
+
+void EndpointGroup::add_member(Endpoint *e)
+{
+    RouteCache::invalidate();
+    e->_group = this;
+    _members.push_back(e);
+    for (const auto &r : e->routes())
+        add_route(r.sys_comp_id);
+}
+
+void EndpointGroup::remove_member(Endpoint *e)
+{
+    RouteCache::invalidate();
+    _members.erase(std::remove(_members.begin(), _members.end(), e), _members.end());
+    e->_group = nullptr;
+    update_routes();
+}
+
+void EndpointGroup::update_routes()
+{
+    _routes.assign(_routes.size(), false);
+    for (auto *e : _members) {
+        for (const auto &r : e->routes())
+            add_route(r.sys_comp_id);
+    }
+}
+
 Endpoint::Endpoint(const std::string& name)
     : _name{name}
 {
@@ -60,6 +156,7 @@ Endpoint::~Endpoint()
 {
     free(rx_buf.data);
     free(tx_buf.data);
+    free(_shaper.queue.data);
     del_expire_timer();
 }
 
@@ -76,9 +173,40 @@ int Endpoint::handle_read()
     uint32_t msg_id;
     struct buffer buf{};
 
-    while ((r = read_msg(&buf, &target_sysid, &target_compid, &src_sysid, &src_compid, &msg_id)) > 0)
-        Mainloop::get_instance().route_msg(&buf, target_sysid, target_compid, src_sysid,
-                                           src_compid, msg_id);
+    while ((r = read_msg(&buf, &target_sysid, &target_compid, &src_sysid, &src_compid, &msg_id)) > 0) {
+        Mainloop &mainloop = Mainloop::get_instance();
+
+        if (!_src_allowed(src_sysid, src_compid)) {
+            _stat.read.src_rejected++;
+            continue;
+        }
+
+        if (!_rx_filter.empty() && (msg_id >= _rx_filter.size() || !_rx_filter[msg_id])) {
+            _stat.read.rx_filtered++;
+            continue;
+        }
+
+        switch (mainloop.check_duplicate(&buf, src_sysid, src_compid, msg_id)) {
+        case Dedup::PacketStatus::Duplicate:
+            _stat.read.duplicates++;
+            continue;
+        case Dedup::PacketStatus::New:
+            // This link delivered the packet before any other
+            _stat.read.first_arrivals++;
+            break;
+        case Dedup::PacketStatus::Disabled:
+            break;
+        }
+
+        if (mainloop.answer_from_cache(this, &buf, msg_id, src_sysid, src_compid, target_sysid,
+                                       target_compid))
+            continue;
+
+        mainloop.track_request(this, &buf, msg_id, src_sysid, target_sysid, target_compid);
+
+        mainloop.route_msg(&buf, target_sysid, target_compid, src_sysid, src_compid, msg_id,
+                           this);
+    }
 
     return r;
 }
@@ -228,8 +356,13 @@ int Endpoint::read_msg(struct buffer *pbuf, int *target_sysid, int *target_compi
             _stat.read.crc_error_bytes += expected_size;
             return 0;
         }
-        
-        _add_sys_comp_id(((uint16_t)*src_sysid << 8) | *src_compid);
+
+        // Don't learn routes to sources that are not allowed on this endpoint
+        if (_src_allowed(*src_sysid, *src_compid))
+            _add_sys_comp_id(((uint16_t)*src_sysid << 8) | *src_compid);
+
+        if (_radio.enabled && *msg_id == MAVLINK_MSG_ID_RADIO_STATUS)
+            _handle_radio_status(payload, payload_len);
     }
 
     _stat.read.handled++;
@@ -283,18 +416,28 @@ int Endpoint::read_msg(struct buffer *pbuf, int *target_sysid, int *target_compi
     return msg_entry != nullptr ? ReadOk : ReadUnkownMsg;
 }
 
-void Endpoint::_add_sys_comp_id(uint16_t sys_comp_id)
+void Endpoint::_add_sys_comp_id(uint16_t sys_comp_id, bool permanent)
 {
-    if (has_sys_comp_id(sys_comp_id))
-        return;
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+
+    for (auto &r : _routes) {
+        if (r.sys_comp_id == sys_comp_id) {
+            r.last_seen_ms = now_ms;
+            return;
+        }
+    }
 
-    _sys_comp_ids.push_back(sys_comp_id);
+    log_debug("%s: new route to %u/%u", _name.c_str(), sys_comp_id >> 8, sys_comp_id & 0xff);
+    _routes.push_back({sys_comp_id, permanent, now_ms});
+    RouteCache::invalidate();
+    if (_group)
+        _group->add_route(sys_comp_id);
 }
 
 bool Endpoint::has_sys_id(unsigned sysid)
 {
-    for (auto it = _sys_comp_ids.begin(); it != _sys_comp_ids.end(); it++) {
-        if (((*it >> 8) | (sysid & 0xff)) == sysid)
+    for (const auto &r : _routes) {
+        if ((r.sys_comp_id >> 8) == (sysid & 0xff))
             return true;
     }
     return false;
@@ -302,14 +445,42 @@ bool Endpoint::has_sys_id(unsigned sysid)
 
 bool Endpoint::has_sys_comp_id(unsigned sys_comp_id)
 {
-    for (auto it = _sys_comp_ids.begin(); it != _sys_comp_ids.end(); it++) {
-        if (sys_comp_id == *it)
+    for (const auto &r : _routes) {
+        if (sys_comp_id == r.sys_comp_id)
             return true;
     }
 
     return false;
 }
 
+void Endpoint::expire_routes(uint64_t now_ms, uint32_t ttl_ms,
+                             const std::map<uint16_t, uint64_t> &last_seen)
+{
+    for (auto it = _routes.begin(); it != _routes.end();) {
+        const auto newest = last_seen.find(it->sys_comp_id);
+        bool expired = false;
+
+        if (!it->permanent && ttl_ms > 0) {
+            if (now_ms - it->last_seen_ms > ttl_ms) {
+                log_debug("%s: route to %u/%u expired", _name.c_str(), it->sys_comp_id >> 8,
+                          it->sys_comp_id & 0xff);
+                expired = true;
+            } else if (newest != last_seen.end()
+                       && newest->second - it->last_seen_ms > ROUTE_MIGRATE_MSEC) {
+                log_debug("%s: route to %u/%u moved to another endpoint", _name.c_str(),
+                          it->sys_comp_id >> 8, it->sys_comp_id & 0xff);
+                expired = true;
+            }
+        }
+
+        if (expired) {
+            it = _routes.erase(it);
+            RouteCache::invalidate();
+        } else
+            it++;
+    }
+}
+
 bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid,
                           uint8_t src_compid, uint32_t msg_id)
 {
@@ -317,8 +488,8 @@ bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid
         log_debug("Endpoint [%d] got message to %d/%d from %u/%u", fd, target_sysid, target_compid,
                   src_sysid, src_compid);
         log_debug("\tKnown endpoints:");
-        for (auto it = _sys_comp_ids.begin(); it != _sys_comp_ids.end(); it++) {
-            log_debug("\t\t%u/%u", (*it >> 8), *it & 0xff);
+        for (const auto &r : _routes) {
+            log_debug("\t\t%u/%u", (r.sys_comp_id >> 8), r.sys_comp_id & 0xff);
         }
     }
 
@@ -335,9 +506,10 @@ bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid
         return false;
     }
 
-    // Message is broadcast on sysid: accept msg
+    // Message is broadcast on sysid: accept msg if subscribed to it
     if (target_sysid == 0 || target_sysid == -1)
-        return true;
+        return _subscriptions.empty() || msg_id == UINT32_MAX
+            || (msg_id < _subscriptions.size() && _subscriptions[msg_id]);
 
     // This endpoint has the target of message (sys and comp id): accept
     if (target_compid > 0 && has_sys_comp_id(target_sysid, target_compid))
@@ -351,6 +523,41 @@ bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid
     return false;
 }
 
+void Endpoint::set_subscriptions(const std::vector<uint32_t> &msg_ids)
+{
+    RouteCache::invalidate();
+    _subscriptions.clear();
+
+    for (uint32_t id : msg_ids) {
+        if (id >= _subscriptions.size())
+            _subscriptions.resize(id + 1);
+        _subscriptions[id] = true;
+    }
+}
+
+void Endpoint::set_rx_filter(const std::vector<uint32_t> &msg_ids)
+{
+    _rx_filter.clear();
+
+    for (uint32_t id : msg_ids) {
+        if (id >= _rx_filter.size())
+            _rx_filter.resize(id + 1);
+        _rx_filter[id] = true;
+    }
+}
+
+void Endpoint::set_src_filter(std::vector<bool> allow, std::vector<bool> deny)
+{
+    _allow_src = std::move(allow);
+    _deny_src = std::move(deny);
+}
+
+bool Endpoint::has_same_filters(const Endpoint &other) const
+{
+    return _message_filter == other._message_filter && _subscriptions == other._subscriptions
+        && _rule_mask == other._rule_mask;
+}
+
 void Endpoint::postprocess_msg(int target_sysid, int target_compid, uint8_t src_sysid,
                                uint8_t src_compid, uint32_t msg_id)
 {
@@ -398,6 +605,160 @@ bool Endpoint::_check_crc(const mavlink_msg_entry_t *msg_entry)
     return true;
 }
 
+void Endpoint::set_max_bitrate(unsigned long bitrate)
+{
+    if (bitrate == 0) {
+        return;
+    }
+
+    if (!_shaper.queue.data) {
+        _shaper.queue.data = (uint8_t *)malloc(SHAPER_QUEUE_MAX_SIZE);
+        assert(_shaper.queue.data);
+    }
+
+    _shaper_set_rate(std::max(bitrate / 8, 1UL));
+    _shaper.tokens = _shaper.burst;
+    _shaper.last_refill_us = now_usec();
+
+    log_info("Endpoint %s: shaping to %lu bps", _name.c_str(), bitrate);
+}
+
+void Endpoint::_shaper_set_rate(uint32_t rate)
+{
+    _shaper.rate = rate;
+    // Allow at least one full packet through, otherwise big packets would
+    // never be released on slow links
+    _shaper.burst = std::max(_shaper.rate * SHAPER_BURST_MSEC / MSEC_PER_SEC,
+                             (unsigned long long)MAVLINK_MAX_PACKET_LEN);
+    _shaper.tokens = std::min(_shaper.tokens, _shaper.burst);
+}
+
+void Endpoint::set_radio_link(bool enabled)
+{
+    _radio.enabled = enabled;
+    if (!enabled)
+        return;
+
+    if (!has_shaper())
+        set_max_bitrate(RADIO_DEFAULT_BITRATE);
+
+    _radio.max_rate = _shaper.rate;
+}
+
+void Endpoint::_handle_radio_status(const uint8_t *payload, uint8_t payload_len)
+{
+    mavlink_radio_status_t status{};
+    const uint32_t min_rate = std::max(_radio.max_rate / RADIO_MIN_RATE_DIVISOR, 1U);
+    uint32_t rate = _shaper.rate;
+
+    memcpy(&status, payload, std::min<size_t>(payload_len, sizeof(status)));
+    _radio.txbuf = status.txbuf;
+
+    /*
+     * Back off quickly when the radio buffer fills up and speed up slowly
+     * once it has drained, similar to what flight stacks do with their own
+     * stream rates
+     */
+    if (status.txbuf < RADIO_TXBUF_LOW)
+        rate = rate / 2;
+    else if (status.txbuf < RADIO_TXBUF_HIGH)
+        rate = rate - rate / 8;
+    else if (status.txbuf > RADIO_TXBUF_FREE)
+        rate = rate + _radio.max_rate / 16;
+
+    rate = std::max(std::min(rate, _radio.max_rate), min_rate);
+    if (rate != _shaper.rate) {
+        log_debug("%s: radio txbuf %u%%, pacing at %u bps", _name.c_str(), status.txbuf, rate * 8);
+        _shaper_set_rate(rate);
+    }
+
+    if (status.txbuf < RADIO_TXBUF_CRITICAL)
+        _radio.congested = true;
+    else if (status.txbuf >= RADIO_TXBUF_LOW)
+        _radio.congested = false;
+}
+
+void Endpoint::_shaper_refill()
+{
+    usec_t now = now_usec();
+    uint64_t tokens = (now - _shaper.last_refill_us) * _shaper.rate / USEC_PER_SEC;
+
+    if (tokens == 0)
+        return;
+
+    // Only account for the time actually converted into tokens so the
+    // fractional part is not lost between refills
+    _shaper.last_refill_us += tokens * USEC_PER_SEC / _shaper.rate;
+    _shaper.tokens = std::min<uint64_t>(_shaper.tokens + tokens, _shaper.burst);
+    if (_shaper.tokens == _shaper.burst)
+        _shaper.last_refill_us = now;
+}
+
+int Endpoint::write_shaped_msg(const struct buffer *pbuf)
+{
+    const uint16_t len = pbuf->len;
+
+    if (_radio.congested && !is_high_priority_msg(get_msg_id(pbuf))) {
+        _stat.write.radio_drops++;
+        return 0;
+    }
+
+    _shaper_refill();
+
+    if (_shaper.queue.len == 0 && _shaper.tokens >= len) {
+        int r = write_msg(pbuf);
+        if (r != -EAGAIN) {
+            _shaper.tokens -= len;
+            return r;
+        }
+    }
+
+    if (_shaper.queue.len + sizeof(len) + len > SHAPER_QUEUE_MAX_SIZE) {
+        _stat.write.shaper_drops++;
+        log_debug("%s: Dropping message, shaper queue full", _name.c_str());
+        return 0;
+    }
+
+    memcpy(&_shaper.queue.data[_shaper.queue.len], &len, sizeof(len));
+    memcpy(&_shaper.queue.data[_shaper.queue.len + sizeof(len)], pbuf->data, len);
+    _shaper.queue.len += sizeof(len) + len;
+    _stat.write.shaped++;
+
+    Mainloop::get_instance().start_shaper();
+
+    return len;
+}
+
+bool Endpoint::flush_shaped_msgs()
+{
+    unsigned int pos = 0;
+
+    if (_shaper.queue.len == 0)
+        return false;
+
+    _shaper_refill();
+
+    while (pos < _shaper.queue.len) {
+        uint16_t len;
+        memcpy(&len, &_shaper.queue.data[pos], sizeof(len));
+
+        if (_shaper.tokens < len)
+            break;
+
+        struct buffer buf = {len, &_shaper.queue.data[pos + sizeof(len)]};
+        if (write_msg(&buf) == -EAGAIN)
+            break;
+
+        _shaper.tokens -= len;
+        pos += sizeof(len) + len;
+    }
+
+    _shaper.queue.len -= pos;
+    memmove(_shaper.queue.data, &_shaper.queue.data[pos], _shaper.queue.len);
+
+    return _shaper.queue.len > 0;
+}
+
 void Endpoint::print_statistics()
 {
     const uint32_t read_total = _stat.read.total == 0 ? 1 : _stat.read.total;
@@ -413,9 +774,20 @@ void Endpoint::print_statistics()
            (_stat.read.drop_seq_total * 100) / read_total);
     printf(" Handled: %u %luKbps", _stat.read.handled, (_stat.read.handled_bytes - _stat.read.last_bytes) * 8 / time_ms);
     printf(" Total: %u", _stat.read.total);
+    if (_stat.read.duplicates || _stat.read.first_arrivals)
+        printf(" Duplicates: %u First: %u", _stat.read.duplicates, _stat.read.first_arrivals);
+    if (!_rx_filter.empty())
+        printf(" Filtered: %u", _stat.read.rx_filtered);
+    if (!_allow_src.empty() || !_deny_src.empty())
+        printf(" Rejected sources: %u", _stat.read.src_rejected);
     printf("}");
     printf(" TX {");
     printf("Total: %u %luKbps", _stat.write.total, (_stat.write.bytes - _stat.write.last_bytes) * 8 / time_ms);
+    if (has_shaper())
+        printf(" Shaped: %u Dropped: %u", _stat.write.shaped, _stat.write.shaper_drops);
+    if (_radio.enabled)
+        printf(" Radio {TX buffer: %u%% Rate: %ubps Dropped: %u}", _radio.txbuf, _shaper.rate * 8,
+               _stat.write.radio_drops);
     printf("}}\n");
 
     _stat.read.last_bytes = _stat.read.handled_bytes;
@@ -793,9 +1165,148 @@ void UdpEndpoint::set_coalescing(unsigned int bytes, unsigned int milliseconds)
     _max_timeout_ms = milliseconds;
 }
 
+/*
+ * Build a classic BPF program accepting UDP datagrams whose first MAVLink
+ * packet has one of @msg_ids. Offsets start at the UDP header. Datagrams
+ * not holding exactly one packet are accepted and left to the userspace
+ * filter. Return false if the jumps don't fit the 8-bit BPF offsets.
+ */
+static bool build_rx_bpf(const std::vector<uint32_t> &msg_ids, std::vector<struct sock_filter> &prog)
+{
+    enum { NEXT = 0, L_V2 = 0x100, L_REJECT, L_ACCEPT };
+    struct insn {
+        struct sock_filter f;
+        unsigned int jt, jf;
+    };
+    std::vector<struct insn> code;
+    const uint32_t h = 8; // UDP header
+    size_t v2_pos;
+
+    auto stmt = [&code](uint16_t op, uint32_t k) {
+        code.push_back({BPF_STMT(op, k), NEXT, NEXT});
+    };
+    auto jump = [&code](uint16_t op, uint32_t k, unsigned int jt, unsigned int jf) {
+        code.push_back({BPF_JUMP(op, k, 0, 0), jt, jf});
+    };
+
+    stmt(BPF_LD | BPF_B | BPF_ABS, h);
+    jump(BPF_JMP | BPF_JEQ | BPF_K, MAVLINK_STX_MAVLINK1, NEXT, L_V2);
+
+    // MAVLink 1: stx, len, seq, sysid, compid, msgid, payload, crc
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 1);
+    stmt(BPF_ALU | BPF_ADD | BPF_K, h + 8);
+    stmt(BPF_MISC | BPF_TAX, 0);
+    stmt(BPF_LD | BPF_W | BPF_LEN, 0);
+    jump(BPF_JMP | BPF_JEQ | BPF_X, 0, NEXT, L_ACCEPT);
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 5);
+    for (uint32_t id : msg_ids) {
+        if (id <= UINT8_MAX)
+            jump(BPF_JMP | BPF_JEQ | BPF_K, id, L_ACCEPT, NEXT);
+    }
+    jump(BPF_JMP | BPF_JA, 0, L_REJECT, L_REJECT);
+
+    // MAVLink 2: stx, len, incompat, compat, seq, sysid, compid, msgid[3], payload, crc, signature
+    v2_pos = code.size();
+    jump(BPF_JMP | BPF_JEQ | BPF_K, MAVLINK_STX, NEXT, L_REJECT);
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 1);
+    stmt(BPF_ALU | BPF_ADD | BPF_K, h + 12);
+    stmt(BPF_ST, 0);
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 2);
+    jump(BPF_JMP | BPF_JSET | BPF_K, MAVLINK_IFLAG_SIGNED, NEXT, 3);
+    stmt(BPF_LD | BPF_MEM, 0);
+    stmt(BPF_ALU | BPF_ADD | BPF_K, MAVLINK_SIGNATURE_BLOCK_LEN);
+    stmt(BPF_ST, 0);
+    stmt(BPF_LDX | BPF_MEM, 0);
+    stmt(BPF_LD | BPF_W | BPF_LEN, 0);
+    jump(BPF_JMP | BPF_JEQ | BPF_X, 0, NEXT, L_ACCEPT);
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 8);
+    stmt(BPF_ALU | BPF_LSH | BPF_K, 8);
+    stmt(BPF_MISC | BPF_TAX, 0);
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 7);
+    stmt(BPF_ALU | BPF_OR | BPF_X, 0);
+    stmt(BPF_ST, 1);
+    stmt(BPF_LD | BPF_B | BPF_ABS, h + 9);
+    stmt(BPF_ALU | BPF_LSH | BPF_K, 16);
+    stmt(BPF_MISC | BPF_TAX, 0);
+    stmt(BPF_LD | BPF_MEM, 1);
+    stmt(BPF_ALU | BPF_OR | BPF_X, 0);
+    for (uint32_t id : msg_ids)
+        jump(BPF_JMP | BPF_JEQ | BPF_K, id, L_ACCEPT, NEXT);
+
+    size_t reject_pos = code.size();
+    stmt(BPF_RET | BPF_K, 0);
+    size_t accept_pos = code.size();
+    stmt(BPF_RET | BPF_K, UINT32_MAX);
+
+    prog.clear();
+    for (size_t i = 0; i < code.size(); i++) {
+        struct sock_filter f = code[i].f;
+        unsigned int *labels[] = {&code[i].jt, &code[i].jf};
+        uint32_t offsets[2];
+
+        for (int j = 0; j < 2; j++) {
+            size_t target;
+
+            switch (*labels[j]) {
+            case L_V2:
+                target = v2_pos;
+                break;
+            case L_REJECT:
+                target = reject_pos;
+                break;
+            case L_ACCEPT:
+                target = accept_pos;
+                break;
+            default:
+                offsets[j] = *labels[j];
+                continue;
+            }
+            offsets[j] = target - i - 1;
+        }
+
+        if (f.code == (BPF_JMP | BPF_JA)) {
+            f.k = offsets[0];
+        } else if (BPF_CLASS(f.code) == BPF_JMP) {
+            if (offsets[0] > UINT8_MAX || offsets[1] > UINT8_MAX)
+                return false;
+            f.jt = offsets[0];
+            f.jf = offsets[1];
+        }
+        prog.push_back(f);
+    }
+
+    return true;
+}
+
+void UdpEndpoint::set_rx_filter(const std::vector<uint32_t> &msg_ids)
+{
+    std::vector<struct sock_filter> prog;
+    struct sock_fprog fprog;
+
+    Endpoint::set_rx_filter(msg_ids);
+
+    if (msg_ids.empty()) {
+        setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, nullptr, 0);
+        return;
+    }
+
+    if (!build_rx_bpf(msg_ids, prog)) {
+        log_warning("%s: Too many msg ids to filter in kernel, filtering in userspace only",
+                    _name.c_str());
+        return;
+    }
+
+    fprog.len = prog.size();
+    fprog.filter = prog.data();
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+        log_warning("%s: Could not attach socket filter (%m), filtering in userspace only",
+                    _name.c_str());
+}
+
 ssize_t UdpEndpoint::_read_msg(uint8_t *buf, size_t len)
 {
     socklen_t addrlen = sizeof(sockaddr);
+    const struct sockaddr_in prev_sockaddr = sockaddr;
     ssize_t r = ::recvfrom(fd, buf, len, 0,
                            (struct sockaddr *)&sockaddr, &addrlen);
     if (r == -1 && errno == EAGAIN)
@@ -803,6 +1314,16 @@ ssize_t UdpEndpoint::_read_msg(uint8_t *buf, size_t len)
     if (r == -1)
         return -errno;
 
+    // New client sending to our port. Several clients sharing it would make
+    // the address change on every message, so only replay the snapshot once
+    // the previous one went silent.
+    const uint64_t now = now_usec();
+    if ((sockaddr.sin_port != prev_sockaddr.sin_port
+         || sockaddr.sin_addr.s_addr != prev_sockaddr.sin_addr.s_addr)
+        && (_last_rx_usec == 0 || now - _last_rx_usec >= SNAPSHOT_SILENCE_MSEC * USEC_PER_MSEC))
+        Mainloop::get_instance().send_snapshot(this);
+    _last_rx_usec = now;
+
     return r;
 }
 
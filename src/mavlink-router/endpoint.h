@@ -18,13 +18,16 @@
 #pragma once
 
 #include <common/mavlink.h>
+#include <string.h>
 
 #include <chrono>
+#include <map>
 #include <memory>
 #include <vector>
 
 #include "comm.h"
 #include "pollable.h"
+#include "routecache.h"
 #include "timeout.h"
 
 class Mainloop;
@@ -66,6 +69,67 @@ struct _packed_ mavlink_router_mavlink1_header {
     uint8_t msgid;
 };
 
+/*
+ * Copy payload of MAVLink 1 or 2 packet in @buf to message struct @msg.
+ * Fields trimmed from MAVLink 2 payloads are left zeroed.
+ */
+template <typename T>
+static inline void decode_mavlink_payload(const struct buffer *buf, T *msg)
+{
+    const uint8_t *payload;
+    size_t payload_len;
+
+    if (buf->data[0] == MAVLINK_STX) {
+        payload_len = ((const struct mavlink_router_mavlink2_header *)buf->data)->payload_len;
+        payload = buf->data + sizeof(struct mavlink_router_mavlink2_header);
+    } else {
+        payload_len = ((const struct mavlink_router_mavlink1_header *)buf->data)->payload_len;
+        payload = buf->data + sizeof(struct mavlink_router_mavlink1_header);
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    memcpy(msg, payload, payload_len < sizeof(*msg) ? payload_len : sizeof(*msg));
+}
+
+class Endpoint;
+
+/*
+ * Endpoints sharing the same filters and routing rules. Broadcast messages
+ * are checked once against the first member and then written to all of
+ * them, unless one of the members is the source of the message.
+ */
+class EndpointGroup {
+public:
+    explicit EndpointGroup(const std::string &name)
+        : _name{name}
+        , _routes(UINT16_MAX + 1)
+    {
+    }
+
+    const std::string &name() const { return _name; }
+    const std::vector<Endpoint *> &members() const { return _members; }
+
+    void add_member(Endpoint *e);
+    void remove_member(Endpoint *e);
+
+    /*
+     * Whether a route to the source was learned by any member
+     */
+    bool has_route(uint8_t sysid, uint8_t compid) const { return _routes[sysid << 8 | compid]; }
+    void add_route(uint16_t sys_comp_id) { _routes[sys_comp_id] = true; }
+
+    /*
+     * Rebuild the learned routes from members, after some of them expired
+     */
+    void update_routes();
+
+private:
+    std::string _name;
+    std::vector<Endpoint *> _members;
+    // Union of the routes of members, indexed by sysid << 8 | compid
+    std::vector<bool> _routes;
+};
+
 class Endpoint : public Pollable {
 public:
     /*
@@ -79,6 +143,8 @@ public:
     Endpoint(const std::string& name);
     virtual ~Endpoint();
 
+    const std::string &name() const { return _name; }
+
     int handle_read() override;
     bool handle_canwrite() override;
 
@@ -86,8 +152,81 @@ public:
     virtual int write_msg(const struct buffer *pbuf) = 0;
     virtual int flush_pending_msgs() = 0;
 
+    /*
+     * Limit the rate this endpoint is written to, in bits per second. A
+     * value of 0 disables shaping. Messages exceeding the rate are held in
+     * a queue and released by the mainloop shaper timer.
+     */
+    void set_max_bitrate(unsigned long bitrate);
+    bool has_shaper() const { return _shaper.rate > 0; }
+    // Current shaping rate in bits per second, lowered by RadioLink pacing
+    unsigned long bitrate() const { return _shaper.rate * 8UL; }
+    bool has_shaped_msgs() const { return _shaper.queue.len > 0; }
+
+    /*
+     * Mark endpoint as a telemetry radio link: RADIO_STATUS messages received
+     * on it drive the shaper rate (up to the configured max bitrate) and, when
+     * the radio TX buffer is almost full, low priority telemetry is dropped.
+     */
+    void set_radio_link(bool enabled);
+
+    /*
+     * Write @pbuf if the token bucket allows it, otherwise queue it. Messages
+     * are dropped if the queue is full.
+     */
+    int write_shaped_msg(const struct buffer *pbuf);
+
+    /*
+     * Write queued messages allowed by the token bucket. Return true if
+     * there are still messages waiting.
+     */
+    bool flush_shaped_msgs();
+
     void log_aggregate(unsigned int interval_sec);
 
+    /*
+     * Only deliver broadcast messages with these ids. Messages targeted at
+     * systems on this endpoint are always delivered. An empty list delivers
+     * every message.
+     */
+    void set_subscriptions(const std::vector<uint32_t> &msg_ids);
+
+    /*
+     * Only route received messages with these ids, everything else is
+     * discarded right after parsing. An empty list accepts every message.
+     */
+    virtual void set_rx_filter(const std::vector<uint32_t> &msg_ids);
+
+    /*
+     * Restrict the sources (sysid << 8 | compid) of messages accepted from
+     * this endpoint. Messages routed to it are not affected. Each bitmap is indexed by source and is
+     * either empty (no restriction) or has 65536 entries.
+     */
+    void set_src_filter(std::vector<bool> allow, std::vector<bool> deny);
+
+    /*
+     * Mask identifying this endpoint in routing rules, 0 if no rule names it
+     */
+    void set_rule_mask(uint64_t mask)
+    {
+        _rule_mask = mask;
+        RouteCache::invalidate();
+    }
+    uint64_t rule_mask() const { return _rule_mask; }
+
+    EndpointGroup *group() const { return _group; }
+
+    /*
+     * Position of the endpoint in the mainloop route cache bitmasks
+     */
+    unsigned int cache_index = 0;
+
+    /*
+     * Whether @other accepts the same messages as this endpoint, apart from
+     * the ones targeted at routes learned by each of them
+     */
+    bool has_same_filters(const Endpoint &other) const;
+
     uint8_t get_trimmed_zeros(const mavlink_msg_entry_t *msg_entry, const struct buffer *buffer);
 
     bool has_sys_id(unsigned sysid);
@@ -97,10 +236,37 @@ public:
         return has_sys_comp_id(sys_comp_id);
     }
 
+    /*
+     * Route to a system/component learned from messages received on this
+     * endpoint. Permanent routes belong to the endpoint itself and never
+     * expire.
+     */
+    struct route {
+        uint16_t sys_comp_id;
+        bool permanent;
+        uint64_t last_seen_ms;
+    };
+
+    const std::vector<struct route> &routes() const { return _routes; }
+
+    /*
+     * Remove routes not seen for more than @ttl_ms and routes that migrated
+     * to another endpoint, i.e. the same system/component was seen
+     * elsewhere a while after it was last seen here. @last_seen holds the
+     * most recent time of each route among all endpoints. Routes are kept
+     * forever if @ttl_ms is 0.
+     */
+    void expire_routes(uint64_t now_ms, uint32_t ttl_ms,
+                       const std::map<uint16_t, uint64_t> &last_seen);
+
     bool accept_msg(int target_sysid, int target_compid, uint8_t src_sysid, uint8_t src_compid, uint32_t msg_id);
     void postprocess_msg(int target_sysid, int target_compid, uint8_t src_sysid, uint8_t src_compid, uint32_t msg_id);
 
-    void add_message_to_filter(uint32_t msg_id) { _message_filter.push_back(msg_id); }
+    void add_message_to_filter(uint32_t msg_id)
+    {
+        _message_filter.push_back(msg_id);
+        RouteCache::invalidate();
+    }
     void add_message_to_nodelay(uint32_t msg_id) { _message_nodelay.push_back(msg_id); }
 
     void start_expire_timer();
@@ -117,7 +283,7 @@ protected:
                          uint8_t *src_sysid, uint8_t *src_compid, uint32_t *msg_id);
     virtual ssize_t _read_msg(uint8_t *buf, size_t len) = 0;
     bool _check_crc(const mavlink_msg_entry_t *msg_entry);
-    void _add_sys_comp_id(uint16_t sys_comp_id);
+    void _add_sys_comp_id(uint16_t sys_comp_id, bool permanent = false);
 
     std::string _name;
     size_t _last_packet_len = 0;
@@ -133,22 +299,66 @@ protected:
             uint32_t crc_error = 0;
             uint32_t handled = 0;
             uint32_t drop_seq_total = 0;
+            uint32_t duplicates = 0;
+            uint32_t first_arrivals = 0;
+            uint32_t rx_filtered = 0;
+            uint32_t src_rejected = 0;
             uint8_t expected_seq = 0;
         } read;
         struct {
             uint64_t bytes = 0;
             uint32_t total = 0;
             uint32_t last_bytes = 0;
+            uint32_t shaped = 0;
+            uint32_t shaper_drops = 0;
+            uint32_t radio_drops = 0;
         } write;
     } _stat;
 
     uint32_t _incomplete_msgs = 0;
-    std::vector<uint16_t> _sys_comp_ids;
+    std::vector<struct route> _routes;
+
+    friend class EndpointGroup;
+    EndpointGroup *_group = nullptr;
 
 private:
     Timeout* _expire_timer = nullptr;
     std::vector<uint32_t> _message_filter;
     std::vector<uint32_t> _message_nodelay;
+    // Indexed by msg id, empty if not subscribed
+    std::vector<bool> _subscriptions;
+    // Indexed by msg id, empty if not filtering received messages
+    std::vector<bool> _rx_filter;
+    uint64_t _rule_mask = 0;
+    // Indexed by sysid << 8 | compid, empty if not restricted
+    std::vector<bool> _allow_src;
+    std::vector<bool> _deny_src;
+
+    // Token bucket, in bytes
+    struct {
+        uint32_t rate = 0;
+        uint32_t burst = 0;
+        uint32_t tokens = 0;
+        uint64_t last_refill_us = 0;
+        struct buffer queue {};
+    } _shaper;
+
+    struct {
+        bool enabled = false;
+        bool congested = false;
+        uint8_t txbuf = 100;
+        uint32_t max_rate = 0;
+    } _radio;
+
+    bool _src_allowed(uint8_t sysid, uint8_t compid) const
+    {
+        const uint16_t id = ((uint16_t)sysid << 8) | compid;
+        return (_allow_src.empty() || _allow_src[id]) && (_deny_src.empty() || !_deny_src[id]);
+    }
+
+    void _shaper_refill();
+    void _shaper_set_rate(uint32_t rate);
+    void _handle_radio_status(const uint8_t *payload, uint8_t payload_len);
 };
 
 class UartEndpoint : public Endpoint {
@@ -192,6 +402,13 @@ public:
 
     void set_coalescing(unsigned int bytes, unsigned int milliseconds);
 
+    /*
+     * Besides the userspace check, attach a classic BPF program to the
+     * socket so datagrams with other msg ids are dropped by the kernel
+     * before being copied to mavlink-router.
+     */
+    void set_rx_filter(const std::vector<uint32_t> &msg_ids) override;
+
     struct sockaddr_in sockaddr;
 
 protected:
@@ -201,6 +418,7 @@ protected:
 
     Timeout* _write_schedule_timer = nullptr;
     unsigned int _max_packet_size, _max_timeout_ms;
+    uint64_t _last_rx_usec = 0;
 
     ssize_t _read_msg(uint8_t *buf, size_t len) override;
 };
@@ -19,6 +19,7 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,7 +33,6 @@
 #include <algorithm>
 #include <map>
 #include <memory>
-#include <tuple>
 #include <vector>
 
 #include <common/log.h>
@@ -52,19 +52,11 @@ LogEndpoint::LogEndpoint(const char *name, const char *logs_dir, LogMode mode,
     , _mode(mode)
 {
     assert(_logs_dir);
-    _add_sys_comp_id(LOG_ENDPOINT_SYSTEM_ID << 8);
+    _add_sys_comp_id(LOG_ENDPOINT_SYSTEM_ID << 8, true);
 
     if (heartbeat) {
         _start_heartbeat();
     }
-
-    _fsync_cb.aio_fildes = -1;
-
-    aioinit aio_init_data {};
-    aio_init_data.aio_threads = 1;
-    aio_init_data.aio_num = 1;
-    aio_init_data.aio_idle_time = 3; // make sure to keep the thread running
-    aio_init(&aio_init_data);
 }
 
 bool LogEndpoint::_broadcast_log_heartbeat() {
@@ -100,35 +92,36 @@ void LogEndpoint::_send_msg(const mavlink_message_t *msg, int target_sysid)
 
 void LogEndpoint::mark_unfinished_logs()
 {
-    DIR *dir = opendir(_logs_dir);
-
-    // Assume the directory does not exist if opendir failed
-    if (!dir) {
+    // Assume the directory does not exist if it can't be indexed
+    if (_index.refresh(_logs_dir) < 0)
         return;
-    }
-
-    struct dirent *ent;
-    uint32_t u;
 
-    while ((ent = readdir(dir)) != nullptr) {
-        if (sscanf(ent->d_name, "%u-", &u) != 1)
-            continue;
+    std::vector<uint32_t> unfinished;
+    for (const auto &f : _index.files()) {
+        if (!f.second.finished)
+            unfinished.push_back(f.first);
+    }
 
+    for (uint32_t prefix : unfinished) {
+        const std::string &name = _index.files().at(prefix).name;
         char log_file[PATH_MAX];
         struct stat file_stat;
-        if (snprintf(log_file, sizeof(log_file), "%s/%s", _logs_dir, ent->d_name)
+        if (snprintf(log_file, sizeof(log_file), "%s/%s", _logs_dir, name.c_str())
             >= (int)sizeof(log_file))
             continue;
 
-        if (stat(log_file, &file_stat))
+        if (stat(log_file, &file_stat)) {
+            _index.remove(prefix);
             continue;
+        }
 
-        if (S_ISREG(file_stat.st_mode) && (file_stat.st_mode & S_IWUSR)) {
-            log_info("File %s not read-only yet, marking as RO", ent->d_name);
+        if (file_stat.st_mode & S_IWUSR) {
+            log_info("File %s not read-only yet, marking as RO", name.c_str());
             chmod(log_file, S_IRUSR | S_IRGRP | S_IROTH);
         }
+        _index.set_finished(prefix, file_stat.st_size);
     }
-    closedir(dir);
+    _index.commit();
 }
 
 void LogEndpoint::_delete_old_logs()
@@ -150,105 +143,62 @@ void LogEndpoint::_delete_old_logs()
         return;
     }
 
-    DIR *dir = opendir(_logs_dir);
-
-    // Assume the directory does not exist if opendir failed
-    if (!dir) {
+    // Assume the directory does not exist if it can't be indexed
+    if (_index.refresh(_logs_dir) < 0) {
         return;
     }
 
-    int dir_fd = dirfd(dir);
-    if (dir_fd < 0) {
-        closedir(dir);
-        log_error("[Log Deletion] Error getting dir file descriptor: %m");
-        return;
-    }
-
-    // Map of index -> (filename, file size)
-    // All three of these values are saved for later to reduce the amount of IO operations needed.
-    std::map<unsigned long, std::tuple<std::string, unsigned long>> file_map;
-
-    struct dirent *ent;
-    uint32_t idx, year, month, day, hour, minute, second;
-
-    // This loop just gathers the name, index, and size of each read-only file in the log dir
-    while ((ent = readdir(dir)) != nullptr) {
-        // Even though we don't need the timestamp, we want to match as much of the filename as
-        // possible, so we don't accidentally delete something that isn't a log.
-        if (sscanf(ent->d_name, "%u-%u-%u-%u_%u-%u-%u.", &idx, &year, &month, &day, &hour, &minute,
-                   &second)
-            == 7) {
-            struct stat file_stat;
-            if (!fstatat(dir_fd, ent->d_name, &file_stat, 0)) {
-                // Only bother with read-only files. If this function is somehow called while a file
-                // is still being used (not read-only), it should not be deleted.
-                if (!S_ISDIR(file_stat.st_mode) && !(file_stat.st_mode & S_IWUSR)) {
-                    std::string str(ent->d_name);
-                    file_map[idx] = std::make_tuple(str, file_stat.st_size);
-                }
-            }
-        }
-    }
-
     // If the configured value for _min_free_space is 0, then we don't have to do anything special.
     int64_t bytes_to_delete = _min_free_space - free_space;
     // If the configured value for _max_files is 0, then set this to -1 to indicate that we've
     // already deleted enough files.
-    ssize_t files_to_delete = _max_files > 0 ? (ssize_t)file_map.size() - _max_files : -1;
+    ssize_t files_to_delete = _max_files > 0 ? (ssize_t)_index.finished_count() - _max_files : -1;
 
     log_debug("[Log Deletion] Files to delete: %zd", files_to_delete);
 
     // Delete the logs in order until there's enough free space, and few enough files
     // It is possible for this loop to run only once and return immediately, if we don't actually
-    // need to delete any files. Maps in C++ are ordered by the keys, so this iteration is
-    // guaranteed to happen in index order (oldest -> newest)
-    for (auto &pair : file_map) {
+    // need to delete any files. The index is ordered by prefix, so this iteration is guaranteed
+    // to happen in index order (oldest -> newest). Only bother with read-only files: if this
+    // function is somehow called while a file is still being used, it should not be deleted.
+    const std::map<uint32_t, LogIndex::log_file> &files = _index.files();
+    for (auto it = files.begin(); it != files.end();) {
         if (bytes_to_delete <= 0 && files_to_delete <= 0) {
             break;
         }
 
-        std::string &filename = std::get<0>(pair.second);
-        const unsigned long filesize = std::get<1>(pair.second);
+        // Removing the file from the index doesn't invalidate the next one
+        const uint32_t prefix = it->first;
+        const LogIndex::log_file &file = (it++)->second;
+        if (!file.finished) {
+            continue;
+        }
+
         char log_file[PATH_MAX];
-        if (snprintf(log_file, sizeof(log_file), "%s/%s", _logs_dir, filename.c_str())
+        if (snprintf(log_file, sizeof(log_file), "%s/%s", _logs_dir, file.name.c_str())
             >= (int)sizeof(log_file)) {
-            log_error("Directory + filename %s is longer than PATH_MAX of %d", filename.c_str(),
+            log_error("Directory + filename %s is longer than PATH_MAX of %d", file.name.c_str(),
                       PATH_MAX);
             continue;
         }
 
         int err_code = remove(log_file);
-        if (err_code == 0) {
-            bytes_to_delete -= filesize;
+        if (err_code == 0 || errno == ENOENT) {
+            bytes_to_delete -= file.size;
             files_to_delete--;
-            log_info("[Log Deletion] Deleted old logfile %s", filename.c_str());
+            log_info("[Log Deletion] Deleted old logfile %s", file.name.c_str());
+            _index.remove(prefix);
         } else {
-            log_error("[Log Deletion] Error deleting old logfile %s: %m", filename.c_str());
+            log_error("[Log Deletion] Error deleting old logfile %s: %m", file.name.c_str());
         }
     }
 
+    _index.commit();
+
     if (bytes_to_delete > 0) {
         log_error(
             "[Log Deletion] Deleted all closed logs, but there is still not enough free space.");
     }
-
-    closedir(dir);
-}
-
-uint32_t LogEndpoint::_get_prefix(DIR *dir)
-{
-    struct dirent *ent;
-    uint32_t u, prefix = 0;
-
-    while ((ent = readdir(dir)) != nullptr) {
-        if (sscanf(ent->d_name, "%u-", &u) == 1) {
-            if (u >= prefix && u < UINT32_MAX) {
-                prefix = ++u;
-            }
-        }
-    }
-
-    return prefix;
 }
 
 DIR *LogEndpoint::_open_or_create_dir(const char *name)
@@ -286,7 +236,11 @@ int LogEndpoint::_get_file(const char *extension)
     // Close dir when leaving function.
     std::shared_ptr<void> defer(dir, [](DIR *p) { closedir(p); });
 
-    i = _get_prefix(dir);
+    if (_index.refresh(_logs_dir) < 0) {
+        log_error("Could not index log dir (%m)");
+        return -1;
+    }
+    i = _index.next_prefix();
     dir_fd = dirfd(dir);
 
     for (j = 0; j <= MAX_RETRIES; j++) {
@@ -313,6 +267,10 @@ int LogEndpoint::_get_file(const char *extension)
             log_error("fsync failed: %m");
         }
 
+        _file_prefix = i + j;
+        _index.add(_file_prefix, _filename);
+        _index.commit();
+
         return r;
     }
 
@@ -338,21 +296,34 @@ void LogEndpoint::stop()
         _alive_check_timeout = nullptr;
     }
 
-    if (_fsync_timeout) {
-        mainloop.del_timeout(_fsync_timeout);
-        _fsync_timeout = nullptr;
+    if (_flush_timeout) {
+        mainloop.del_timeout(_flush_timeout);
+        _flush_timeout = nullptr;
     }
 
-    fsync(_file);
+    // Wait for queued data to be written
+    _writer.close();
+    if (_writer.get_error())
+        log_error("Log file %s is incomplete, some data could not be written", _filename);
+
+    const LogWriter::sync_stats sync = _writer.get_sync_stats();
+    if (sync.count)
+        log_info("Log file %s synced %u times, avg %" PRIu64 "us max %" PRIu64 "us", _filename,
+                 sync.count, sync.total_us / sync.count, sync.max_us);
+
+    struct stat file_stat;
+    if (fstat(_file, &file_stat) < 0)
+        file_stat.st_size = 0;
     close(_file);
     _file = -1;
-    _fsync_cb.aio_fildes = -1;
 
     // change file permissions to read-only to mark them as finished
     char log_file[PATH_MAX];
     if (snprintf(log_file, sizeof(log_file), "%s/%s", _logs_dir, _filename) < (int)sizeof(log_file)) {
         chmod(log_file, S_IRUSR|S_IRGRP|S_IROTH);
     }
+    _index.set_finished(_file_prefix, file_stat.st_size);
+    _index.commit();
 
     _logging_stop_timeout = Mainloop::get_instance().add_timeout(
         MSEC_PER_SEC, std::bind(&LogEndpoint::_stop_timeout, this), this);
@@ -389,6 +360,12 @@ bool LogEndpoint::start()
         return false;
     }
 
+    if (_writer.open(_file, _storage) < 0) {
+        close(_file);
+        _file = -1;
+        return false;
+    }
+
     _logging_start_timeout = Mainloop::get_instance().add_timeout(
         MSEC_PER_SEC, std::bind(&LogEndpoint::_start_timeout, this), this);
     if (!_logging_start_timeout) {
@@ -396,10 +373,11 @@ bool LogEndpoint::start()
         goto timeout_error;
     }
 
-    // Call fsync once per second
-    _fsync_timeout = Mainloop::get_instance().add_timeout(
-        MSEC_PER_SEC, std::bind(&LogEndpoint::_fsync, this), this);
-    if (!_fsync_timeout) {
+    // Hand data over to the writer thread at least as often as it's synced
+    _flush_timeout = Mainloop::get_instance().add_timeout(
+        _storage.sync_interval ? std::min<unsigned long>(_storage.sync_interval, MSEC_PER_SEC) : MSEC_PER_SEC,
+        std::bind(&LogEndpoint::_flush, this), this);
+    if (!_flush_timeout) {
         log_error("Unable to add timeout");
         goto timeout_error;
     }
@@ -413,10 +391,11 @@ bool LogEndpoint::start()
 
 timeout_error:
     if (_logging_start_timeout) {
-        Mainloop::get_instance().del_timeout(_fsync_timeout);
-        _fsync_timeout = nullptr;
+        Mainloop::get_instance().del_timeout(_flush_timeout);
+        _flush_timeout = nullptr;
     }
 
+    _writer.close();
     close(_file);
     _file = -1;
     return false;
@@ -434,20 +413,34 @@ bool LogEndpoint::_alive_timeout()
     return true;
 }
 
-bool LogEndpoint::_fsync()
+void LogEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+
+    if (_file < 0)
+        return;
+
+    const LogWriter::sync_stats sync = _writer.get_sync_stats();
+    printf("EP %s Sync {Total: %u Avg: %" PRIu64 "us Max: %" PRIu64 "us}\n", _name.c_str(),
+           sync.count, sync.count ? sync.total_us / sync.count : 0, sync.max_us);
+}
+
+bool LogEndpoint::_flush()
 {
     if (_file < 0) {
         return false;
     }
 
-    if (_fsync_cb.aio_fildes >= 0 && aio_error(&_fsync_cb) == EINPROGRESS) {
-        // previous operation is still in progress
-        return true;
+    const int err = _writer.get_error();
+    if (err) {
+        log_error("Unable to write to log file %s (%s), restarting log...", _filename,
+                  strerror(err));
+        stop();
+        start();
+        return false;
     }
-    _fsync_cb.aio_fildes = _file;
-    _fsync_cb.aio_sigevent.sigev_notify = SIGEV_NONE;
 
-    aio_fsync(O_SYNC, &_fsync_cb);
+    _writer.flush();
 
     return true;
 }
@@ -17,11 +17,12 @@
  */
 #pragma once
 
-#include <aio.h>
 #include <assert.h>
 #include <dirent.h>
 
 #include "endpoint.h"
+#include "logindex.h"
+#include "logwriter.h"
 #include "timeout.h"
 
 #define LOG_ENDPOINT_SYSTEM_ID 2
@@ -43,8 +44,12 @@ public:
     virtual bool start();
     virtual void stop();
 
+    void print_statistics() override;
+
     bool has_active_stop_timeout() { return _logging_stop_timeout != nullptr; }
 
+    void set_storage_options(const struct log_storage_options &storage) { _storage = storage; }
+
     /**
      * Check existing log files and mark logs as read-only if needed.
      * This handles the case where the system (or mavlink-router) crashed or
@@ -56,16 +61,17 @@ protected:
     const char *_logs_dir;
     int _target_system_id = -1;
     int _file = -1;
+    LogWriter _writer;
+    struct log_storage_options _storage = {};
     unsigned long _min_free_space;
     unsigned long _max_files;
     LogMode _mode;
 
     Timeout *_logging_start_timeout = nullptr;
     Timeout *_logging_stop_timeout = nullptr;
-    Timeout *_fsync_timeout = nullptr;
+    Timeout *_flush_timeout = nullptr;
     Timeout *_alive_check_timeout = nullptr;
     uint32_t _timeout_write_total = 0;
-    aiocb _fsync_cb = {};
 
     /* heartbeat components */
     uint8_t _system_status = MAV_STATE_STANDBY;
@@ -84,14 +90,13 @@ protected:
     virtual bool _stop_timeout() = 0;
     virtual bool _alive_timeout();
 
-    bool _fsync();
+    bool _flush();
 
     void _handle_auto_start_stop(uint32_t msg_id, uint8_t source_system_id,
             uint8_t source_component_id, uint8_t *payload);
 
 private:
     int _get_file(const char *extension);
-    uint32_t _get_prefix(DIR *dir);
     DIR *_open_or_create_dir(const char *name);
 
     /**
@@ -101,4 +106,6 @@ private:
     void _delete_old_logs();
 
     char _filename[64];
+    uint32_t _file_prefix = 0;
+    LogIndex _index;
 };
@@ -0,0 +1,329 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "logindex.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <common/log.h>
+
+#define LOG_INDEX_FILENAME ".log_index"
+#define LOG_INDEX_MAGIC 0x58444E49 // "INDX"
+#define LOG_INDEX_VERSION 1
+#define LOG_INDEX_NAME_LEN 48
+
+#define LOG_INDEX_USED (1 << 0)
+#define LOG_INDEX_FINISHED (1 << 1)
+
+struct log_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t next_prefix;
+    uint32_t slot_count;
+    int64_t dir_mtime_sec;
+    int64_t dir_mtime_nsec;
+};
+
+struct log_index_record {
+    uint32_t prefix;
+    uint32_t flags;
+    uint64_t size;
+    char name[LOG_INDEX_NAME_LEN];
+};
+
+LogIndex::~LogIndex()
+{
+    commit();
+    _close();
+}
+
+void LogIndex::_close()
+{
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+    _valid = false;
+    _dirty = false;
+    _files.clear();
+    _slots.clear();
+    _free_slots.clear();
+    _slot_count = 0;
+    _next_prefix = 0;
+    _finished_count = 0;
+}
+
+int LogIndex::_get_dir_mtime(struct timespec *mtime) const
+{
+    struct stat st;
+
+    if (stat(_dir.c_str(), &st) < 0)
+        return -errno;
+
+    *mtime = st.st_mtim;
+    return 0;
+}
+
+int LogIndex::refresh(const char *logs_dir)
+{
+    struct timespec mtime;
+    int r;
+
+    if (_dir != logs_dir) {
+        _close();
+        _dir = logs_dir;
+    }
+
+    r = _get_dir_mtime(&mtime);
+    if (r < 0) {
+        _close();
+        return r;
+    }
+
+    if (!_valid && !_load())
+        return _rebuild();
+
+    if (mtime.tv_sec != _dir_mtime.tv_sec || mtime.tv_nsec != _dir_mtime.tv_nsec) {
+        log_info("Log directory %s changed, rebuilding its index", logs_dir);
+        return _rebuild();
+    }
+
+    return 0;
+}
+
+bool LogIndex::_load()
+{
+    const std::string path = _dir + "/" LOG_INDEX_FILENAME;
+    struct log_index_header hdr;
+    struct log_index_record rec;
+    struct stat st;
+
+    _close();
+
+    _fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (_fd < 0)
+        return false;
+
+    if (fstat(_fd, &st) < 0 || pread(_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+        || hdr.magic != LOG_INDEX_MAGIC || hdr.version != LOG_INDEX_VERSION
+        || (uint64_t)st.st_size != sizeof(hdr) + (uint64_t)hdr.slot_count * sizeof(rec))
+        goto invalid;
+
+    _next_prefix = hdr.next_prefix;
+    _slot_count = hdr.slot_count;
+    _dir_mtime.tv_sec = hdr.dir_mtime_sec;
+    _dir_mtime.tv_nsec = hdr.dir_mtime_nsec;
+
+    for (uint32_t slot = 0; slot < _slot_count; slot++) {
+        if (pread(_fd, &rec, sizeof(rec), sizeof(hdr) + (off_t)slot * sizeof(rec)) != sizeof(rec))
+            goto invalid;
+
+        if (!(rec.flags & LOG_INDEX_USED)) {
+            _free_slots.push_back(slot);
+            continue;
+        }
+
+        if (rec.prefix >= _next_prefix || _files.count(rec.prefix)
+            || strnlen(rec.name, sizeof(rec.name)) == sizeof(rec.name))
+            goto invalid;
+
+        const bool finished = rec.flags & LOG_INDEX_FINISHED;
+        _files[rec.prefix] = {rec.name, rec.size, finished};
+        _slots[rec.prefix] = slot;
+        _finished_count += finished;
+    }
+
+    _valid = true;
+    return true;
+
+invalid:
+    log_warning("Index of log directory %s is invalid", _dir.c_str());
+    _close();
+    return false;
+}
+
+int LogIndex::_rebuild()
+{
+    const std::string path = _dir + "/" LOG_INDEX_FILENAME;
+    const std::string tmp_path = path + ".tmp";
+    uint32_t idx, year, month, day, hour, minute, second;
+    struct dirent *ent;
+    DIR *dir;
+
+    _close();
+
+    dir = opendir(_dir.c_str());
+    if (!dir)
+        return -errno;
+
+    while ((ent = readdir(dir)) != nullptr) {
+        struct stat st;
+
+        if (sscanf(ent->d_name, "%u-", &idx) != 1)
+            continue;
+        if (idx >= _next_prefix && idx < UINT32_MAX)
+            _next_prefix = idx + 1;
+
+        // Match as much of the name as possible to only index logs
+        if (sscanf(ent->d_name, "%u-%u-%u-%u_%u-%u-%u.", &idx, &year, &month, &day, &hour,
+                   &minute, &second)
+                != 7
+            || strlen(ent->d_name) >= LOG_INDEX_NAME_LEN
+            || fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        const bool finished = !(st.st_mode & S_IWUSR);
+        if (_files.count(idx))
+            _finished_count -= _files[idx].finished;
+        _files[idx] = {ent->d_name, (uint64_t)st.st_size, finished};
+        _finished_count += finished;
+    }
+    closedir(dir);
+
+    for (const auto &f : _files)
+        _slots[f.first] = _slot_count++;
+    _valid = true;
+
+    // Write the whole index aside and replace the old one at once
+    _fd = open(tmp_path.c_str(), O_RDWR | O_CLOEXEC | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+        log_warning("Unable to write index of log directory %s (%m)", _dir.c_str());
+        _get_dir_mtime(&_dir_mtime);
+        return 0;
+    }
+
+    for (const auto &s : _slots)
+        _write_record(s.first, s.second);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        log_warning("Unable to write index of log directory %s (%m)", _dir.c_str());
+        close(_fd);
+        _fd = -1;
+        unlink(tmp_path.c_str());
+    }
+    _dirty = true;
+    commit();
+
+    return 0;
+}
+
+void LogIndex::_write_record(uint32_t prefix, uint32_t slot)
+{
+    struct log_index_record rec = {};
+    auto it = _files.find(prefix);
+
+    if (_fd < 0)
+        return;
+
+    if (it != _files.end()) {
+        rec.prefix = prefix;
+        rec.flags = LOG_INDEX_USED | (it->second.finished ? LOG_INDEX_FINISHED : 0);
+        rec.size = it->second.size;
+        strncpy(rec.name, it->second.name.c_str(), sizeof(rec.name) - 1);
+    }
+
+    if (pwrite(_fd, &rec, sizeof(rec), sizeof(struct log_index_header) + (off_t)slot * sizeof(rec))
+        != sizeof(rec))
+        log_error("Unable to update index of log directory %s (%m)", _dir.c_str());
+}
+
+/*
+ * Record the directory modification time, after changes made by us, and make
+ * the index durable
+ */
+void LogIndex::commit()
+{
+    struct log_index_header hdr = {};
+
+    if (!_dirty)
+        return;
+    _dirty = false;
+
+    if (_get_dir_mtime(&_dir_mtime) < 0 || _fd < 0)
+        return;
+
+    hdr.magic = LOG_INDEX_MAGIC;
+    hdr.version = LOG_INDEX_VERSION;
+    hdr.next_prefix = _next_prefix;
+    hdr.slot_count = _slot_count;
+    hdr.dir_mtime_sec = _dir_mtime.tv_sec;
+    hdr.dir_mtime_nsec = _dir_mtime.tv_nsec;
+
+    if (pwrite(_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(_fd) < 0)
+        log_error("Unable to update index of log directory %s (%m)", _dir.c_str());
+}
+
+void LogIndex::add(uint32_t prefix, const char *name)
+{
+    uint32_t slot;
+
+    if (!_valid)
+        return;
+
+    if (prefix >= _next_prefix && prefix < UINT32_MAX)
+        _next_prefix = prefix + 1;
+
+    // Not a name we would index when rebuilding
+    _dirty = true;
+    if (strlen(name) >= LOG_INDEX_NAME_LEN || _files.count(prefix))
+        return;
+
+    if (!_free_slots.empty()) {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+    } else {
+        slot = _slot_count++;
+    }
+
+    _files[prefix] = {name, 0, false};
+    _slots[prefix] = slot;
+    _write_record(prefix, slot);
+}
+
+void LogIndex::set_finished(uint32_t prefix, uint64_t size)
+{
+    auto it = _files.find(prefix);
+
+    if (it == _files.end())
+        return;
+
+    _dirty = true;
+    _finished_count += !it->second.finished;
+    it->second.finished = true;
+    it->second.size = size;
+    _write_record(prefix, _slots[prefix]);
+}
+
+void LogIndex::remove(uint32_t prefix)
+{
+    auto it = _files.find(prefix);
+
+    if (it == _files.end())
+        return;
+
+    const uint32_t slot = _slots[prefix];
+    _dirty = true;
+    _finished_count -= it->second.finished;
+    _files.erase(it);
+    _slots.erase(prefix);
+    _free_slots.push_back(slot);
+    _write_record(prefix, slot);
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Index of the log files in a directory, so that starting or rotating a log
+ * doesn't need to list and stat every file in it.
+ *
+ * The index is kept in LOG_INDEX_FILENAME in the directory itself, with one
+ * fixed size record per log file, updated in place as logs are created,
+ * finished and deleted. It also stores the modification time of the
+ * directory after its last change by us: if it differs, files were created
+ * or deleted by someone else, or we crashed before updating the index, and
+ * the index is rebuilt from the directory content.
+ *
+ * This relies on the timestamp granularity of the filesystem: a file created
+ * or deleted by someone else within the same tick as our last change, e.g.
+ * the same 2 seconds on FAT, goes unnoticed until the directory changes
+ * again. Missing files are harmless, the log endpoint checks them before
+ * use, but unknown ones are neither counted nor deleted.
+ */
+class LogIndex {
+public:
+    struct log_file {
+        std::string name;
+        uint64_t size;
+        bool finished;
+    };
+
+    LogIndex() = default;
+    LogIndex(const LogIndex &) = delete;
+    LogIndex &operator=(const LogIndex &) = delete;
+    ~LogIndex();
+
+    /*
+     * Make sure the index matches @logs_dir, loading it on first use and
+     * rebuilding it if needed. Return 0 on success or a negative errno if
+     * the directory can't be read, e.g. because it doesn't exist yet.
+     */
+    int refresh(const char *logs_dir);
+
+    /*
+     * Prefix for the next log file: one more than the highest one in the
+     * directory.
+     */
+    uint32_t next_prefix() const { return _next_prefix; }
+
+    // Log files by prefix, oldest first. Only valid after refresh() succeeded.
+    const std::map<uint32_t, log_file> &files() const { return _files; }
+    size_t finished_count() const { return _finished_count; }
+
+    /*
+     * Update the index after a change to the directory. Changes are only
+     * written to the index file, and synced, by commit(): call it once
+     * done with them.
+     */
+    void add(uint32_t prefix, const char *name);
+    void set_finished(uint32_t prefix, uint64_t size);
+    void remove(uint32_t prefix);
+    void commit();
+
+private:
+    std::string _dir;
+    int _fd = -1;
+    bool _valid = false;
+    bool _dirty = false;
+    std::map<uint32_t, log_file> _files;
+    // Record of each log file in the index file
+    std::map<uint32_t, uint32_t> _slots;
+    std::vector<uint32_t> _free_slots;
+    uint32_t _slot_count = 0;
+    uint32_t _next_prefix = 0;
+    size_t _finished_count = 0;
+    struct timespec _dir_mtime = {};
+
+    int _get_dir_mtime(struct timespec *mtime) const;
+    bool _load();
+    int _rebuild();
+    void _write_record(uint32_t prefix, uint32_t slot);
+    void _close();
+};
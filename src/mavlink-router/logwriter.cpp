@@ -0,0 +1,536 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "logwriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <common/log.h>
+#include <common/util.h>
+
+// Chunk buffers are aligned to memory pages
+#define CHUNK_ALIGNMENT 4096
+#define MAX_RETRIES 10
+
+/*
+ * Create a new file in @dir, named after the current local time
+ */
+int LogWriter::create_file(const char *dir, const char *extension, char *filename,
+                           size_t filename_len)
+{
+    time_t t = time(NULL);
+    struct tm *timeinfo = localtime(&t);
+    char path[PATH_MAX];
+    int r;
+
+    r = mkdir_p(dir, strlen(dir), 0755);
+    if (r < 0) {
+        log_error("Could not create dir %s (%s)", dir, strerror(-r));
+        return -1;
+    }
+
+    for (int i = 0; i <= MAX_RETRIES; i++) {
+        r = strftime(filename, filename_len, "%Y-%m-%d_%H-%M-%S", timeinfo);
+        if (r > 0 && i > 0)
+            r += snprintf(filename + r, filename_len - r, "_%d", i);
+        if (r > 0 && (size_t)r < filename_len)
+            r += snprintf(filename + r, filename_len - r, ".%s", extension);
+
+        if (r <= 0 || (size_t)r >= filename_len
+            || snprintf(path, sizeof(path), "%s/%s", dir, filename) >= (int)sizeof(path)) {
+            log_error("Error formatting file name");
+            return -1;
+        }
+
+        r = ::open(path, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644);
+        if (r >= 0)
+            return r;
+        if (errno != EEXIST) {
+            log_error("Unable to open file(%s): (%m)", path);
+            return -1;
+        }
+    }
+
+    log_error("Unable to create a file without overriding another one");
+    return -1;
+}
+
+LogWriter::LogWriter()
+{
+    pthread_condattr_t attr;
+
+    // Sync interval is measured with the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+LogWriter::~LogWriter()
+{
+    close();
+
+    for (auto &c : _chunks)
+        free(c.data);
+
+    pthread_cond_destroy(&_cond);
+}
+
+int LogWriter::open(int fd, const struct log_storage_options &storage)
+{
+    int r;
+
+    if (_thread_running)
+        return -EBUSY;
+
+    for (auto &c : _chunks) {
+        if (!c.data && posix_memalign((void **)&c.data, CHUNK_ALIGNMENT, CHUNK_SIZE))
+            return -ENOMEM;
+    }
+
+    _fd = fd;
+    _head.store(0);
+    _tail.store(0);
+    _fill_len = 0;
+    _fill_offset = -1;
+    _stop.store(false);
+    _done.store(false);
+    _error.store(0);
+    _sync_count.store(0);
+    _sync_total_us.store(0);
+    _sync_max_us.store(0);
+    _storage = storage;
+    _allocated = 0;
+    _append_offset = lseek(fd, 0, SEEK_CUR);
+    if (_append_offset < 0)
+        _append_offset = 0;
+    _unsynced_bytes = 0;
+    _close_fd = false;
+    _finished_path.clear();
+
+    r = pthread_create(&_thread, nullptr, _thread_main, this);
+    if (r) {
+        log_error("Could not create log writer thread (%s)", strerror(r));
+        return -r;
+    }
+
+    _thread_running = true;
+    return 0;
+}
+
+void LogWriter::close()
+{
+    if (!_thread_running)
+        return;
+
+    if (!_stop.load()) {
+        flush();
+        _stop.store(true);
+        _wake_writer();
+    }
+    pthread_join(_thread, nullptr);
+
+    _thread_running = false;
+    _fd = -1;
+}
+
+void LogWriter::close_async(const char *path)
+{
+    if (!_thread_running || _stop.load())
+        return;
+
+    flush();
+    _close_fd = true;
+    _finished_path = path ? path : "";
+    _stop.store(true);
+    _wake_writer();
+}
+
+void LogWriter::collect(std::vector<std::unique_ptr<LogWriter>> &closing)
+{
+    closing.erase(std::remove_if(closing.begin(), closing.end(),
+                                 [](const std::unique_ptr<LogWriter> &w) { return w->is_done(); }),
+                  closing.end());
+}
+
+bool LogWriter::_has_room() const
+{
+    // Chunk being filled can't be one the writer thread didn't release yet
+    return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire)
+        < RING_CHUNKS;
+}
+
+void LogWriter::_publish()
+{
+    const uint32_t head = _head.load(std::memory_order_relaxed);
+    struct chunk *c = &_chunks[head % RING_CHUNKS];
+
+    c->len = _fill_len;
+    c->offset = _fill_offset;
+    _head.store(head + 1, std::memory_order_release);
+
+    _fill_len = 0;
+    _fill_offset = -1;
+    _wake_writer();
+}
+
+bool LogWriter::append(const void *data, size_t len)
+{
+    const struct iovec iov = {(void *)data, len};
+
+    return append(&iov, 1);
+}
+
+bool LogWriter::append(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+
+    if (!_thread_running)
+        return false;
+
+    if (_fill_len && _fill_offset != -1)
+        _publish();
+
+    if (!_has_room())
+        return false;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    const uint32_t free_chunks = RING_CHUNKS - 1
+        - (_head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire));
+    if (len > CHUNK_SIZE - _fill_len + free_chunks * CHUNK_SIZE)
+        return false;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t *p = (const uint8_t *)iov[i].iov_base;
+
+        for (len = iov[i].iov_len; len;) {
+            const size_t n = std::min(len, CHUNK_SIZE - _fill_len);
+
+            memcpy(_chunks[_head.load(std::memory_order_relaxed) % RING_CHUNKS].data + _fill_len, p,
+                   n);
+            _fill_len += n;
+            p += n;
+            len -= n;
+
+            if (_fill_len == CHUNK_SIZE)
+                _publish();
+        }
+    }
+
+    return true;
+}
+
+bool LogWriter::write_at(const void *data, size_t len, off_t offset)
+{
+    if (!_thread_running || len > CHUNK_SIZE)
+        return false;
+
+    // Only data contiguous in the file is merged in the same chunk
+    if (_fill_len
+        && (_fill_offset == -1 || _fill_offset + (off_t)_fill_len != offset
+            || _fill_len + len > CHUNK_SIZE))
+        _publish();
+
+    if (!_has_room())
+        return false;
+
+    if (!_fill_len)
+        _fill_offset = offset;
+    memcpy(_chunks[_head.load(std::memory_order_relaxed) % RING_CHUNKS].data + _fill_len, data, len);
+    _fill_len += len;
+
+    if (_fill_len == CHUNK_SIZE)
+        _publish();
+
+    return true;
+}
+
+void LogWriter::flush()
+{
+    if (_fill_len)
+        _publish();
+}
+
+struct LogWriter::sync_stats LogWriter::get_sync_stats() const
+{
+    return {_sync_count.load(), _sync_total_us.load(), _sync_max_us.load()};
+}
+
+void LogWriter::_wake_writer()
+{
+    pthread_mutex_lock(&_lock);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+}
+
+void *LogWriter::_thread_main(void *data)
+{
+    LogWriter *writer = static_cast<LogWriter *>(data);
+
+    writer->_write_loop();
+    writer->_finish();
+    writer->_done.store(true);
+    return nullptr;
+}
+
+void LogWriter::_write_loop()
+{
+    for (;;) {
+        const uint32_t tail = _tail.load(std::memory_order_relaxed);
+        const uint32_t head = _head.load(std::memory_order_acquire);
+
+        if (tail != head) {
+            _write_chunks(tail, head - tail);
+            _tail.store(head, std::memory_order_release);
+        }
+
+        if (_sync_due(now_usec()))
+            _sync(_storage.sync_mode);
+
+        if (tail != head)
+            continue;
+
+        if (_stop.load())
+            break;
+
+        _wait(tail);
+    }
+}
+
+/*
+ * Called by the writer thread once everything queued is written
+ */
+void LogWriter::_finish()
+{
+    // Release preallocated space past the end of the data
+    struct stat st;
+    if (_allocated > 0 && fstat(_fd, &st) == 0 && st.st_size < _allocated
+        && ftruncate(_fd, st.st_size) < 0)
+        log_warning("Could not release space preallocated for log file (%m)");
+
+    if (_unsynced_bytes && _storage.sync_mode != LogSyncMode::none)
+        _sync(LogSyncMode::data);
+
+    if (!_close_fd)
+        return;
+
+    if (_error.load())
+        log_error("Log file %s is incomplete, some data could not be written",
+                  _finished_path.c_str());
+
+    ::close(_fd);
+
+    // change file permissions to read-only to mark them as finished
+    if (!_finished_path.empty())
+        chmod(_finished_path.c_str(), S_IRUSR | S_IRGRP | S_IROTH);
+}
+
+/*
+ * Sleep until there is something to write, or the sync interval expires if
+ * there is data to sync.
+ */
+void LogWriter::_wait(uint32_t tail)
+{
+    const bool timed = _unsynced_bytes && _storage.sync_mode != LogSyncMode::none
+        && _storage.sync_interval;
+    struct timespec deadline;
+
+    if (timed) {
+        const uint64_t deadline_us = _unsynced_since_us + _storage.sync_interval * USEC_PER_MSEC;
+
+        deadline.tv_sec = deadline_us / USEC_PER_SEC;
+        deadline.tv_nsec = (deadline_us % USEC_PER_SEC) * NSEC_PER_USEC;
+    }
+
+    pthread_mutex_lock(&_lock);
+    while (_head.load(std::memory_order_acquire) == tail && !_stop.load()) {
+        if (!timed)
+            pthread_cond_wait(&_cond, &_lock);
+        else if (pthread_cond_timedwait(&_cond, &_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+bool LogWriter::_sync_due(uint64_t now_us) const
+{
+    if (!_unsynced_bytes || _storage.sync_mode == LogSyncMode::none)
+        return false;
+
+    return (_storage.sync_bytes && _unsynced_bytes >= _storage.sync_bytes)
+        || (_storage.sync_interval
+            && now_us - _unsynced_since_us >= _storage.sync_interval * USEC_PER_MSEC);
+}
+
+void LogWriter::_sync(LogSyncMode mode)
+{
+    const uint64_t start_us = now_usec();
+    int r = 0;
+
+    switch (mode) {
+    case LogSyncMode::data:
+        r = fdatasync(_fd);
+        break;
+    case LogSyncMode::range:
+        // Only start writeback, it's completed by the kernel in background
+        if (_unsynced_end > _unsynced_start)
+            r = sync_file_range(_fd, _unsynced_start, _unsynced_end - _unsynced_start,
+                                SYNC_FILE_RANGE_WRITE);
+        break;
+    case LogSyncMode::none:
+        return;
+    }
+
+    if (r < 0)
+        _error.store(errno);
+
+    const uint64_t elapsed_us = now_usec() - start_us;
+
+    _sync_count.fetch_add(1);
+    _sync_total_us.fetch_add(elapsed_us);
+    if (elapsed_us > _sync_max_us.load())
+        _sync_max_us.store(elapsed_us);
+
+    _unsynced_bytes = 0;
+}
+
+/*
+ * Write all of @iov, at @offset or at the current file position if it's -1
+ */
+static int write_iov(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0) {
+        const ssize_t r = offset < 0 ? writev(fd, iov, iovcnt) : pwritev(fd, iov, iovcnt, offset);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (offset >= 0)
+            offset += r;
+
+        // Skip what was written, on partial writes
+        size_t written = r;
+        while (iovcnt > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Make sure space is allocated up to @end, in multiples of the preallocation
+ * size, without changing the file size.
+ */
+void LogWriter::_preallocate(off_t end)
+{
+    const off_t extent = _storage.prealloc_size;
+
+    if (!extent || end <= _allocated)
+        return;
+
+    const off_t new_allocated = (end + extent - 1) / extent * extent;
+
+    if (fallocate(_fd, FALLOC_FL_KEEP_SIZE, _allocated, new_allocated - _allocated) < 0) {
+        // Not supported by the filesystem or out of space: just write
+        _storage.prealloc_size = 0;
+        return;
+    }
+
+    _allocated = new_allocated;
+}
+
+void LogWriter::_write(struct iovec *iov, int iovcnt, off_t offset)
+{
+    const off_t start = offset < 0 ? _append_offset : offset;
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    _preallocate(start + (off_t)len);
+
+    int r = write_iov(_fd, iov, iovcnt, offset);
+    if (r < 0) {
+        _error.store(-r);
+        if (offset < 0)
+            _append_offset = lseek(_fd, 0, SEEK_CUR);
+        return;
+    }
+
+    if (offset < 0)
+        _append_offset += len;
+
+    // Range of the file written since last sync
+    if (!_unsynced_bytes) {
+        _unsynced_since_us = now_usec();
+        _unsynced_start = start;
+        _unsynced_end = start + len;
+    } else {
+        _unsynced_start = std::min(_unsynced_start, start);
+        _unsynced_end = std::max(_unsynced_end, start + (off_t)len);
+    }
+    _unsynced_bytes += len;
+}
+
+void LogWriter::_write_chunks(uint32_t first, uint32_t count)
+{
+    struct iovec iov[RING_CHUNKS];
+    int iovcnt = 0;
+    off_t offset = -1, next_offset = -1;
+
+    for (uint32_t i = first; i != first + count; i++) {
+        const struct chunk *c = &_chunks[i % RING_CHUNKS];
+
+        // Start a new write unless chunk continues the previous one
+        if (iovcnt > 0 && (c->offset != next_offset || (c->offset == -1) != (offset == -1))) {
+            _write(iov, iovcnt, offset);
+            iovcnt = 0;
+        }
+
+        if (iovcnt == 0)
+            offset = c->offset;
+        iov[iovcnt].iov_base = c->data;
+        iov[iovcnt].iov_len = c->len;
+        iovcnt++;
+        next_offset = c->offset == -1 ? -1 : c->offset + (off_t)c->len;
+    }
+
+    if (iovcnt > 0)
+        _write(iov, iovcnt, offset);
+}
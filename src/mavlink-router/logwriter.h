@@ -0,0 +1,206 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define LOG_DEFAULT_PREALLOC_SIZE (16 * 1024 * 1024)
+#define LOG_DEFAULT_SYNC_INTERVAL 1000
+
+enum class LogSyncMode {
+    data = 0, ///< fdatasync() the file
+    range,    ///< Start writeback of the ranges written with sync_file_range()
+    none,     ///< Leave it to the kernel
+};
+
+/*
+ * How log files are written to storage
+ */
+struct log_storage_options {
+    unsigned long prealloc_size;    ///< Extent preallocated as files grow, 0 to disable
+    unsigned long ulog_buffer_size; ///< Where ULog messages are reassembled, 0 for default
+    LogSyncMode sync_mode;
+    unsigned long sync_bytes;       ///< Sync after this many bytes are written, 0 to disable
+    unsigned long sync_interval;    ///< Sync written data after this many ms, 0 to disable
+};
+
+/*
+ * Writes log data to a file from a dedicated thread, so the main loop never
+ * blocks on storage. Data is copied into a single-producer single-consumer
+ * ring of chunks; the writer thread writes all published chunks at once,
+ * merging the ones contiguous in the file into a single writev()/pwritev().
+ *
+ * The file may be preallocated in large extents as it grows, to avoid
+ * fragmentation and allocation latency on flash storage. The excess is
+ * released on close(). Written data is synced by the writer thread too,
+ * according to the sync policy.
+ *
+ * All methods except the constructor and destructor must be called from the
+ * same (main loop) thread.
+ */
+class LogWriter {
+public:
+    static const size_t CHUNK_SIZE = 32 * 1024;
+    static const unsigned int RING_CHUNKS = 32;
+
+    struct sync_stats {
+        uint32_t count;
+        uint64_t total_us;
+        uint64_t max_us;
+    };
+
+    LogWriter();
+    LogWriter(const LogWriter &) = delete;
+    LogWriter &operator=(const LogWriter &) = delete;
+    ~LogWriter();
+
+    /*
+     * Start writer thread for @fd. Return 0 on success or a negative errno.
+     */
+    int open(int fd, const struct log_storage_options &storage);
+
+    /*
+     * Flush pending data, wait for the writer thread to write it and stop it.
+     * The file descriptor is not closed, but space preallocated beyond the
+     * data is released and, unless the sync mode is none, what wasn't
+     * synced yet is fdatasync()ed.
+     */
+    void close();
+
+    /*
+     * Same as close(), but without waiting for the writer thread: once it
+     * has written all queued data, it closes the file descriptor and marks
+     * the file at @path finished by making it read-only. close() must still
+     * be called before reusing the writer; it doesn't block once is_done().
+     */
+    void close_async(const char *path);
+
+    bool is_open() const { return _thread_running; }
+    bool is_done() const { return _done.load(); }
+
+    /*
+     * Destroy the writers in @closing whose thread is done, without blocking
+     */
+    static void collect(std::vector<std::unique_ptr<LogWriter>> &closing);
+
+    /*
+     * Queue @len bytes to be written after the previously appended data.
+     * Nothing is queued and false is returned if the ring doesn't have room
+     * for all of it.
+     */
+    bool append(const void *data, size_t len);
+
+    /*
+     * Same as append() for the concatenation of @iovcnt buffers
+     */
+    bool append(const struct iovec *iov, int iovcnt);
+
+    /*
+     * Queue @len bytes, at most CHUNK_SIZE, to be written at @offset.
+     * Return false if the ring is full.
+     */
+    bool write_at(const void *data, size_t len, off_t offset);
+
+    /*
+     * Hand partially filled chunk over to the writer thread
+     */
+    void flush();
+
+    /*
+     * Number of syncs done and how long they took
+     */
+    struct sync_stats get_sync_stats() const;
+
+    /*
+     * Return and clear the last write error of the writer thread, 0 if none
+     */
+    int get_error() { return _error.exchange(0); }
+
+    /*
+     * Create a new file with @extension in @dir, creating it if needed,
+     * named after the current local time. The name is returned in
+     * @filename. Return the file descriptor or -1 on error.
+     */
+    static int create_file(const char *dir, const char *extension, char *filename,
+                           size_t filename_len);
+
+private:
+    struct chunk {
+        uint8_t *data;
+        size_t len;
+        off_t offset; // -1 to append to the file
+    };
+
+    int _fd = -1;
+    struct chunk _chunks[RING_CHUNKS] = {};
+
+    // Chunk being filled by producer is _head, chunks in [_tail, _head) are ready
+    std::atomic<uint32_t> _head{0};
+    std::atomic<uint32_t> _tail{0};
+    std::atomic<bool> _stop{false};
+    std::atomic<bool> _done{false};
+    std::atomic<int> _error{0};
+
+    pthread_t _thread;
+    bool _thread_running = false;
+    pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t _cond;
+
+    // Chunk being filled, only accessed by the producer
+    size_t _fill_len = 0;
+    off_t _fill_offset = -1;
+
+    bool _has_room() const;
+    void _publish();
+    void _wake_writer();
+
+    std::atomic<uint32_t> _sync_count{0};
+    std::atomic<uint64_t> _sync_total_us{0};
+    std::atomic<uint64_t> _sync_max_us{0};
+
+    // Only accessed by the writer thread while it runs
+    struct log_storage_options _storage = {};
+    off_t _allocated = 0;
+    off_t _append_offset = 0;
+    uint64_t _unsynced_bytes = 0;
+    off_t _unsynced_start = 0;
+    off_t _unsynced_end = 0;
+    uint64_t _unsynced_since_us = 0;
+
+    // Set by close_async() before the writer thread is stopped
+    bool _close_fd = false;
+    std::string _finished_path;
+
+    static void *_thread_main(void *data);
+    void _write_loop();
+    void _finish();
+    void _write_chunks(uint32_t first, uint32_t count);
+    void _write(struct iovec *iov, int iovcnt, off_t offset);
+    void _preallocate(off_t end);
+    bool _sync_due(uint64_t now_us) const;
+    void _sync(LogSyncMode mode);
+    void _wait(uint32_t tail);
+};
@@ -44,6 +44,7 @@
 
 static struct options opt = {
     .endpoints = nullptr,
+    .rules = nullptr,
     .conf_file_name = nullptr,
     .conf_dir = nullptr,
     .tcp_port = ULONG_MAX,
@@ -54,10 +55,40 @@ static struct options opt = {
     .mavlink_dialect = Auto,
     .min_free_space = 0,
     .max_log_files = 0,
+    .ulog_buffer_size = ULOG_DEFAULT_BUFFER_SIZE,
+    .log_prealloc_size = LOG_DEFAULT_PREALLOC_SIZE,
+    .log_sync_mode = LogSyncMode::data,
+    .log_sync_bytes = 0,
+    .log_sync_interval = LOG_DEFAULT_SYNC_INTERVAL,
+    .tlog_dir = nullptr,
+    .tlog_max_size = 0,
+    .tlog_max_time = 0,
+    .tlog_msgs = nullptr,
+    .capture_dir = nullptr,
+    .capture_msgs = nullptr,
+    .capture_enabled = true,
+    .dedup_period = 0,
+    .route_ttl = 0,
+    .response_steering = false,
+    .param_cache = false,
+    .mission_cache = false,
+    .snapshot_msgs = nullptr,
+    .aggregate_msg_intervals = false,
     .heartbeat = false,
     .use_pipe = true
 };
 
+/*
+ * Options that may be set on any endpoint section of the conf files
+ */
+struct option_endpoint {
+    unsigned long max_bitrate;
+    bool radio_link;
+    char *allow_src;
+    char *deny_src;
+    char *group;
+};
+
 static const struct option long_options[] = {
     { "endpoints",              required_argument,  NULL,   'e' },
     { "conf-file",              required_argument,  NULL,   'c' },
@@ -218,7 +249,8 @@ fail:
 
 static int add_udp_endpoint_address(const char *name, size_t name_len, const char *ip,
                                     long unsigned port, bool eavesdropping, const char *filter,
-                                    int coalesce_bytes, int coalesce_ms, const char *coalesce_nodelay)
+                                    int coalesce_bytes, int coalesce_ms, const char *coalesce_nodelay,
+                                    const char *rx_filter)
 {
     int ret;
 
@@ -271,6 +303,14 @@ static int add_udp_endpoint_address(const char *name, size_t name_len, const cha
         }
     }
 
+    if (rx_filter) {
+        conf->rx_filter = strdup(rx_filter);
+        if (!conf->rx_filter) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
     conf->next = opt.endpoints;
     opt.endpoints = conf;
 
@@ -278,6 +318,8 @@ static int add_udp_endpoint_address(const char *name, size_t name_len, const cha
 
 fail:
     free(conf->address);
+    free(conf->filter);
+    free(conf->coalesce_nodelay);
     free(conf->name);
     free(conf);
 
@@ -372,6 +414,39 @@ fail:
     return ret;
 }
 
+static int add_replay_endpoint(const char *name, size_t name_len, const char *file, double speed,
+                               bool loop)
+{
+    struct endpoint_config *conf
+        = (struct endpoint_config *)calloc(1, sizeof(struct endpoint_config));
+    assert_or_return(conf, -ENOMEM);
+    conf->type = Replay;
+
+    if (name) {
+        conf->name = strndup(name, name_len);
+        if (!conf->name)
+            goto fail;
+    }
+
+    conf->replay_file = strdup(file);
+    if (!conf->replay_file)
+        goto fail;
+
+    conf->replay_speed = speed;
+    conf->replay_loop = loop;
+
+    conf->next = opt.endpoints;
+    opt.endpoints = conf;
+
+    return 0;
+
+fail:
+    free(conf->name);
+    free(conf);
+
+    return -ENOMEM;
+}
+
 static bool pre_parse_argv(int argc, char *argv[])
 {
     // This function parses only conf-file and conf-dir from
@@ -427,7 +502,7 @@ static int parse_argv(int argc, char *argv[])
                 return -EINVAL;
             }
 
-            add_udp_endpoint_address(NULL, 0, ip, port, false, NULL, 0, 0, NULL);
+            add_udp_endpoint_address(NULL, 0, ip, port, false, NULL, 0, 0, NULL, NULL);
             free(ip);
             break;
         }
@@ -520,7 +595,7 @@ static int parse_argv(int argc, char *argv[])
                 return -EINVAL;
             }
 
-            add_udp_endpoint_address(NULL, 0, base, number, true, NULL, 0, 0, NULL);
+            add_udp_endpoint_address(NULL, 0, base, number, true, NULL, 0, 0, NULL, NULL);
         } else {
             const char *bauds = number != ULONG_MAX ? base + strlen(base) + 1 : NULL;
             int ret = add_uart_endpoint(NULL, 0, base, bauds, false);
@@ -643,6 +718,36 @@ static int parse_log_mode(const char *val, size_t val_len, void *storage, size_t
 }
 #undef MAX_LOG_MODE_SIZE
 
+#define MAX_LOG_SYNC_MODE_SIZE 20
+static int parse_log_sync_mode(const char *val, size_t val_len, void *storage, size_t storage_len)
+{
+    assert(val);
+    assert(storage);
+    assert(val_len);
+
+    if (storage_len < sizeof(options::log_sync_mode))
+        return -ENOBUFS;
+    if (val_len > MAX_LOG_SYNC_MODE_SIZE)
+        return -EINVAL;
+
+    const char *sync_mode_str = strndupa(val, val_len);
+    LogSyncMode sync_mode;
+    if (strcaseeq(sync_mode_str, "data"))
+        sync_mode = LogSyncMode::data;
+    else if (strcaseeq(sync_mode_str, "range"))
+        sync_mode = LogSyncMode::range;
+    else if (strcaseeq(sync_mode_str, "none"))
+        sync_mode = LogSyncMode::none;
+    else {
+        log_error("Invalid argument for LogSync = %s", sync_mode_str);
+        return -EINVAL;
+    }
+    *((LogSyncMode *)storage) = sync_mode;
+
+    return 0;
+}
+#undef MAX_LOG_SYNC_MODE_SIZE
+
 
 static int parse_mode(const char *val, size_t val_len, void *storage, size_t storage_len)
 {
@@ -668,6 +773,81 @@ static int parse_mode(const char *val, size_t val_len, void *storage, size_t sto
     return 0;
 }
 
+static int parse_replay_speed(const char *val, size_t val_len, void *storage, size_t storage_len)
+{
+    assert(val);
+    assert(storage);
+    assert(val_len);
+
+    if (storage_len < sizeof(double))
+        return -ENOBUFS;
+
+    const char *speed_str = strndupa(val, val_len);
+    char *end;
+    errno = 0;
+    double speed = strtod(speed_str, &end);
+    if (errno || end == speed_str || *end != '\0' || !(speed >= 0)) {
+        log_error("Invalid argument for Speed = %s", speed_str);
+        return -EINVAL;
+    }
+    *((double *)storage) = speed;
+
+    return 0;
+}
+
+/*
+ * add_*_endpoint() functions prepend the new endpoint to opt.endpoints, so
+ * this is called with the head of the list right after adding it.
+ */
+static int set_endpoint_options(struct endpoint_config *conf, const struct option_endpoint *opt_ep)
+{
+    conf->max_bitrate = opt_ep->max_bitrate;
+    conf->radio_link = opt_ep->radio_link;
+
+    if (opt_ep->allow_src) {
+        conf->allow_src = strdup(opt_ep->allow_src);
+        if (!conf->allow_src)
+            return -ENOMEM;
+    }
+
+    if (opt_ep->deny_src) {
+        conf->deny_src = strdup(opt_ep->deny_src);
+        if (!conf->deny_src)
+            return -ENOMEM;
+    }
+
+    if (opt_ep->group) {
+        conf->group = strdup(opt_ep->group);
+        if (!conf->group)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int add_rule(const char *name, size_t name_len, char *match, char *action)
+{
+    struct rule_config **tail = &opt.rules;
+
+    struct rule_config *rule = (struct rule_config *)calloc(1, sizeof(struct rule_config));
+    assert_or_return(rule, -ENOMEM);
+
+    rule->name = strndup(name, name_len);
+    if (!rule->name) {
+        free(rule);
+        return -ENOMEM;
+    }
+
+    // Rules are evaluated in the order they are defined
+    rule->match = match;
+    rule->action = action;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = rule;
+
+    return 0;
+}
+
 static int parse_confs(ConfFile &conf)
 {
     int ret;
@@ -689,6 +869,39 @@ static int parse_confs(ConfFile &conf)
          OPTIONS_TABLE_STRUCT_FIELD(options, min_free_space)},
         {"MaxLogFiles", false, ConfFile::parse_ul,
          OPTIONS_TABLE_STRUCT_FIELD(options, max_log_files)},
+        {"ULogBufferSize", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, ulog_buffer_size)},
+        {"LogPreallocSize", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, log_prealloc_size)},
+        {"LogSync", false, parse_log_sync_mode, OPTIONS_TABLE_STRUCT_FIELD(options, log_sync_mode)},
+        {"LogSyncBytes", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, log_sync_bytes)},
+        {"LogSyncInterval", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, log_sync_interval)},
+        {"TLog", false, ConfFile::parse_str_dup, OPTIONS_TABLE_STRUCT_FIELD(options, tlog_dir)},
+        {"TLogMaxSize", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, tlog_max_size)},
+        {"TLogMaxTime", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, tlog_max_time)},
+        {"TLogMessages", false, ConfFile::parse_str_dup,
+         OPTIONS_TABLE_STRUCT_FIELD(options, tlog_msgs)},
+        {"Capture", false, ConfFile::parse_str_dup, OPTIONS_TABLE_STRUCT_FIELD(options, capture_dir)},
+        {"CaptureMessages", false, ConfFile::parse_str_dup,
+         OPTIONS_TABLE_STRUCT_FIELD(options, capture_msgs)},
+        {"CaptureEnabled", false, ConfFile::parse_bool,
+         OPTIONS_TABLE_STRUCT_FIELD(options, capture_enabled)},
+        {"DeduplicationPeriod", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, dedup_period)},
+        {"RouteTTL", false, ConfFile::parse_ul, OPTIONS_TABLE_STRUCT_FIELD(options, route_ttl)},
+        {"ResponseSteering", false, ConfFile::parse_bool,
+         OPTIONS_TABLE_STRUCT_FIELD(options, response_steering)},
+        {"ParamCache", false, ConfFile::parse_bool, OPTIONS_TABLE_STRUCT_FIELD(options, param_cache)},
+        {"MissionCache", false, ConfFile::parse_bool,
+         OPTIONS_TABLE_STRUCT_FIELD(options, mission_cache)},
+        {"SnapshotMessages", false, ConfFile::parse_str_dup,
+         OPTIONS_TABLE_STRUCT_FIELD(options, snapshot_msgs)},
+        {"AggregateMessageIntervals", false, ConfFile::parse_bool,
+         OPTIONS_TABLE_STRUCT_FIELD(options, aggregate_msg_intervals)},
     };
 
     struct option_uart {
@@ -710,6 +923,7 @@ static int parse_confs(ConfFile &conf)
         unsigned long coalesce_bytes;
         unsigned long coalesce_ms;
         char *coalesce_nodelay;
+        char *rx_filter;
     };
     static const ConfFile::OptionsTable option_table_udp[] = {
         {"address",         true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, addr)},
@@ -719,6 +933,7 @@ static int parse_confs(ConfFile &conf)
         {"CoalesceBytes",   false,  ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_udp, coalesce_bytes)},
         {"CoalesceMs",      false,  ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_udp, coalesce_ms)},
         {"CoalesceNoDelay", false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, coalesce_nodelay)},
+        {"RxFilter",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, rx_filter)},
     };
 
     struct option_tcp {
@@ -732,6 +947,34 @@ static int parse_confs(ConfFile &conf)
         {"RetryTimeout",    false,  ConfFile::parse_i,          OPTIONS_TABLE_STRUCT_FIELD(option_tcp, timeout)},
     };
 
+    struct option_replay {
+        char *file;
+        double speed;
+        bool loop;
+    };
+    static const ConfFile::OptionsTable option_table_replay[] = {
+        {"File",            true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_replay, file)},
+        {"Speed",           false,  parse_replay_speed,         OPTIONS_TABLE_STRUCT_FIELD(option_replay, speed)},
+        {"Loop",            false,  ConfFile::parse_bool,       OPTIONS_TABLE_STRUCT_FIELD(option_replay, loop)},
+    };
+
+    struct option_rule {
+        char *match;
+        char *action;
+    };
+    static const ConfFile::OptionsTable option_table_rule[] = {
+        {"Match",           true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_rule, match)},
+        {"Action",          true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_rule, action)},
+    };
+
+    static const ConfFile::OptionsTable option_table_endpoint[] = {
+        {"MaxBitrate",      false,  ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_endpoint, max_bitrate)},
+        {"RadioLink",       false,  ConfFile::parse_bool,       OPTIONS_TABLE_STRUCT_FIELD(option_endpoint, radio_link)},
+        {"AllowSrc",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_endpoint, allow_src)},
+        {"DenySrc",         false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_endpoint, deny_src)},
+        {"Group",           false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_endpoint, group)},
+    };
+
     ret = conf.extract_options("General", option_table, ARRAY_SIZE(option_table), &opt);
     if (ret < 0)
         return ret;
@@ -741,13 +984,22 @@ static int parse_confs(ConfFile &conf)
     offset = strlen(pattern) - 1;
     while (conf.get_sections(pattern, &iter) == 0) {
         struct option_uart opt_uart = {nullptr, nullptr};
+        struct option_endpoint opt_ep = {};
         ret = conf.extract_options(&iter, option_table_uart, ARRAY_SIZE(option_table_uart),
                                    &opt_uart);
+        if (ret == 0)
+            ret = conf.extract_options(&iter, option_table_endpoint,
+                                       ARRAY_SIZE(option_table_endpoint), &opt_ep);
         if (ret == 0)
             ret = add_uart_endpoint(iter.name + offset, iter.name_len - offset, opt_uart.device,
                                     opt_uart.bauds, opt_uart.flowcontrol);
+        if (ret == 0)
+            ret = set_endpoint_options(opt.endpoints, &opt_ep);
         free(opt_uart.device);
         free(opt_uart.bauds);
+        free(opt_ep.allow_src);
+        free(opt_ep.deny_src);
+        free(opt_ep.group);
         if (ret < 0)
             return ret;
     }
@@ -756,8 +1008,12 @@ static int parse_confs(ConfFile &conf)
     pattern = "udpendpoint *";
     offset = strlen(pattern) - 1;
     while (conf.get_sections(pattern, &iter) == 0) {
-        struct option_udp opt_udp = {nullptr, false, ULONG_MAX, nullptr, 0, 0, nullptr};
+        struct option_udp opt_udp = {nullptr, false, ULONG_MAX, nullptr, 0, 0, nullptr, nullptr};
+        struct option_endpoint opt_ep = {};
         ret = conf.extract_options(&iter, option_table_udp, ARRAY_SIZE(option_table_udp), &opt_udp);
+        if (ret == 0)
+            ret = conf.extract_options(&iter, option_table_endpoint,
+                                       ARRAY_SIZE(option_table_endpoint), &opt_ep);
         if (ret == 0) {
             if (opt_udp.eavesdropping && opt_udp.port == ULONG_MAX) {
                 log_error("Expected 'port' key for section %.*s", (int)iter.name_len, iter.name);
@@ -765,29 +1021,86 @@ static int parse_confs(ConfFile &conf)
             } else {
                 ret = add_udp_endpoint_address(iter.name + offset, iter.name_len - offset, opt_udp.addr,
                                                opt_udp.port, opt_udp.eavesdropping, opt_udp.filter, opt_udp.coalesce_bytes,
-                                               opt_udp.coalesce_ms, opt_udp.coalesce_nodelay);
+                                               opt_udp.coalesce_ms, opt_udp.coalesce_nodelay,
+                                               opt_udp.rx_filter);
             }
         }
+        if (ret == 0)
+            ret = set_endpoint_options(opt.endpoints, &opt_ep);
 
         free(opt_udp.addr);
         free(opt_udp.coalesce_nodelay);
+        free(opt_udp.rx_filter);
         free(opt_udp.filter);
+        free(opt_ep.allow_src);
+        free(opt_ep.deny_src);
+        free(opt_ep.group);
         if (ret < 0)
             return ret;
     }
 
+    iter = {};
+    pattern = "replayendpoint *";
+    offset = strlen(pattern) - 1;
+    while (conf.get_sections(pattern, &iter) == 0) {
+        struct option_replay opt_replay = {nullptr, 1.0, false};
+        struct option_endpoint opt_ep = {};
+        ret = conf.extract_options(&iter, option_table_replay, ARRAY_SIZE(option_table_replay),
+                                   &opt_replay);
+        if (ret == 0)
+            ret = conf.extract_options(&iter, option_table_endpoint,
+                                       ARRAY_SIZE(option_table_endpoint), &opt_ep);
+        if (ret == 0)
+            ret = add_replay_endpoint(iter.name + offset, iter.name_len - offset, opt_replay.file,
+                                      opt_replay.speed, opt_replay.loop);
+        if (ret == 0)
+            ret = set_endpoint_options(opt.endpoints, &opt_ep);
+        free(opt_replay.file);
+        free(opt_ep.allow_src);
+        free(opt_ep.deny_src);
+        free(opt_ep.group);
+        if (ret < 0)
+            return ret;
+    }
+
+    iter = {};
+    pattern = "rule *";
+    offset = strlen(pattern) - 1;
+    while (conf.get_sections(pattern, &iter) == 0) {
+        struct option_rule opt_rule = {nullptr, nullptr};
+        ret = conf.extract_options(&iter, option_table_rule, ARRAY_SIZE(option_table_rule),
+                                   &opt_rule);
+        if (ret == 0)
+            ret = add_rule(iter.name + offset, iter.name_len - offset, opt_rule.match,
+                           opt_rule.action);
+        if (ret < 0) {
+            free(opt_rule.match);
+            free(opt_rule.action);
+            return ret;
+        }
+    }
+
     iter = {};
     pattern = "tcpendpoint *";
     offset = strlen(pattern) - 1;
     while (conf.get_sections(pattern, &iter) == 0) {
         struct option_tcp opt_tcp = {nullptr, ULONG_MAX, DEFAULT_RETRY_TCP_TIMEOUT};
+        struct option_endpoint opt_ep = {};
         ret = conf.extract_options(&iter, option_table_tcp, ARRAY_SIZE(option_table_tcp), &opt_tcp);
+        if (ret == 0)
+            ret = conf.extract_options(&iter, option_table_endpoint,
+                                       ARRAY_SIZE(option_table_endpoint), &opt_ep);
 
         if (ret == 0) {
             ret = add_tcp_endpoint_address(iter.name + offset, iter.name_len - offset, opt_tcp.addr,
                                            opt_tcp.port, opt_tcp.timeout);
         }
+        if (ret == 0)
+            ret = set_endpoint_options(opt.endpoints, &opt_ep);
         free(opt_tcp.addr);
+        free(opt_ep.allow_src);
+        free(opt_ep.deny_src);
+        free(opt_ep.group);
         if (ret < 0)
             return ret;
     }
@@ -888,15 +1201,30 @@ static void free_endpoints_options_strings(struct options* opts)
         if (e->type == Udp || e->type == Tcp) {
             free(e->address);
             free(e->coalesce_nodelay);
+            free(e->rx_filter);
+        } else if (e->type == Replay) {
+            free(e->replay_file);
         } else {
             free(e->device);
             delete e->bauds;
         }
         free(e->filter);
+        free(e->allow_src);
+        free(e->deny_src);
+        free(e->group);
         free(e->name);
         free(e);
         e = next;
     }
+
+    for (auto r = opts->rules; r;) {
+        auto next = r->next;
+        free(r->name);
+        free(r->match);
+        free(r->action);
+        free(r);
+        r = next;
+    }
 }
 
 int main(int argc, char *argv[])
@@ -940,6 +1268,11 @@ int main(int argc, char *argv[])
     free_endpoints_options_strings(&opt);
 
     free(opt.logs_dir);
+    free(opt.snapshot_msgs);
+    free(opt.tlog_dir);
+    free(opt.tlog_msgs);
+    free(opt.capture_dir);
+    free(opt.capture_msgs);
 
     Log::close();
 
@@ -949,6 +1282,11 @@ endpoint_error:
     free_endpoints_options_strings(&opt);
 
     free(opt.logs_dir);
+    free(opt.snapshot_msgs);
+    free(opt.tlog_dir);
+    free(opt.tlog_msgs);
+    free(opt.capture_dir);
+    free(opt.capture_msgs);
 
 close_log:
     Log::close();
@@ -25,6 +25,7 @@
 #include <sys/timerfd.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <sstream>
@@ -37,6 +38,9 @@
 #define TIMEOUT_LOG_SHUTDOWN_US     5000000ULL // number of microseconds we wait until we give up trying to stop log streaming
                                         // after a shutdown of mavlink router was requested
 
+#define SHAPER_INTERVAL_MSEC 10
+#define PARAM_CACHE_INTERVAL_MSEC 10
+
 static const char* pipe_path = "/tmp/mavlink_router_pipe";
 
 Mainloop* Mainloop::instance = nullptr;
@@ -130,7 +134,7 @@ int Mainloop::remove_fd(int fd)
 
 int Mainloop::write_msg(Endpoint *e, const struct buffer *buf)
 {
-    int r = e->write_msg(buf);
+    int r = e->has_shaper() ? e->write_shaped_msg(buf) : e->write_msg(buf);
 
     /*
      * If endpoint would block, add EPOLLOUT event to get notified when it's
@@ -138,48 +142,169 @@ int Mainloop::write_msg(Endpoint *e, const struct buffer *buf)
      */
     if (r == -EAGAIN)
         mod_fd(e->fd, e, EPOLLIN | EPOLLOUT);
+    else if (r >= 0 && _capture_endpoint)
+        _capture_endpoint->capture(e, true, buf);
 
     return r;
 }
 
+void Mainloop::_route_to(Endpoint *e, const struct buffer *buf, int target_sysid,
+                         int target_compid, int sender_sysid, int sender_compid, uint32_t msg_id)
+{
+    // Endpoint asked for a lower rate of this message
+    if (!_msg_intervals.should_send(e, sender_sysid, sender_compid, msg_id))
+        return;
+
+    log_debug("Endpoint [%d] accepted message to %d/%d from %u/%u", e->fd, target_sysid,
+              target_compid, sender_sysid, sender_compid);
+    if (write_msg(e, buf) == -EPIPE)
+        should_process_tcp_hangups = true;
+    e->postprocess_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id);
+}
+
+void Mainloop::_update_route_cache_index()
+{
+    _cached_endpoints.clear();
+
+    for (const auto &e : _endpoints)
+        _cached_endpoints.push_back(e.get());
+    for (auto i : _dynamic_endpoints)
+        _cached_endpoints.push_back(i.second);
+    for (auto *t = g_tcp_endpoints; t; t = t->next)
+        _cached_endpoints.push_back(t->endpoint);
+
+    for (unsigned int i = 0; i < _cached_endpoints.size(); i++)
+        _cached_endpoints[i]->cache_index = i;
+
+    _route_cache_generation = RouteCache::generation();
+}
+
 void Mainloop::route_msg(struct buffer *buf, int target_sysid, int target_compid, int sender_sysid,
-                         int sender_compid, uint32_t msg_id)
+                         int sender_compid, uint32_t msg_id, Endpoint *source)
 {
     bool unknown = true;
-
-    for (const auto& e : _endpoints) {
-        if (e->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
-            log_debug("Endpoint [%d] accepted message to %d/%d from %u/%u", e->fd, target_sysid,
-                      target_compid, sender_sysid, sender_compid);
-            write_msg(e.get(), buf);
-            e->postprocess_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id);
-            unknown = false;
+    uint64_t routed = 0;
+    // Replies to a request are only sent to the requester and logged
+    Endpoint *requester
+        = _steering.find_requester(buf, msg_id, sender_sysid, sender_compid, target_sysid);
+
+    _snapshot.store(buf, sender_sysid, sender_compid, msg_id);
+
+    if (_tlog_endpoint)
+        _tlog_endpoint->record(buf, msg_id);
+    if (_capture_endpoint)
+        _capture_endpoint->capture(source, false, buf);
+
+    if (_route_cache_generation != RouteCache::generation())
+        _update_route_cache_index();
+    const bool use_cache = !requester && _cached_endpoints.size() <= RouteCache::MAX_ENDPOINTS;
+
+    if (use_cache) {
+        auto *entry
+            = _route_cache.lookup(target_sysid, target_compid, sender_sysid, sender_compid, msg_id);
+        if (entry) {
+            for (uint64_t m = entry->endpoints; m; m &= m - 1) {
+                _route_to(_cached_endpoints[__builtin_ctzll(m)], buf, target_sysid, target_compid,
+                          sender_sysid, sender_compid, msg_id);
+            }
+            unknown = entry->unknown;
+            goto done;
         }
     }
 
-    for (auto i: _dynamic_endpoints) {
-        if (i.second->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
-            log_debug("Endpoint [%d] accepted message to %d/%d from %u/%u", i.second->fd, target_sysid,
-                      target_compid, sender_sysid, sender_compid);
-            write_msg(i.second, buf);
-            unknown = false;
-            i.second->postprocess_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id);
+    {
+        // Restriction from the first matching routing rule, applied on top of target routing
+        const RoutingRules::decision rule = _routing_rules.evaluate(
+            target_sysid, target_compid, sender_sysid, sender_compid, msg_id);
+
+        // Broadcast messages are checked once per group of endpoints, below
+        const bool by_group = !requester && (target_sysid == 0 || target_sysid == -1);
+
+        for (const auto& e : _endpoints) {
+            if (requester && e.get() != requester && e.get() != _log_endpoint)
+                continue;
+            if (by_group && e->group())
+                continue;
+
+            if (e->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
+                unknown = false;
+                if (e.get() != _log_endpoint && !rule.allows(e->rule_mask()))
+                    continue;
+
+                routed |= 1ULL << (e->cache_index & 63);
+                _route_to(e.get(), buf, target_sysid, target_compid, sender_sysid, sender_compid,
+                          msg_id);
+            }
         }
-    }
 
-    for (struct endpoint_entry *e = g_tcp_endpoints; e; e = e->next) {
-        if (e->endpoint->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
-            log_debug("Endpoint [%d] accepted message to %d/%d from %u/%u", e->endpoint->fd,
-                      target_sysid, target_compid, sender_sysid, sender_compid);
-            int r = write_msg(e->endpoint, buf);
-            if (r == -EPIPE) {
-                should_process_tcp_hangups = true;
+        for (auto i: _dynamic_endpoints) {
+            if (requester && i.second != requester)
+                continue;
+
+            if (i.second->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
+                unknown = false;
+                if (!rule.allows(i.second->rule_mask()))
+                    continue;
+
+                routed |= 1ULL << (i.second->cache_index & 63);
+                _route_to(i.second, buf, target_sysid, target_compid, sender_sysid, sender_compid,
+                          msg_id);
+            }
+        }
+
+        for (struct endpoint_entry *e = g_tcp_endpoints; e; e = e->next) {
+            if (requester && e->endpoint != requester)
+                continue;
+            if (by_group && e->endpoint->group())
+                continue;
+
+            if (e->endpoint->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
+                unknown = false;
+                if (!rule.allows(e->endpoint->rule_mask()))
+                    continue;
+
+                routed |= 1ULL << (e->endpoint->cache_index & 63);
+                _route_to(e->endpoint, buf, target_sysid, target_compid, sender_sysid,
+                          sender_compid, msg_id);
+            }
+        }
+
+        for (const auto &g : _groups) {
+            const auto &members = g->members();
+
+            if (!by_group || members.empty())
+                continue;
+
+            // A member is the source: check each one so it doesn't get its own message back
+            const bool from_member = g->has_route(sender_sysid, sender_compid);
+            if (!from_member
+                && !members[0]->accept_msg(target_sysid, target_compid, sender_sysid,
+                                           sender_compid, msg_id))
+                continue;
+
+            for (auto *e : members) {
+                if (from_member
+                    && !e->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid,
+                                      msg_id))
+                    continue;
+
+                unknown = false;
+                if (!rule.allows(e->rule_mask()))
+                    continue;
+
+                routed |= 1ULL << (e->cache_index & 63);
+                _route_to(e, buf, target_sysid, target_compid, sender_sysid, sender_compid,
+                          msg_id);
             }
-            unknown = false;
-            e->endpoint->postprocess_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id);
         }
+
+        // Writing may have changed routes or endpoints, e.g. on TCP hangups
+        if (use_cache && _route_cache_generation == RouteCache::generation())
+            _route_cache.store(target_sysid, target_compid, sender_sysid, sender_compid, msg_id,
+                               routed, unknown);
     }
 
+done:
     if (unknown) {
         _errors_aggregate.msg_to_unknown++;
         log_debug("Message to unknown sysid/compid: %u/%u", target_sysid, target_compid);
@@ -194,6 +319,7 @@ void Mainloop::process_tcp_hangups()
     while (*first && !(*first)->endpoint->is_valid()) {
         struct endpoint_entry *next = (*first)->next;
         remove_fd((*first)->endpoint->fd);
+        _forget_endpoint((*first)->endpoint);
         if ((*first)->endpoint->retry_timeout > 0) {
             _add_tcp_retry((*first)->endpoint);
         } else {
@@ -211,6 +337,7 @@ void Mainloop::process_tcp_hangups()
             if (!current->endpoint->is_valid()) {
                 prev->next = current->next;
                 remove_fd(current->endpoint->fd);
+                _forget_endpoint(current->endpoint);
                 if (current->endpoint->retry_timeout > 0) {
                     _add_tcp_retry(current->endpoint);
                 } else {
@@ -239,6 +366,7 @@ int Mainloop::_add_tcp_endpoint(TcpEndpoint *tcp)
     tcp_entry->next = g_tcp_endpoints;
     tcp_entry->endpoint = tcp;
     g_tcp_endpoints = tcp_entry;
+    RouteCache::invalidate();
 
     add_fd(tcp->fd, tcp, EPOLLIN);
 
@@ -258,7 +386,15 @@ void Mainloop::handle_tcp_connection()
     if (_add_tcp_endpoint(tcp) < 0)
         goto add_error;
 
+    // Clients of the TCP server have no options of their own
+    if (!_tcp_clients_group) {
+        _groups.emplace_back(new EndpointGroup{"TCP clients"});
+        _tcp_clients_group = _groups.back().get();
+    }
+    _tcp_clients_group->add_member(tcp);
+
     log_debug("Accepted TCP connection on [%d]", fd);
+    send_snapshot(tcp);
     return;
 
 add_error:
@@ -279,6 +415,9 @@ void Mainloop::loop()
 
     add_timeout(LOG_AGGREGATE_INTERVAL_SEC * MSEC_PER_SEC,
                 std::bind(&Mainloop::_log_aggregate_timeout, this, std::placeholders::_1), this);
+    if (_route_ttl_ms)
+        add_timeout(ROUTE_CHECK_INTERVAL_SEC * MSEC_PER_SEC,
+                    std::bind(&Mainloop::_route_timeout_cb, this, std::placeholders::_1), this);
 
     while (!_should_exit.load(std::memory_order_relaxed)) {
         run_single(-1);
@@ -301,7 +440,14 @@ void Mainloop::loop()
         _log_endpoint->stop();
     }
 
+    if (_tlog_endpoint)
+        _tlog_endpoint->stop();
+    if (_capture_endpoint)
+        _capture_endpoint->stop();
+
     // free all remaning Timeouts
+    _shaper_timeout = nullptr;
+    _param_cache_timeout = nullptr;
     while (_timeouts) {
         Timeout *current = _timeouts;
         _timeouts = current->next;
@@ -379,6 +525,114 @@ bool Mainloop::_log_aggregate_timeout(void *data)
     return true;
 }
 
+bool Mainloop::_route_timeout_cb(void *data)
+{
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+    std::map<uint16_t, uint64_t> last_seen;
+    std::vector<Endpoint *> endpoints;
+
+    for (const auto &e : _endpoints)
+        endpoints.push_back(e.get());
+    for (auto i : _dynamic_endpoints)
+        endpoints.push_back(i.second);
+    for (auto *t = g_tcp_endpoints; t; t = t->next)
+        endpoints.push_back(t->endpoint);
+
+    for (auto *e : endpoints) {
+        for (const auto &r : e->routes()) {
+            uint64_t &newest = last_seen[r.sys_comp_id];
+            newest = std::max(newest, r.last_seen_ms);
+        }
+    }
+
+    for (auto *e : endpoints)
+        e->expire_routes(now_ms, _route_ttl_ms, last_seen);
+
+    for (const auto &g : _groups)
+        g->update_routes();
+
+    return true;
+}
+
+bool Mainloop::answer_from_cache(Endpoint *e, const struct buffer *buf, uint32_t msg_id,
+                                 uint8_t src_sysid, uint8_t src_compid, int target_sysid,
+                                 int target_compid)
+{
+    if (_msg_intervals.handle_msg(e, buf, msg_id, src_sysid, src_compid, target_sysid,
+                                  target_compid))
+        return true;
+
+    if (_mission_cache.handle_msg(e, buf, msg_id, src_sysid, src_compid, target_sysid,
+                                  target_compid))
+        return true;
+
+    if (!_param_cache.handle_msg(e, buf, msg_id, src_sysid, src_compid, target_sysid,
+                                 target_compid))
+        return false;
+
+    if (!_param_cache_timeout) {
+        _param_cache_timeout = add_timeout(
+            PARAM_CACHE_INTERVAL_MSEC,
+            std::bind(&Mainloop::_param_cache_timeout_cb, this, std::placeholders::_1), this);
+    }
+
+    return true;
+}
+
+bool Mainloop::_param_cache_timeout_cb(void *data)
+{
+    if (_param_cache.send_pending())
+        return true;
+
+    _param_cache_timeout = nullptr;
+    return false;
+}
+
+void Mainloop::_forget_endpoint(Endpoint *e)
+{
+    RouteCache::invalidate();
+    _steering.remove_endpoint(e);
+    _param_cache.remove_endpoint(e);
+    _mission_cache.remove_endpoint(e);
+    _msg_intervals.remove_endpoint(e);
+    if (_capture_endpoint)
+        _capture_endpoint->forget_endpoint(e);
+    if (e->group())
+        e->group()->remove_member(e);
+}
+
+void Mainloop::start_shaper()
+{
+    if (_shaper_timeout)
+        return;
+
+    _shaper_timeout = add_timeout(SHAPER_INTERVAL_MSEC,
+                                  std::bind(&Mainloop::_shaper_timeout_cb, this, std::placeholders::_1),
+                                  this);
+}
+
+bool Mainloop::_shaper_timeout_cb(void *data)
+{
+    bool pending = false;
+
+    for (const auto &e : _endpoints) {
+        pending |= e->flush_shaped_msgs();
+    }
+
+    for (auto i: _dynamic_endpoints) {
+        pending |= i.second->flush_shaped_msgs();
+    }
+
+    for (auto *t = g_tcp_endpoints; t; t = t->next) {
+        pending |= t->endpoint->flush_shaped_msgs();
+    }
+
+    if (!pending)
+        _shaper_timeout = nullptr;
+
+    return pending;
+}
+
 void Mainloop::print_statistics()
 {
     for (const auto & e : _endpoints) {
@@ -389,6 +643,10 @@ void Mainloop::print_statistics()
     }
     for (auto *t = g_tcp_endpoints; t; t = t->next)
         t->endpoint->print_statistics();
+    if (_tlog_endpoint)
+        _tlog_endpoint->print_statistics();
+    if (_capture_endpoint)
+        _capture_endpoint->print_statistics();
 }
 
 static bool _print_statistics_timeout_cb(void *data)
@@ -408,6 +666,7 @@ bool Mainloop::remove_dynamic_endpoint(Endpoint *endpoint)
         if (i->second == endpoint) {
             log_info("Removing dynamic endpoint: %s", i->first.c_str());
             remove_fd(i->second->fd);
+            _forget_endpoint(i->second);
             delete i->second;
             _pipe_commands.erase(i->first);
             _dynamic_endpoints.erase(i);
@@ -418,12 +677,43 @@ bool Mainloop::remove_dynamic_endpoint(Endpoint *endpoint)
     return false;
 }
 
+bool Mainloop::subscribe_dynamic_endpoint(const dynamic_command& command)
+{
+    auto i = _dynamic_endpoints.find(command.name);
+    if (i == _dynamic_endpoints.end()) {
+        log_warning("Unknown dynamic endpoint: %s", command.name.c_str());
+        return false;
+    }
+
+    log_info("Dynamic endpoint %s subscribed to %zu messages", i->first.c_str(),
+             command.subscribe_ids.size());
+    i->second->set_subscriptions(command.subscribe_ids);
+
+    return true;
+}
+
+bool Mainloop::set_capture(bool enabled)
+{
+    if (!_capture_endpoint) {
+        log_warning("Capture is not configured");
+        return false;
+    }
+
+    if (!enabled) {
+        _capture_endpoint->stop();
+        return true;
+    }
+
+    return _capture_endpoint->start();
+}
+
 bool Mainloop::remove_dynamic_endpoint(const dynamic_command& command)
 {
     for (auto i = _dynamic_endpoints.begin(); i != _dynamic_endpoints.end(); i++) {
         if (i->first == command.name) {
             log_info("Removing dynamic endpoint: %s", i->first.c_str());
             remove_fd(i->second->fd);
+            _forget_endpoint(i->second);
             delete i->second;
             _pipe_commands.erase(i->first);
             _dynamic_endpoints.erase(i);
@@ -459,23 +749,47 @@ bool Mainloop::add_dynamic_endpoint(const dynamic_command& command)
     for (int id : command.coalesce_nodelay_ids) {
         endpoint->add_message_to_nodelay(id);
     }
+    endpoint->set_rule_mask(_routing_rules.endpoint_mask(command.name));
 
     remove_dynamic_endpoint(command);
     log_info("Adding dynamic endpoint: %s - coalesce %d bytes %d ms", command.name.c_str(), command.coalesce_bytes, command.coalesce_ms);
     _pipe_commands[command.name] = command.command;
     add_fd(endpoint->fd, endpoint.get(), EPOLLIN);
     _dynamic_endpoints[command.name] = endpoint.get();
+    RouteCache::invalidate();
     endpoint->start_expire_timer();
     endpoint.release();
 
     return true;
 }
 
+/*
+ * Parse a comma separated list of message ids
+ */
+static std::vector<uint32_t> parse_msg_id_list(const char *list)
+{
+    std::vector<uint32_t> msg_ids;
+    char *local_list = strdup(list);
+    char *saveptr = nullptr;
+
+    for (char *token = strtok_r(local_list, ",", &saveptr); token;
+         token = strtok_r(nullptr, ",", &saveptr))
+        msg_ids.push_back(atoi(token));
+    free(local_list);
+
+    return msg_ids;
+}
+
 bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
 {
     unsigned n_endpoints = 0;
     struct endpoint_config *conf;
 
+    for (struct rule_config *rule = opt->rules; rule; rule = rule->next) {
+        if (_routing_rules.add_rule(rule->name, rule->match, rule->action) < 0)
+            return false;
+    }
+
     for (conf = opt->endpoints; conf; conf = conf->next) {
         if (conf->type != Tcp) {
             // TCP endpoints are ephemeral, that's why they don't
@@ -507,6 +821,10 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
                     return false;
             }
 
+            if (!_set_endpoint_options(uart.get(), conf))
+                return false;
+            if (conf->group && !_join_group(uart.get(), conf->group))
+                return false;
             mainloop.add_fd(uart->fd, uart.get(), EPOLLIN);
             _endpoints.push_back(std::move(uart));
             break;
@@ -540,13 +858,40 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
                 free(local_nodelay);
             }
 
+            if (conf->rx_filter)
+                udp->set_rx_filter(parse_msg_id_list(conf->rx_filter));
+
+            if (!_set_endpoint_options(udp.get(), conf))
+                return false;
+            if (conf->group && !_join_group(udp.get(), conf->group))
+                return false;
             mainloop.add_fd(udp->fd, udp.get(), EPOLLIN);
             _endpoints.push_back(std::move(udp));
             break;
         }
+        case Replay: {
+            std::unique_ptr<ReplayEndpoint> replay{new ReplayEndpoint{}};
+            if (replay->open(conf->replay_file, conf->replay_speed, conf->replay_loop) < 0)
+                return false;
+
+            if (!_set_endpoint_options(replay.get(), conf))
+                return false;
+            if (conf->group && !_join_group(replay.get(), conf->group))
+                return false;
+            mainloop.add_fd(replay->fd, replay.get(), EPOLLIN);
+            _endpoints.push_back(std::move(replay));
+            break;
+        }
         case Tcp: {
             std::unique_ptr<TcpEndpoint> tcp{new TcpEndpoint{}};
             tcp->retry_timeout = conf->retry_timeout;
+            if (conf->group) {
+                // Reconnections replace the endpoint, keep them out of groups
+                log_error("Group is not supported on TCP endpoints");
+                return false;
+            }
+            if (!_set_endpoint_options(tcp.get(), conf))
+                return false;
             if (tcp->open(conf->address, conf->port) < 0) {
                 log_error("Could not open %s:%ld.", conf->address, conf->port);
                 if (tcp->retry_timeout > 0) {
@@ -568,39 +913,183 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
         }
     }
 
+    _dedup.set_period(opt->dedup_period);
+    _route_ttl_ms = opt->route_ttl * MSEC_PER_SEC;
+    _steering.set_enabled(opt->response_steering);
+    _param_cache.set_enabled(opt->param_cache);
+    _mission_cache.set_enabled(opt->mission_cache);
+    _msg_intervals.set_enabled(opt->aggregate_msg_intervals);
+
+    if (opt->snapshot_msgs) {
+        for (uint32_t msg_id : parse_msg_id_list(opt->snapshot_msgs))
+            _snapshot.add_msg_id(msg_id);
+    }
+
     if (opt->tcp_port) {
         g_tcp_fd = tcp_open(opt->tcp_port);
     }
 
 
+    struct log_storage_options storage;
+    storage.prealloc_size = opt->log_prealloc_size;
+    storage.ulog_buffer_size = opt->ulog_buffer_size;
+    storage.sync_mode = opt->log_sync_mode;
+    storage.sync_bytes = opt->log_sync_bytes;
+    storage.sync_interval = opt->log_sync_interval;
+
     if (opt->logs_dir) {
         std::unique_ptr<LogEndpoint> log_endpoint;
+
+        if (opt->ulog_buffer_size < ULOG_MIN_BUFFER_SIZE) {
+            log_error("ULogBufferSize must be at least %u bytes", ULOG_MIN_BUFFER_SIZE);
+            return false;
+        }
+
         if (opt->mavlink_dialect == Ardupilotmega) {
             log_endpoint.reset(
                 new BinLog(opt->logs_dir, opt->log_mode, opt->min_free_space, opt->max_log_files, opt->heartbeat));
         } else if (opt->mavlink_dialect == Common) {
-            log_endpoint.reset(
-                new ULog(opt->logs_dir, opt->log_mode, opt->min_free_space, opt->max_log_files, opt->heartbeat));
+            log_endpoint.reset(new ULog(opt->logs_dir, opt->log_mode, opt->min_free_space,
+                                        opt->max_log_files, opt->heartbeat));
         } else {
             log_endpoint.reset(new AutoLog(opt->logs_dir, opt->log_mode, opt->min_free_space,
                                         opt->max_log_files, opt->heartbeat));
         }
+        log_endpoint->set_storage_options(storage);
         _log_endpoint = log_endpoint.get();
         _log_endpoint->mark_unfinished_logs();
         _endpoints.push_back(std::move(log_endpoint));
     }
 
+    if (opt->tlog_dir) {
+        _tlog_endpoint.reset(
+            new TLogEndpoint(opt->tlog_dir, storage, opt->tlog_max_size, opt->tlog_max_time));
+
+        if (opt->tlog_msgs)
+            _tlog_endpoint->set_msg_filter(parse_msg_id_list(opt->tlog_msgs));
+
+        if (!_tlog_endpoint->start())
+            return false;
+    }
+
+    if (opt->capture_dir) {
+        _capture_endpoint.reset(new CaptureEndpoint(opt->capture_dir, storage));
+
+        if (opt->capture_msgs)
+            _capture_endpoint->set_msg_filter(parse_msg_id_list(opt->capture_msgs));
+
+        if (opt->capture_enabled && !_capture_endpoint->start())
+            return false;
+    }
+
+    RouteCache::invalidate();
+
     if (opt->report_msg_statistics)
         add_timeout(MSEC_PER_SEC, _print_statistics_timeout_cb, this);
 
     return true;
 }
 
+/*
+ * Parse a list of sources like "1,255:190" into a bitmap indexed by
+ * sysid << 8 | compid. A sysid alone stands for all its components.
+ */
+static int parse_src_list(const char *list, std::vector<bool> &bitmap)
+{
+    char *local_list = strdup(list);
+    char *saveptr = nullptr;
+    int ret = 0;
+
+    assert_or_return(local_list, -ENOMEM);
+    bitmap.assign(UINT16_MAX + 1, false);
+
+    for (char *token = strtok_r(local_list, ",", &saveptr); token;
+         token = strtok_r(nullptr, ",", &saveptr)) {
+        unsigned long sysid, compid;
+        char *end;
+
+        sysid = strtoul(token, &end, 10);
+        if (end == token || sysid > UINT8_MAX) {
+            ret = -EINVAL;
+            break;
+        }
+
+        if (*end == '\0') {
+            for (unsigned int i = 0; i <= UINT8_MAX; i++)
+                bitmap[sysid << 8 | i] = true;
+            continue;
+        }
+
+        token = end + 1;
+        compid = strtoul(token, &end, 10);
+        if (end == token || *end != '\0' || compid > UINT8_MAX) {
+            ret = -EINVAL;
+            break;
+        }
+        bitmap[sysid << 8 | compid] = true;
+    }
+
+    free(local_list);
+    return ret;
+}
+
+bool Mainloop::_set_endpoint_options(Endpoint *e, const struct endpoint_config *conf)
+{
+    std::vector<bool> allow_src, deny_src;
+
+    if (conf->allow_src && parse_src_list(conf->allow_src, allow_src) < 0) {
+        log_error("Invalid AllowSrc list '%s'", conf->allow_src);
+        return false;
+    }
+
+    if (conf->deny_src && parse_src_list(conf->deny_src, deny_src) < 0) {
+        log_error("Invalid DenySrc list '%s'", conf->deny_src);
+        return false;
+    }
+
+    e->set_src_filter(std::move(allow_src), std::move(deny_src));
+    e->set_max_bitrate(conf->max_bitrate);
+    e->set_radio_link(conf->radio_link);
+    if (conf->name)
+        e->set_rule_mask(_routing_rules.endpoint_mask(conf->name));
+    if (conf->group)
+        e->set_rule_mask(e->rule_mask() | _routing_rules.endpoint_mask(conf->group));
+
+    return true;
+}
+
+bool Mainloop::_join_group(Endpoint *e, const char *name)
+{
+    EndpointGroup *group = nullptr;
+
+    for (const auto &g : _groups) {
+        if (g.get() != _tcp_clients_group && g->name() == name) {
+            group = g.get();
+            break;
+        }
+    }
+
+    if (!group) {
+        _groups.emplace_back(new EndpointGroup{name});
+        group = _groups.back().get();
+    } else if (!group->members()[0]->has_same_filters(*e)) {
+        log_error("Endpoints of group %s must have the same filters and routing rules", name);
+        return false;
+    }
+
+    group->add_member(e);
+    return true;
+}
+
 void Mainloop::free_endpoints()
 {
     // XXX not explicitly needed since only called from constructor; leaving
     // here until remainder clean.
+    _groups.clear();
+    _tcp_clients_group = nullptr;
     _endpoints.clear();
+    _tlog_endpoint.reset();
+    _capture_endpoint.reset();
 
     for (auto *t = g_tcp_endpoints; t;) {
         auto next = t->next;
@@ -776,6 +1265,8 @@ int Mainloop::parse(const char* cmd_string, dynamic_command& cmd) {
       COALESCE_BYTES = 6,
       COALESCE_MS = 7,
       COALESCE_NODELAY = 8,
+      SUBSCRIBE_IDS = 2,
+      CAPTURE_STATE = 1,
     };
 
     std::istringstream stream(cmd_string);
@@ -792,6 +1283,35 @@ int Mainloop::parse(const char* cmd_string, dynamic_command& cmd) {
         cmd.name = tokens[1];
         return 0;
     }
+    else if (tokens.size() == 3 && tokens[CMD] == "subscribe") {
+        cmd.command = dynamic_command::subscribe;
+        cmd.name = tokens[1];
+
+        std::istringstream ids_split(tokens[SUBSCRIBE_IDS]);
+        for (std::string each; std::getline(ids_split, each, ',');) {
+            char *end;
+            errno = 0;
+            unsigned long id = strtoul(each.c_str(), &end, 10);
+            if (errno != 0 || *end != '\0' || each.empty() || id >= (1 << 24)) {
+                return -SUBSCRIBE_IDS;
+            }
+            cmd.subscribe_ids.push_back(id);
+        }
+        return 0;
+    }
+    else if (tokens.size() == 2 && tokens[CMD] == "unsubscribe") {
+        cmd.command = dynamic_command::unsubscribe;
+        cmd.name = tokens[1];
+        return 0;
+    }
+    else if (tokens.size() == 2 && tokens[CMD] == "capture") {
+        cmd.command = dynamic_command::capture;
+        if (tokens[1] != "on" && tokens[1] != "off") {
+            return -CAPTURE_STATE;
+        }
+        cmd.capture_enabled = (tokens[1] == "on");
+        return 0;
+    }
     else {
         cmd.command = dynamic_command::unknown_command;
         return -CMD;
@@ -885,6 +1405,17 @@ void Mainloop::_handle_pipe()
                     add_dynamic_endpoint(dcmd);
                     break;
                 }
+                case dynamic_command::subscribe:
+                case dynamic_command::unsubscribe:
+                {
+                    subscribe_dynamic_endpoint(dcmd);
+                    break;
+                }
+                case dynamic_command::capture:
+                {
+                    set_capture(dcmd.capture_enabled);
+                    break;
+                }
                 default:
                 {
                     log_warning("Unhandled dynamic endpoint command");
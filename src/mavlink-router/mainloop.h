@@ -24,9 +24,19 @@
 #include <map>
 
 #include "binlog.h"
+#include "captureendpoint.h"
 #include "comm.h"
+#include "dedup.h"
 #include "endpoint.h"
+#include "missioncache.h"
+#include "msginterval.h"
+#include "paramcache.h"
+#include "replayendpoint.h"
+#include "routingrules.h"
+#include "snapshot.h"
+#include "steering.h"
 #include "timeout.h"
+#include "tlogendpoint.h"
 #include "ulog.h"
 
 struct endpoint_entry {
@@ -35,13 +45,22 @@ struct endpoint_entry {
 };
 
 struct dynamic_command {
-    enum Command { add, remove, unknown_command } command = unknown_command;
+    enum Command {
+        add,
+        remove,
+        subscribe,
+        unsubscribe,
+        capture,
+        unknown_command
+    } command = unknown_command;
     enum Protocol { udp, unknown_protocol } protocol = unknown_protocol;
     std::string name, address;
     int port = -1;
     bool eavesdropping = false;
+    bool capture_enabled = false;
     int coalesce_bytes = 0, coalesce_ms = 0;
     std::vector<int> coalesce_nodelay_ids;
+    std::vector<uint32_t> subscribe_ids;
 };
 
 class Mainloop {
@@ -71,7 +90,7 @@ public:
     int run_single(int timeout_msec);
 
     void route_msg(struct buffer *buf, int target_sysid, int target_compid, int sender_sysid,
-                   int sender_compid, uint32_t msg_id = UINT32_MAX);
+                   int sender_compid, uint32_t msg_id = UINT32_MAX, Endpoint *source = nullptr);
     void handle_read(Endpoint *e);
     void handle_canwrite(Endpoint *e);
     void handle_tcp_connection();
@@ -81,12 +100,67 @@ public:
     void set_timeout(Timeout *t, uint32_t timeout_msec);
     void del_timeout(Timeout *t);
 
+    /*
+     * Start the timer releasing messages held by endpoints' rate shapers.
+     * It stops by itself once all shaper queues are empty.
+     */
+    void start_shaper();
+
+    /*
+     * Check if message was already received, possibly through another
+     * endpoint, within the configured deduplication period.
+     */
+    Dedup::PacketStatus check_duplicate(const struct buffer *buf, uint8_t src_sysid,
+                                        uint8_t src_compid, uint32_t msg_id)
+    {
+        return _dedup.check_packet(buf, src_sysid, src_compid, msg_id);
+    }
+
+    /*
+     * Remember @e sent a request, so that its reply is only routed back to
+     * it when response steering is enabled.
+     */
+    void track_request(Endpoint *e, const struct buffer *buf, uint32_t msg_id, uint8_t src_sysid,
+                       int target_sysid, int target_compid)
+    {
+        _steering.track_request(e, buf, msg_id, src_sysid, target_sysid, target_compid);
+    }
+
+    /*
+     * Update caches with message received on endpoint @e. Return true if
+     * the message is a request answered by the router itself, in which case
+     * it must not be routed.
+     */
+    bool answer_from_cache(Endpoint *e, const struct buffer *buf, uint32_t msg_id,
+                           uint8_t src_sysid, uint8_t src_compid, int target_sysid,
+                           int target_compid);
+
+    /*
+     * Send latest state of known systems to a newly connected client
+     */
+    void send_snapshot(Endpoint *e)
+    {
+        if (_snapshot.enabled())
+            _snapshot.send(e);
+    }
+
     bool add_endpoints(Mainloop &mainloop, struct options *opt);
 
     bool add_dynamic_endpoint(const dynamic_command& command);
     bool remove_dynamic_endpoint(const dynamic_command& command);
     bool remove_dynamic_endpoint(Endpoint *endpoint);
 
+    /*
+     * Set broadcast messages delivered to a dynamic endpoint. An empty set
+     * delivers all of them again.
+     */
+    bool subscribe_dynamic_endpoint(const dynamic_command& command);
+
+    /*
+     * Start or stop capturing routed messages, if Capture is configured
+     */
+    bool set_capture(bool enabled);
+
     void print_statistics();
 
     int epollfd = -1;
@@ -123,11 +197,14 @@ public:
 
 private:
     static const unsigned int LOG_AGGREGATE_INTERVAL_SEC = 5;
+    static const unsigned int ROUTE_CHECK_INTERVAL_SEC = 1;
 
     endpoint_entry *g_tcp_endpoints = nullptr;
     std::vector<std::unique_ptr<Endpoint>> _endpoints;
     int g_tcp_fd = -1;
     LogEndpoint *_log_endpoint = nullptr;
+    std::unique_ptr<TLogEndpoint> _tlog_endpoint;
+    std::unique_ptr<CaptureEndpoint> _capture_endpoint;
 
     std::map<std::string, dynamic_command::Command> _pipe_commands;
     std::map<std::string, Endpoint *> _dynamic_endpoints;
@@ -135,6 +212,22 @@ private:
     struct options* _options{nullptr};
 
     Timeout *_timeouts = nullptr;
+    Timeout *_shaper_timeout = nullptr;
+    Dedup _dedup;
+    ResponseSteering _steering;
+    ParamCache _param_cache;
+    MissionCache _mission_cache;
+    Snapshot _snapshot;
+    MessageIntervals _msg_intervals;
+    RoutingRules _routing_rules;
+    std::vector<std::unique_ptr<EndpointGroup>> _groups;
+    EndpointGroup *_tcp_clients_group = nullptr;
+    RouteCache _route_cache;
+    // Endpoints indexed by their bit in route cache entries
+    std::vector<Endpoint *> _cached_endpoints;
+    uint32_t _route_cache_generation = 0;
+    Timeout *_param_cache_timeout = nullptr;
+    uint32_t _route_ttl_ms = 0;
 
     std::atomic<bool> _should_exit {false};
 
@@ -149,6 +242,15 @@ private:
     void _add_tcp_retry(TcpEndpoint *tcp);
     bool _retry_timeout_cb(void *data);
     bool _log_aggregate_timeout(void *data);
+    bool _shaper_timeout_cb(void *data);
+    bool _route_timeout_cb(void *data);
+    bool _param_cache_timeout_cb(void *data);
+    void _forget_endpoint(Endpoint *e);
+    bool _set_endpoint_options(Endpoint *e, const struct endpoint_config *conf);
+    bool _join_group(Endpoint *e, const char *name);
+    void _update_route_cache_index();
+    void _route_to(Endpoint *e, const struct buffer *buf, int target_sysid, int target_compid,
+                   int sender_sysid, int sender_compid, uint32_t msg_id);
     void _handle_pipe();
 
     static Mainloop* instance;
@@ -169,7 +271,7 @@ private:
     struct sigaction _old_sigpipe;
 };
 
-enum endpoint_type { Tcp, Uart, Udp, Unknown };
+enum endpoint_type { Tcp, Uart, Udp, Replay, Unknown };
 enum mavlink_dialect { Auto, Common, Ardupilotmega };
 
 struct endpoint_config {
@@ -185,18 +287,37 @@ struct endpoint_config {
             int coalesce_ms;        // max time to hold data to try to send packets together
             int coalesce_bytes;     // never send packets larger than this size
             char *coalesce_nodelay; // immediately send if a mavlink msg_id is matching this
+            char *rx_filter;        // only accept received messages with these msg_ids
         };
         struct {
             char *device;
             std::vector<unsigned long> *bauds;
             bool flowcontrol;
         };
+        struct {
+            char *replay_file;
+            double replay_speed; // 0 to replay as fast as possible
+            bool replay_loop;
+        };
     };
     char *filter;
+    unsigned long max_bitrate; // bits per second sent to endpoint, 0 for unlimited
+    bool radio_link;           // pace endpoint based on RADIO_STATUS received from it
+    char *allow_src;           // only accept messages from these sysid[:compid]
+    char *deny_src;            // reject messages from these sysid[:compid]
+    char *group;               // share routing decisions with endpoints of this group
+};
+
+struct rule_config {
+    struct rule_config *next;
+    char *name;
+    char *match;
+    char *action;
 };
 
 struct options {
     struct endpoint_config *endpoints;
+    struct rule_config *rules;
     const char *conf_file_name;
     const char *conf_dir;
     unsigned long tcp_port;
@@ -207,6 +328,25 @@ struct options {
     enum mavlink_dialect mavlink_dialect;
     unsigned long min_free_space;
     unsigned long max_log_files;
+    unsigned long ulog_buffer_size;
+    unsigned long log_prealloc_size;
+    LogSyncMode log_sync_mode;
+    unsigned long log_sync_bytes;
+    unsigned long log_sync_interval;
+    char *tlog_dir;
+    unsigned long tlog_max_size;
+    unsigned long tlog_max_time;
+    char *tlog_msgs;
+    char *capture_dir;
+    char *capture_msgs;
+    bool capture_enabled;
+    unsigned long dedup_period;
+    unsigned long route_ttl;
+    bool response_steering;
+    bool param_cache;
+    bool mission_cache;
+    char *snapshot_msgs;
+    bool aggregate_msg_intervals;
     bool heartbeat;
     bool use_pipe;
 };
@@ -1,7 +1,15 @@
 #include "mainloop.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cstring>
 
+#include <common/util.h>
+
 #include <gtest/gtest.h>
 
 class MainLoopTest : public ::testing::Test {
@@ -256,6 +264,123 @@ TEST_F(MainLoopTest, direct_udp_endpoint_send_coalesce_nodelay)
 }
 
 
+TEST_F(MainLoopTest, direct_udp_endpoint_send_shaped)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    // 2000 bytes/s: the initial burst of one max sized packet lets the first
+    // 2 packets through
+    cfg.max_bitrate = 16000;
+    struct options opts = make_single_endpoint_options(&cfg);
+
+    Mainloop mainloop;
+
+    // Set up and grab one udp endpoint
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    UdpEndpoint* udp_endpoint = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[0].get());
+    ASSERT_NE(nullptr, udp_endpoint);
+    ASSERT_TRUE(udp_endpoint->has_shaper());
+
+    int sock;
+    std::tie(sock, udp_endpoint->sockaddr) = make_scratch_udp_socket();
+
+    char data[100] = {};
+    struct buffer buf = {100, reinterpret_cast<uint8_t*>(data)};
+    for (int i = 0; i < 5; i++) {
+        mainloop.write_msg(udp_endpoint, &buf);
+    }
+
+    char recvbuf[1024];
+    EXPECT_EQ(100, ::recv(sock, recvbuf, 1024, MSG_DONTWAIT));
+    EXPECT_EQ(100, ::recv(sock, recvbuf, 1024, MSG_DONTWAIT));
+
+    ssize_t count = ::recv(sock, recvbuf, 1024, MSG_DONTWAIT);
+    EXPECT_EQ(-1, count) << "Shaper shouldn't have allowed a send yet";
+    EXPECT_EQ(EWOULDBLOCK, errno);
+
+    // let the shaper release the queued packets, which takes ~110ms
+    int received = 0;
+    usec_t deadline = now_usec() + 500 * USEC_PER_MSEC;
+    while (received < 3 && now_usec() < deadline) {
+        mainloop.run_single(10);
+        while (::recv(sock, recvbuf, 1024, MSG_DONTWAIT) == 100) {
+            received++;
+        }
+    }
+    EXPECT_EQ(3, received);
+
+    ::close(sock);
+}
+
+TEST_F(MainLoopTest, udp_endpoint_radio_link_pacing)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    cfg.max_bitrate = 64000;
+    cfg.radio_link = true;
+    struct options opts = make_single_endpoint_options(&cfg);
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    Endpoint *radio = mainloop.endpoints()[0].get();
+    ASSERT_EQ(64000u, radio->bitrate());
+
+    int sock;
+    struct sockaddr_in addr;
+    std::tie(sock, addr) = make_scratch_udp_socket();
+    addr.sin_port = htons(7777);
+
+    // Radio reports the free space of its TX buffer, in percent
+    auto feed = [&](uint8_t txbuf) {
+        mavlink_message_t msg;
+        mavlink_radio_status_t status{};
+        uint8_t data[MAVLINK_MAX_PACKET_LEN];
+
+        status.txbuf = txbuf;
+        mavlink_msg_radio_status_encode(1, 68, &msg, &status);
+        const uint16_t len = mavlink_msg_to_send_buffer(data, &msg);
+        ::sendto(sock, data, len, 0, reinterpret_cast<const struct sockaddr *>(&addr),
+                 sizeof(addr));
+        radio->handle_read();
+    };
+
+    uint8_t attitude[] = {MAVLINK_STX, 1, 0, 0, 0, 1, 1, MAVLINK_MSG_ID_ATTITUDE, 0, 0, 0, 0, 0};
+    uint8_t heartbeat[] = {MAVLINK_STX, 1, 0, 0, 0, 1, 1, MAVLINK_MSG_ID_HEARTBEAT, 0, 0, 0, 0, 0};
+    struct buffer attitude_buf = {sizeof(attitude), attitude};
+    struct buffer heartbeat_buf = {sizeof(heartbeat), heartbeat};
+
+    // Halve below 20% free, back off by 1/8 below 50%
+    feed(15);
+    EXPECT_EQ(32000u, radio->bitrate());
+    feed(30);
+    EXPECT_EQ(28000u, radio->bitrate());
+
+    // Below 10% free only high priority messages go through
+    feed(5);
+    EXPECT_EQ(14000u, radio->bitrate());
+    EXPECT_EQ(0, mainloop.write_msg(radio, &attitude_buf));
+    EXPECT_EQ((int)sizeof(heartbeat), mainloop.write_msg(radio, &heartbeat_buf));
+
+    // Never below max/8, and still congested until 20% free
+    feed(5);
+    EXPECT_EQ(8000u, radio->bitrate());
+    feed(15);
+    EXPECT_EQ(8000u, radio->bitrate());
+    EXPECT_EQ(0, mainloop.write_msg(radio, &attitude_buf));
+
+    // Ramp up by max/16 above 90% free, up to max
+    feed(95);
+    EXPECT_EQ(12000u, radio->bitrate());
+    EXPECT_EQ((int)sizeof(attitude), mainloop.write_msg(radio, &attitude_buf));
+    for (int i = 0; i < 20; i++)
+        feed(95);
+    EXPECT_EQ(64000u, radio->bitrate());
+    feed(70);
+    EXPECT_EQ(64000u, radio->bitrate());
+
+    ::close(sock);
+}
+
 TEST_F(MainLoopTest, dynamic_udp_endpoint_send)
 {
     dynamic_command cmd;
@@ -400,4 +525,1559 @@ TEST(MainLoopParseTest, parse_add_dynamic_endpoint_eavesdropping_error) {
     dynamic_command cmd;
     EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), -5); // -EAVESDROPPING
     EXPECT_EQ(cmd.eavesdropping, false);
-}
\ No newline at end of file
+}
+
+TEST(DedupTest, duplicate_detection)
+{
+    Dedup dedup;
+    uint8_t data[] = {MAVLINK_STX, 1, 0, 0, 42, 1, 1, 0, 0, 0, 0x55, 0x12, 0x34};
+    struct buffer buf = {sizeof(data), data};
+
+    EXPECT_EQ(dedup.check_packet(&buf, 1, 1, 0), Dedup::PacketStatus::Disabled);
+
+    dedup.set_period(1000);
+    EXPECT_EQ(dedup.check_packet(&buf, 1, 1, 0), Dedup::PacketStatus::New);
+    EXPECT_EQ(dedup.check_packet(&buf, 1, 1, 0), Dedup::PacketStatus::Duplicate);
+
+    // Same packet from another source is not a duplicate
+    EXPECT_EQ(dedup.check_packet(&buf, 2, 1, 0), Dedup::PacketStatus::New);
+
+    // Neither is a packet with another sequence number
+    data[4] = 43;
+    EXPECT_EQ(dedup.check_packet(&buf, 1, 1, 0), Dedup::PacketStatus::New);
+}
+
+TEST(ResponseSteeringTest, steer_command_ack)
+{
+    ResponseSteering steering;
+    Endpoint *gcs1 = reinterpret_cast<Endpoint *>(0x1000);
+    Endpoint *gcs2 = reinterpret_cast<Endpoint *>(0x2000);
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX_MAVLINK1, sizeof(mavlink_command_long_t)};
+    struct buffer buf = {sizeof(data), data};
+    mavlink_command_long_t cmd{};
+    mavlink_command_ack_t ack{};
+
+    cmd.command = 400;
+    memcpy(data + sizeof(mavlink_router_mavlink1_header), &cmd, sizeof(cmd));
+    steering.set_enabled(true);
+    steering.track_request(gcs1, &buf, MAVLINK_MSG_ID_COMMAND_LONG, 255, 1, 1);
+
+    ack.command = 400;
+    data[1] = sizeof(ack);
+    memcpy(data + sizeof(mavlink_router_mavlink1_header), &ack, sizeof(ack));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_COMMAND_ACK, 1, 1, 0), gcs1);
+    // Reply from another system or targeted at another one is not steered
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_COMMAND_ACK, 2, 1, 0), nullptr);
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_COMMAND_ACK, 1, 1, 254), nullptr);
+
+    // Both endpoints waiting for the same reply: route as usual
+    data[1] = sizeof(cmd);
+    memcpy(data + sizeof(mavlink_router_mavlink1_header), &cmd, sizeof(cmd));
+    steering.track_request(gcs2, &buf, MAVLINK_MSG_ID_COMMAND_LONG, 255, 1, 1);
+    data[1] = sizeof(ack);
+    memcpy(data + sizeof(mavlink_router_mavlink1_header), &ack, sizeof(ack));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_COMMAND_ACK, 1, 1, 0), nullptr);
+
+    steering.remove_endpoint(gcs1);
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_COMMAND_ACK, 1, 1, 0), gcs2);
+}
+
+TEST(ResponseSteeringTest, param_set_during_list)
+{
+    ResponseSteering steering;
+    Endpoint *gcs1 = reinterpret_cast<Endpoint *>(0x1000);
+    Endpoint *gcs2 = reinterpret_cast<Endpoint *>(0x2000);
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX_MAVLINK1};
+    uint8_t *payload = data + sizeof(mavlink_router_mavlink1_header);
+    struct buffer buf = {sizeof(data), data};
+    mavlink_param_request_read_t read{};
+    mavlink_param_set_t set{};
+    mavlink_param_value_t value{};
+
+    steering.set_enabled(true);
+    steering.track_request(gcs1, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 1, 1);
+
+    data[1] = sizeof(value);
+    value.param_count = 3;
+    value.param_index = 0;
+    strcpy(value.param_id, "FOO");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), gcs1);
+
+    // Second GCS changes a parameter while the first is still downloading
+    data[1] = sizeof(set);
+    strcpy(set.param_id, "BAR");
+    memcpy(payload, &set, sizeof(set));
+    steering.track_request(gcs2, &buf, MAVLINK_MSG_ID_PARAM_SET, 254, 1, 1);
+
+    data[1] = sizeof(value);
+    value.param_index = 1;
+    strcpy(value.param_id, "BAR");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), nullptr);
+
+    value.param_index = 2;
+    strcpy(value.param_id, "BAZ");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), gcs1);
+
+    // Single parameter read only steers the value that was asked for
+    steering.remove_endpoint(gcs1);
+    data[1] = sizeof(read);
+    read.param_index = 2;
+    memcpy(payload, &read, sizeof(read));
+    steering.track_request(gcs2, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_READ, 254, 1, 1);
+
+    data[1] = sizeof(value);
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), gcs2);
+    value.param_index = 0;
+    strcpy(value.param_id, "FOO");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), nullptr);
+}
+
+TEST(ResponseSteeringTest, unsolicited_value_during_list)
+{
+    ResponseSteering steering;
+    Endpoint *gcs = reinterpret_cast<Endpoint *>(0x1000);
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX_MAVLINK1};
+    uint8_t *payload = data + sizeof(mavlink_router_mavlink1_header);
+    struct buffer buf = {sizeof(data), data};
+    mavlink_param_value_t value{};
+
+    steering.set_enabled(true);
+    steering.track_request(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 1, 1);
+
+    data[1] = sizeof(value);
+    value.param_count = 3;
+    value.param_index = 0;
+    strcpy(value.param_id, "FOO");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), gcs);
+
+    // Parameter changed on board while the list is downloaded
+    value.param_index = UINT16_MAX;
+    strcpy(value.param_id, "BAR");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), nullptr);
+
+    // Same, from an autopilot that sends the index
+    value.param_index = 0;
+    strcpy(value.param_id, "FOO");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), nullptr);
+
+    value.param_index = 1;
+    strcpy(value.param_id, "BAR");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), gcs);
+
+    // Requesting the list again starts over
+    steering.track_request(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 1, 1);
+    EXPECT_EQ(steering.find_requester(&buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, 0), gcs);
+}
+
+TEST(ParamCacheTest, answer_list_when_complete)
+{
+    ParamCache cache;
+    Endpoint *gcs = reinterpret_cast<Endpoint *>(0x1000);
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX_MAVLINK1, sizeof(mavlink_param_value_t)};
+    struct buffer buf = {sizeof(data), data};
+    uint8_t *payload = data + sizeof(mavlink_router_mavlink1_header);
+    mavlink_param_value_t value{};
+    mavlink_param_set_t set{};
+
+    cache.set_enabled(true);
+    value.param_count = 2;
+
+    value.param_index = 0;
+    strcpy(value.param_id, "FOO");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_FALSE(cache.handle_msg(nullptr, &buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, -1, -1));
+    EXPECT_FALSE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 190, 1, 1));
+
+    value.param_index = 1;
+    strcpy(value.param_id, "BAR");
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_FALSE(cache.handle_msg(nullptr, &buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, -1, -1));
+    EXPECT_TRUE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 190, 1, 0));
+    EXPECT_FALSE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 190, 2, 0));
+    cache.remove_endpoint(gcs);
+
+    // Changed parameter is forwarded until the new value is known
+    data[1] = sizeof(set);
+    strcpy(set.param_id, "BAR");
+    memcpy(payload, &set, sizeof(set));
+    EXPECT_FALSE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_SET, 255, 190, 1, 1));
+    EXPECT_FALSE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 190, 1, 1));
+
+    data[1] = sizeof(value);
+    value.param_index = UINT16_MAX;
+    memcpy(payload, &value, sizeof(value));
+    EXPECT_FALSE(cache.handle_msg(nullptr, &buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, -1, -1));
+    EXPECT_TRUE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_LIST, 255, 190, 1, 1));
+}
+
+TEST_F(MainLoopTest, param_cache_repacks_replies)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    UdpEndpoint *gcs = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[0].get());
+    ASSERT_NE(nullptr, gcs);
+
+    int sock;
+    std::tie(sock, gcs->sockaddr) = make_scratch_udp_socket();
+
+    ParamCache cache;
+    cache.set_enabled(true);
+
+    mavlink_message_t msg;
+    mavlink_param_value_t value{};
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    value.param_count = 1;
+    value.param_value = 1.5;
+    strcpy(value.param_id, "FOO");
+    mavlink_msg_param_value_encode(1, 1, &msg, &value);
+    struct buffer buf = {mavlink_msg_to_send_buffer(data, &msg), data};
+    EXPECT_FALSE(cache.handle_msg(nullptr, &buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, -1, -1));
+
+    // Signed value, sent after a change with no index
+    value.param_index = UINT16_MAX;
+    value.param_value = 2.5;
+    mavlink_msg_param_value_encode(1, 1, &msg, &value);
+    buf.len = mavlink_msg_to_send_buffer(data, &msg);
+    const uint8_t value_seq = data[4] + 100;
+    data[2] |= MAVLINK_IFLAG_SIGNED;
+    data[4] = value_seq;
+    memset(data + buf.len, 0x5a, MAVLINK_SIGNATURE_BLOCK_LEN);
+    buf.len += MAVLINK_SIGNATURE_BLOCK_LEN;
+    EXPECT_FALSE(cache.handle_msg(nullptr, &buf, MAVLINK_MSG_ID_PARAM_VALUE, 1, 1, -1, -1));
+
+    mavlink_param_request_read_t read{};
+    read.param_index = -1;
+    read.target_system = 1;
+    read.target_component = 1;
+    strcpy(read.param_id, "FOO");
+    mavlink_msg_param_request_read_encode(255, 190, &msg, &read);
+    buf.len = mavlink_msg_to_send_buffer(data, &msg);
+    ASSERT_TRUE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_READ, 255, 190, 1, 1));
+
+    // Reply is packed again: own sequence, no signature, index filled in
+    uint8_t reply[MAVLINK_MAX_PACKET_LEN];
+    const ssize_t len = ::recv(sock, reply, sizeof(reply), MSG_DONTWAIT);
+    ASSERT_GT(len, (ssize_t)sizeof(mavlink_router_mavlink2_header));
+    EXPECT_EQ(0, reply[2] & MAVLINK_IFLAG_SIGNED);
+    EXPECT_NE(value_seq, reply[4]);
+    EXPECT_EQ(1, reply[5]);
+    EXPECT_EQ(1, reply[6]);
+
+    struct buffer reply_buf = {(unsigned int)len, reply};
+    mavlink_param_value_t replied;
+    decode_mavlink_payload(&reply_buf, &replied);
+    EXPECT_STREQ("FOO", replied.param_id);
+    EXPECT_EQ(0, replied.param_index);
+    EXPECT_EQ(2.5, replied.param_value);
+
+    // Signed request is left to the component
+    data[2] |= MAVLINK_IFLAG_SIGNED;
+    EXPECT_FALSE(cache.handle_msg(gcs, &buf, MAVLINK_MSG_ID_PARAM_REQUEST_READ, 255, 190, 1, 1));
+
+    ::close(sock);
+}
+
+TEST_F(MainLoopTest, src_filter)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    Endpoint *udp = mainloop.endpoints()[0].get();
+
+    std::vector<bool> allow(UINT16_MAX + 1), deny(UINT16_MAX + 1);
+    for (unsigned int compid = 0; compid <= UINT8_MAX; compid++)
+        allow[1 << 8 | compid] = true;
+    allow[255 << 8 | 190] = true;
+    deny[1 << 8 | 100] = true;
+    udp->set_src_filter(allow, deny);
+
+    int sock;
+    struct sockaddr_in addr;
+    std::tie(sock, addr) = make_scratch_udp_socket();
+    addr.sin_port = htons(7777);
+
+    const std::vector<std::pair<uint8_t, uint8_t>> sources
+        = {{1, 1}, {255, 190}, {1, 100}, {255, 1}, {2, 1}};
+    for (const auto &src : sources) {
+        mavlink_message_t msg;
+        mavlink_heartbeat_t heartbeat{};
+        uint8_t data[MAVLINK_MAX_PACKET_LEN];
+
+        mavlink_msg_heartbeat_encode(src.first, src.second, &msg, &heartbeat);
+        const uint16_t len = mavlink_msg_to_send_buffer(data, &msg);
+        ::sendto(sock, data, len, 0, reinterpret_cast<const struct sockaddr *>(&addr),
+                 sizeof(addr));
+        udp->handle_read();
+    }
+
+    // Routes are only learned to allowed sources received on the endpoint
+    EXPECT_TRUE(udp->has_sys_comp_id(1, 1));
+    EXPECT_TRUE(udp->has_sys_comp_id(255, 190));
+    EXPECT_FALSE(udp->has_sys_comp_id(1, 100));
+    EXPECT_FALSE(udp->has_sys_comp_id(255, 1));
+    EXPECT_FALSE(udp->has_sys_comp_id(2, 1));
+
+    // What is routed to it from elsewhere is not filtered
+    EXPECT_TRUE(udp->accept_msg(-1, -1, 2, 1, MAVLINK_MSG_ID_HEARTBEAT));
+    EXPECT_TRUE(udp->accept_msg(-1, -1, 1, 100, MAVLINK_MSG_ID_HEARTBEAT));
+    EXPECT_TRUE(udp->accept_msg(1, 1, 3, 1, MAVLINK_MSG_ID_COMMAND_LONG));
+
+    ::close(sock);
+}
+
+class RouteTestEndpoint : public UdpEndpoint {
+public:
+    void learn(uint8_t sysid, uint8_t compid, bool permanent = false)
+    {
+        _add_sys_comp_id(sysid << 8 | compid, permanent);
+    }
+};
+
+TEST(EndpointTest, expire_routes)
+{
+    Mainloop mainloop;
+    RouteTestEndpoint old_link, new_link;
+    std::map<uint16_t, uint64_t> last_seen;
+
+    old_link.learn(1, 1);
+    old_link.learn(2, 1);
+    old_link.learn(0, 0, true);
+    ASSERT_EQ(3, old_link.routes().size());
+    const uint64_t now_ms = old_link.routes()[0].last_seen_ms;
+
+    // Nothing expires without a TTL, permanent routes never expire
+    old_link.expire_routes(now_ms + 60000, 0, last_seen);
+    EXPECT_EQ(3, old_link.routes().size());
+    old_link.expire_routes(now_ms + 60000, 10000, last_seen);
+    ASSERT_EQ(1, old_link.routes().size());
+    EXPECT_TRUE(old_link.has_sys_comp_id(0, 0));
+
+    // Redundant links seeing the same component keep both routes
+    old_link.learn(1, 1);
+    new_link.learn(1, 1);
+    for (const auto *e : {&old_link, &new_link}) {
+        for (const auto &r : e->routes()) {
+            uint64_t &newest = last_seen[r.sys_comp_id];
+            newest = std::max(newest, r.last_seen_ms);
+        }
+    }
+    old_link.expire_routes(now_ms, 10000, last_seen);
+    EXPECT_TRUE(old_link.has_sys_comp_id(1, 1));
+
+    // Kept being seen on the other link for more than 5s: route migrated,
+    // unless routes are kept forever
+    last_seen[1 << 8 | 1] = new_link.routes()[0].last_seen_ms + 5001;
+    old_link.expire_routes(now_ms, 0, last_seen);
+    EXPECT_TRUE(old_link.has_sys_comp_id(1, 1));
+    old_link.expire_routes(now_ms, 10000, last_seen);
+    EXPECT_FALSE(old_link.has_sys_comp_id(1, 1));
+    EXPECT_TRUE(old_link.has_sys_comp_id(0, 0));
+}
+
+TEST(RouteCacheTest, lookup_until_invalidated)
+{
+    std::unique_ptr<RouteCache> cache{new RouteCache};
+
+    EXPECT_EQ(nullptr, cache->lookup(-1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT));
+    // Tuple whose key is 0 doesn't match the zeroed entries of an empty cache
+    EXPECT_EQ(nullptr, cache->lookup(-1, -1, 0, 0, MAVLINK_MSG_ID_HEARTBEAT));
+
+    cache->store(-1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT, 0x5, false);
+    cache->store(1, 1, 255, 190, MAVLINK_MSG_ID_COMMAND_LONG, 0, true);
+
+    auto *entry = cache->lookup(-1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT);
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(0x5, entry->endpoints);
+    EXPECT_FALSE(entry->unknown);
+
+    entry = cache->lookup(1, 1, 255, 190, MAVLINK_MSG_ID_COMMAND_LONG);
+    ASSERT_NE(nullptr, entry);
+    EXPECT_TRUE(entry->unknown);
+
+    // Broadcast to sysid 0 is a different tuple than no target at all
+    EXPECT_EQ(nullptr, cache->lookup(0, 0, 1, 1, MAVLINK_MSG_ID_HEARTBEAT));
+
+    RouteCache::invalidate();
+    EXPECT_EQ(nullptr, cache->lookup(-1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT));
+}
+
+TEST_F(MainLoopTest, route_cache_follows_filter_changes)
+{
+    struct endpoint_config cfg[2];
+    for (int i = 0; i < 2; i++)
+        cfg[i] = make_udp_endpoint_config(7777 + i, false);
+    cfg[0].next = &cfg[1];
+    struct options opts = make_single_endpoint_options(&cfg[0]);
+
+    Mainloop mainloop;
+    ASSERT_TRUE(mainloop.add_endpoints(mainloop, &opts));
+    ASSERT_EQ(2, mainloop.endpoints().size());
+    UdpEndpoint *ep[2];
+    int sock[2];
+    for (int i = 0; i < 2; i++) {
+        ep[i] = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[i].get());
+        ASSERT_NE(nullptr, ep[i]);
+        std::tie(sock[i], ep[i]->sockaddr) = make_scratch_udp_socket();
+    }
+
+    mavlink_message_t msg;
+    mavlink_heartbeat_t heartbeat{};
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+    struct buffer buf = {mavlink_msg_to_send_buffer(data, &msg), data};
+
+    // Route heartbeat from 1/1 and return which endpoints got it
+    auto route = [&]() {
+        std::vector<bool> received;
+        mainloop.route_msg(&buf, -1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT);
+        for (int i = 0; i < 2; i++) {
+            uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+            bool got = false;
+            while (::recv(sock[i], recvbuf, sizeof(recvbuf), MSG_DONTWAIT) > 0)
+                got = true;
+            received.push_back(got);
+        }
+        return received;
+    };
+
+    // Decision from the cache is the same as the one computed the first time
+    const std::vector<bool> miss = route();
+    EXPECT_EQ(std::vector<bool>({true, true}), miss);
+    EXPECT_EQ(miss, route());
+
+    // Changing a filter is seen right away
+    ep[0]->add_message_to_filter(MAVLINK_MSG_ID_COMMAND_LONG);
+    EXPECT_EQ(std::vector<bool>({false, true}), route());
+    EXPECT_EQ(std::vector<bool>({false, true}), route());
+
+    ep[0]->add_message_to_filter(MAVLINK_MSG_ID_HEARTBEAT);
+    EXPECT_EQ(std::vector<bool>({true, true}), route());
+
+    for (int i = 0; i < 2; i++)
+        ::close(sock[i]);
+}
+
+TEST(RoutingRulesTest, first_match_decides)
+{
+    RoutingRules rules;
+
+    ASSERT_EQ(0, rules.add_rule("camera", "sysid 1 and compid 100 and msgid 263-266", "route camera"));
+    ASSERT_EQ(0, rules.add_rule("heartbeat", "msgid 0,1", "deny gcs, camera"));
+    ASSERT_EQ(0, rules.add_rule("sys5", "target_sysid 5", "drop"));
+    EXPECT_GT(0, rules.add_rule("bad", "sysid 300", "drop"));
+    EXPECT_GT(0, rules.add_rule("bad", "sysid 1 or compid 1", "drop"));
+    EXPECT_GT(0, rules.add_rule("bad", "any", "route"));
+
+    const uint64_t camera = rules.endpoint_mask("camera");
+    const uint64_t gcs = rules.endpoint_mask("gcs");
+    ASSERT_NE(0, camera);
+    ASSERT_NE(0, gcs);
+    EXPECT_EQ(0, rules.endpoint_mask("other"));
+
+    RoutingRules::decision d = rules.evaluate(-1, -1, 1, 100, 264);
+    EXPECT_TRUE(d.allows(camera));
+    EXPECT_FALSE(d.allows(gcs));
+    EXPECT_FALSE(d.allows(0));
+
+    // Same message from another component doesn't match the first rule
+    d = rules.evaluate(-1, -1, 1, 1, 264);
+    EXPECT_TRUE(d.allows(gcs));
+    EXPECT_TRUE(d.allows(0));
+
+    d = rules.evaluate(-1, -1, 1, 100, 0);
+    EXPECT_FALSE(d.allows(camera));
+    EXPECT_FALSE(d.allows(gcs));
+    EXPECT_TRUE(d.allows(0));
+
+    d = rules.evaluate(5, 1, 1, 100, 70000);
+    EXPECT_FALSE(d.allows(camera));
+    EXPECT_FALSE(d.allows(0));
+}
+
+TEST(LogWriterTest, append_and_write_at)
+{
+    char path[] = "/tmp/mavlink-router-logwriter-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    unlink(path);
+
+    // Sync after every write
+    struct log_storage_options storage;
+    storage.prealloc_size = 1024 * 1024;
+    storage.sync_mode = LogSyncMode::data;
+    storage.sync_bytes = 1;
+    storage.sync_interval = 0;
+
+    LogWriter writer;
+    ASSERT_EQ(0, writer.open(fd, storage));
+
+    ASSERT_TRUE(writer.append("abc", 3));
+    ASSERT_TRUE(writer.append("def", 3));
+    writer.flush();
+    // Out of order blocks, the first two are contiguous in the file
+    ASSERT_TRUE(writer.write_at("34", 2, 9));
+    ASSERT_TRUE(writer.write_at("56", 2, 11));
+    ASSERT_TRUE(writer.write_at("12", 2, 7));
+
+    // All or nothing when it doesn't fit in the ring
+    std::vector<uint8_t> big(LogWriter::CHUNK_SIZE * LogWriter::RING_CHUNKS + 1);
+    EXPECT_FALSE(writer.append(big.data(), big.size()));
+
+    writer.close();
+    EXPECT_EQ(0, writer.get_error());
+    EXPECT_LT(0u, writer.get_sync_stats().count);
+
+    // Preallocated space is released on close
+    struct stat st;
+    ASSERT_EQ(0, fstat(fd, &st));
+    EXPECT_EQ(13, st.st_size);
+    EXPECT_GT(512 * 1024, st.st_blocks * 512);
+
+    char buf[32] = {};
+    ASSERT_EQ(13, pread(fd, buf, sizeof(buf), 0));
+    EXPECT_EQ(0, memcmp("abcdef", buf, 6));
+    EXPECT_EQ('\0', buf[6]);
+    EXPECT_EQ(0, memcmp("123456", buf + 7, 6));
+
+    close(fd);
+}
+
+/*
+ * Wait up to 1s for @writer to sync at least @count times
+ */
+static bool wait_syncs(const LogWriter &writer, uint32_t count)
+{
+    for (int i = 0; i < 100 && writer.get_sync_stats().count < count; i++)
+        usleep(10000);
+    return writer.get_sync_stats().count >= count;
+}
+
+TEST(LogWriterTest, sync_policy)
+{
+    char path[] = "/tmp/mavlink-router-logwriter-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    unlink(path);
+
+    struct log_storage_options storage = {};
+    LogWriter writer;
+
+    // Synced once the interval expires, even with nothing more written
+    storage.sync_mode = LogSyncMode::data;
+    storage.sync_interval = 20;
+    ASSERT_EQ(0, writer.open(fd, storage));
+    ASSERT_TRUE(writer.append("abc", 3));
+    writer.flush();
+    EXPECT_TRUE(wait_syncs(writer, 1));
+    usleep(100000);
+    EXPECT_EQ(1u, writer.get_sync_stats().count);
+    writer.close();
+    EXPECT_EQ(1u, writer.get_sync_stats().count);
+
+    // Writeback of written ranges is started as they are written, what's left
+    // is synced on close
+    storage.sync_mode = LogSyncMode::range;
+    storage.sync_bytes = 4;
+    storage.sync_interval = 0;
+    ASSERT_EQ(0, writer.open(fd, storage));
+    ASSERT_TRUE(writer.append("defg", 4));
+    writer.flush();
+    EXPECT_TRUE(wait_syncs(writer, 1));
+    ASSERT_TRUE(writer.append("h", 1));
+    writer.close();
+    EXPECT_EQ(2u, writer.get_sync_stats().count);
+    EXPECT_EQ(0, writer.get_error());
+
+    // Never synced, not even on close
+    storage.sync_mode = LogSyncMode::none;
+    storage.sync_bytes = 1;
+    storage.sync_interval = 10;
+    ASSERT_EQ(0, writer.open(fd, storage));
+    ASSERT_TRUE(writer.append("ijk", 3));
+    writer.flush();
+    usleep(50000);
+    writer.close();
+    EXPECT_EQ(0u, writer.get_sync_stats().count);
+
+    char buf[16] = {};
+    ASSERT_EQ(11, pread(fd, buf, sizeof(buf), 0));
+    EXPECT_EQ(0, memcmp("abcdefghijk", buf, 11));
+
+    close(fd);
+}
+
+/*
+ * Wait up to 1s for @count files in @dir to be marked finished (read-only)
+ */
+static bool wait_finished_logs(const char *dir, unsigned int count)
+{
+    unsigned int finished = 0;
+
+    for (int i = 0; i < 100 && finished < count; i++) {
+        DIR *d = opendir(dir);
+
+        finished = 0;
+        for (struct dirent *ent = d ? readdir(d) : nullptr; ent; ent = readdir(d)) {
+            const std::string path = std::string(dir) + "/" + ent->d_name;
+            struct stat st;
+
+            if (ent->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && !(st.st_mode & S_IWUSR))
+                finished++;
+        }
+        if (d)
+            closedir(d);
+        if (finished < count)
+            usleep(10000);
+    }
+
+    return finished >= count;
+}
+
+/*
+ * Return the content of the only log file in @dir and remove both, along
+ * with the index of the directory
+ */
+static std::vector<uint8_t> consume_log_dir(const char *dir)
+{
+    std::vector<uint8_t> content;
+    DIR *d = opendir(dir);
+
+    if (!d)
+        return content;
+
+    for (struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        const std::string path = std::string(dir) + "/" + ent->d_name;
+
+        if (ent->d_name[0] == '.') {
+            unlink(path.c_str());
+            continue;
+        }
+
+        int fd = open(path.c_str(), O_RDONLY);
+        uint8_t buf[4096];
+        ssize_t r;
+
+        while (fd >= 0 && (r = read(fd, buf, sizeof(buf))) > 0)
+            content.insert(content.end(), buf, buf + r);
+        if (fd >= 0)
+            close(fd);
+        unlink(path.c_str());
+    }
+    closedir(d);
+    rmdir(dir);
+
+    return content;
+}
+
+static void create_file(const char *dir, const char *name, size_t size, mode_t mode)
+{
+    const std::string path = std::string(dir) + "/" + name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(0, ftruncate(fd, size));
+    fchmod(fd, mode);
+    close(fd);
+}
+
+TEST(LogIndexTest, update_and_rebuild)
+{
+    char dir[] = "/tmp/mavlink-router-index-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+
+    create_file(dir, "00003-2026-01-01_10-00-00.bin", 10, 0444);
+    create_file(dir, "00007-2026-01-01_11-00-00.bin", 0, 0644);
+    create_file(dir, "00009-notes.txt", 0, 0644);
+
+    {
+        LogIndex index;
+        ASSERT_EQ(0, index.refresh(dir));
+        EXPECT_EQ(10u, index.next_prefix());
+        EXPECT_EQ(2u, index.files().size());
+        EXPECT_EQ(1u, index.finished_count());
+
+        create_file(dir, "00010-2026-01-01_12-00-00.bin", 0, 0644);
+        index.add(10, "00010-2026-01-01_12-00-00.bin");
+        index.set_finished(7, 5);
+        unlink((std::string(dir) + "/00003-2026-01-01_10-00-00.bin").c_str());
+        index.remove(3);
+        index.commit();
+    }
+
+    // Loaded as is, a rebuild would find the size of log 7 is still 0
+    LogIndex index;
+    ASSERT_EQ(0, index.refresh(dir));
+    EXPECT_EQ(11u, index.next_prefix());
+    ASSERT_EQ(2u, index.files().size());
+    EXPECT_EQ(1u, index.finished_count());
+    EXPECT_EQ(5u, index.files().at(7).size);
+    EXPECT_FALSE(index.files().at(10).finished);
+
+    // Changes made behind its back are picked up
+    create_file(dir, "00020-2026-01-01_13-00-00.bin", 0, 0444);
+    ASSERT_EQ(0, index.refresh(dir));
+    EXPECT_EQ(21u, index.next_prefix());
+    EXPECT_EQ(3u, index.files().size());
+    EXPECT_EQ(1u, index.finished_count());
+    EXPECT_EQ(0u, index.files().at(7).size);
+
+    // So is a corrupted index
+    truncate((std::string(dir) + "/.log_index").c_str(), 10);
+    LogIndex rebuilt;
+    ASSERT_EQ(0, rebuilt.refresh(dir));
+    EXPECT_EQ(3u, rebuilt.files().size());
+
+    for (const char *name : {"00007-2026-01-01_11-00-00.bin", "00009-notes.txt",
+                             "00010-2026-01-01_12-00-00.bin", "00020-2026-01-01_13-00-00.bin"})
+        unlink((std::string(dir) + "/" + name).c_str());
+    consume_log_dir(dir);
+}
+
+TEST(ULogTest, reassemble_across_ring_wrap)
+{
+    Mainloop mainloop;
+    char dir[] = "/tmp/mavlink-router-ulog-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+
+    // ULog header and 40 messages of 153 bytes, split in LOGGING_DATA packets
+    const uint8_t header[16] = {0x55, 0x4C, 0x6F, 0x67, 0x01, 0x12, 0x35};
+    std::vector<uint8_t> stream(header, header + sizeof(header));
+    std::vector<size_t> msg_start;
+    for (int i = 0; i < 40; i++) {
+        msg_start.push_back(stream.size());
+        stream.insert(stream.end(), {150, 0, 'D'});
+        stream.insert(stream.end(), 150, (uint8_t)i);
+    }
+
+    const size_t packet_len = sizeof(mavlink_logging_data_t::data);
+    const size_t lost_packet = 5;
+    std::vector<uint8_t> expected(header, header + sizeof(header));
+    for (size_t i = 0; i < msg_start.size(); i++) {
+        // Messages overlapping the lost packet can't be reassembled
+        if (msg_start[i] + 153 > lost_packet * packet_len
+            && msg_start[i] < (lost_packet + 1) * packet_len)
+            continue;
+        expected.insert(expected.end(), stream.begin() + msg_start[i],
+                        stream.begin() + msg_start[i] + 153);
+    }
+
+    // Ring smaller than the stream, so it wraps around
+    ULog ulog(dir, LogMode::always, 0, 0, false);
+    struct log_storage_options storage = {};
+    storage.ulog_buffer_size = ULOG_MIN_BUFFER_SIZE;
+    ulog.set_storage_options(storage);
+    ASSERT_TRUE(ulog.start());
+
+    for (size_t p = 0; p * packet_len < stream.size(); p++) {
+        uint8_t data[sizeof(mavlink_router_mavlink2_header) + sizeof(mavlink_logging_data_t)] = {};
+        auto *hdr = reinterpret_cast<mavlink_router_mavlink2_header *>(data);
+        auto *ulog_data = reinterpret_cast<mavlink_logging_data_t *>(hdr + 1);
+        const size_t begin = p * packet_len;
+
+        if (p == lost_packet)
+            continue;
+
+        hdr->magic = MAVLINK_STX;
+        hdr->payload_len = sizeof(mavlink_logging_data_t);
+        hdr->sysid = 1;
+        hdr->compid = MAV_COMP_ID_AUTOPILOT1;
+        hdr->msgid = MAVLINK_MSG_ID_LOGGING_DATA;
+        ulog_data->sequence = p;
+        ulog_data->length = std::min(packet_len, stream.size() - begin);
+        memcpy(ulog_data->data, &stream[begin], ulog_data->length);
+
+        ulog_data->first_message_offset = 255;
+        for (size_t start : msg_start) {
+            if (start >= begin && start < begin + packet_len) {
+                ulog_data->first_message_offset = start - begin;
+                break;
+            }
+        }
+
+        struct buffer buf = {sizeof(data), data};
+        ulog.write_msg(&buf);
+    }
+    ulog.stop();
+
+    EXPECT_EQ(expected, consume_log_dir(dir));
+}
+
+TEST(BinLogTest, write_blocks_out_of_order)
+{
+    Mainloop mainloop;
+    char dir[] = "/tmp/mavlink-router-binlog-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+
+    BinLog binlog(dir, LogMode::always, 0, 0, false);
+    ASSERT_TRUE(binlog.start());
+
+    // Block 3 is lost, 1 is retransmitted and 5 arrives before 4
+    for (uint32_t seqno : {0, 1, 2, 1, 5, 4}) {
+        uint8_t data[sizeof(mavlink_router_mavlink2_header)
+                     + sizeof(mavlink_remote_log_data_block_t)] = {};
+        auto *hdr = reinterpret_cast<mavlink_router_mavlink2_header *>(data);
+        auto *block = reinterpret_cast<mavlink_remote_log_data_block_t *>(hdr + 1);
+
+        hdr->magic = MAVLINK_STX;
+        hdr->payload_len = sizeof(mavlink_remote_log_data_block_t);
+        hdr->sysid = 1;
+        hdr->compid = MAV_COMP_ID_AUTOPILOT1;
+        hdr->msgid = MAVLINK_MSG_ID_REMOTE_LOG_DATA_BLOCK;
+        block->seqno = seqno;
+        memset(block->data, 'a' + seqno, sizeof(block->data));
+
+        struct buffer buf = {sizeof(data), data};
+        binlog.write_msg(&buf);
+    }
+    binlog.stop();
+
+    std::vector<uint8_t> expected;
+    for (char c : {'a', 'b', 'c', '\0', 'e', 'f'})
+        expected.insert(expected.end(), MAVLINK_MSG_REMOTE_LOG_DATA_BLOCK_FIELD_DATA_LEN, c);
+
+    EXPECT_EQ(expected, consume_log_dir(dir));
+}
+
+class BinLogStatusTest : public BinLog {
+public:
+    using BinLog::BinLog;
+    using BinLog::_send_block_statuses;
+};
+
+TEST_F(MainLoopTest, binlog_block_status)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    UdpEndpoint *flight_stack = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[0].get());
+    ASSERT_NE(nullptr, flight_stack);
+    int sock;
+    std::tie(sock, flight_stack->sockaddr) = make_scratch_udp_socket();
+
+    char dir[] = "/tmp/mavlink-router-binlog-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    BinLogStatusTest binlog(dir, LogMode::always, 0, 0, false);
+    ASSERT_TRUE(binlog.start());
+
+    auto write_block = [&](uint32_t seqno) {
+        uint8_t data[sizeof(mavlink_router_mavlink2_header)
+                     + sizeof(mavlink_remote_log_data_block_t)] = {};
+        auto *hdr = reinterpret_cast<mavlink_router_mavlink2_header *>(data);
+        auto *block = reinterpret_cast<mavlink_remote_log_data_block_t *>(hdr + 1);
+
+        hdr->magic = MAVLINK_STX;
+        hdr->payload_len = sizeof(mavlink_remote_log_data_block_t);
+        hdr->sysid = 1;
+        hdr->compid = MAV_COMP_ID_AUTOPILOT1;
+        hdr->msgid = MAVLINK_MSG_ID_REMOTE_LOG_DATA_BLOCK;
+        block->seqno = seqno;
+
+        struct buffer buf = {sizeof(data), data};
+        binlog.write_msg(&buf);
+    };
+    // REMOTE_LOG_BLOCK_STATUS sent so far, as seqno and ack flag
+    typedef std::vector<std::pair<uint32_t, uint8_t>> statuses;
+    auto sent_statuses = [&]() {
+        uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+        const auto *hdr = reinterpret_cast<mavlink_router_mavlink2_header *>(recvbuf);
+        mavlink_remote_log_block_status_t status;
+        statuses sent;
+
+        while (::recv(sock, recvbuf, sizeof(recvbuf), MSG_DONTWAIT) > 0) {
+            if (hdr->msgid != MAVLINK_MSG_ID_REMOTE_LOG_BLOCK_STATUS)
+                continue;
+            // Trailing zeros of the payload are trimmed
+            memset(&status, 0, sizeof(status));
+            memcpy(&status, hdr + 1, std::min<size_t>(hdr->payload_len, sizeof(status)));
+            sent.emplace_back((uint32_t)status.seqno, (uint8_t)status.status);
+        }
+        return sent;
+    };
+    sent_statuses();
+
+    // Acks are batched on the next tick, followed by nacks of the gap
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+    for (uint32_t seqno : {0, 1, 2, 5})
+        write_block(seqno);
+    EXPECT_EQ(statuses{}, sent_statuses());
+    binlog._send_block_statuses(now_ms);
+    EXPECT_EQ((statuses{{0, 1}, {1, 1}, {2, 1}, {5, 1}, {3, 0}, {4, 0}}), sent_statuses());
+
+    // Nacks are only retried after 500ms
+    binlog._send_block_statuses(now_ms + BINLOG_STATUS_INTERVAL_MS);
+    EXPECT_EQ(statuses{}, sent_statuses());
+    write_block(3);
+    binlog._send_block_statuses(now_ms + BINLOG_NACK_RETRY_MS);
+    EXPECT_EQ((statuses{{3, 1}, {4, 0}}), sent_statuses());
+
+    // Block 4 is given up after 10 nacks
+    for (unsigned int i = 2; i < BINLOG_NACK_MAX_RETRIES; i++) {
+        binlog._send_block_statuses(now_ms + i * BINLOG_NACK_RETRY_MS);
+        EXPECT_EQ((statuses{{4, 0}}), sent_statuses());
+    }
+    binlog._send_block_statuses(now_ms + BINLOG_NACK_MAX_RETRIES * BINLOG_NACK_RETRY_MS);
+    binlog._send_block_statuses(now_ms + (BINLOG_NACK_MAX_RETRIES + 1) * BINLOG_NACK_RETRY_MS);
+    EXPECT_EQ(statuses{}, sent_statuses());
+
+    // Only the newest 4096 missing blocks are tracked, nacked 10 per tick
+    write_block(6000);
+    binlog._send_block_statuses(now_ms + 20 * BINLOG_NACK_RETRY_MS);
+    statuses expected{{6000, 1}};
+    for (uint32_t seqno = 6000 - BINLOG_MAX_MISSING_BLOCKS;
+         seqno < 6000 - BINLOG_MAX_MISSING_BLOCKS + BINLOG_MAX_NACKS_PER_INTERVAL; seqno++)
+        expected.emplace_back(seqno, 0);
+    EXPECT_EQ(expected, sent_statuses());
+
+    // Pending acks are flushed on stop
+    write_block(6001);
+    binlog.stop();
+    statuses sent = sent_statuses();
+    ASSERT_FALSE(sent.empty());
+    EXPECT_EQ((std::pair<uint32_t, uint8_t>{6001, 1}), sent.front());
+
+    consume_log_dir(dir);
+    ::close(sock);
+}
+
+TEST(TLogTest, record_filtered_and_rotate)
+{
+    Mainloop mainloop;
+    char dir[] = "/tmp/mavlink-router-tlog-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+
+    uint8_t heartbeat[] = {MAVLINK_STX, 1, 0, 0, 42, 1, 1, 0, 0, 0, 0x55, 0x12, 0x34};
+    uint8_t command[] = {MAVLINK_STX, 1, 0, 0, 43, 1, 1, 76, 0, 0, 0x55, 0x12, 0x34};
+    struct buffer heartbeat_buf = {sizeof(heartbeat), heartbeat};
+    struct buffer command_buf = {sizeof(command), command};
+    const size_t record_len = sizeof(uint64_t) + sizeof(heartbeat);
+
+    struct log_storage_options storage = {};
+    storage.sync_mode = LogSyncMode::none;
+
+    // One record per file
+    TLogEndpoint tlog(dir, storage, record_len, 0);
+    tlog.set_msg_filter({MAVLINK_MSG_ID_HEARTBEAT});
+    ASSERT_TRUE(tlog.start());
+
+    const uint64_t before_us = (uint64_t)time(nullptr) * USEC_PER_SEC;
+    tlog.record(&heartbeat_buf, MAVLINK_MSG_ID_HEARTBEAT);
+    tlog.record(&command_buf, MAVLINK_MSG_ID_COMMAND_LONG);
+    tlog.record(&heartbeat_buf, MAVLINK_MSG_ID_HEARTBEAT);
+
+    // The first file is finished in background, without stopping
+    EXPECT_TRUE(wait_finished_logs(dir, 1));
+    tlog.stop();
+
+    const std::vector<uint8_t> content = consume_log_dir(dir);
+    ASSERT_EQ(2 * record_len, content.size());
+
+    for (size_t offset = 0; offset < content.size(); offset += record_len) {
+        uint64_t timestamp = 0;
+        for (int i = 0; i < 8; i++)
+            timestamp = timestamp << 8 | content[offset + i];
+        EXPECT_LE(before_us, timestamp);
+        EXPECT_EQ(0, memcmp(heartbeat, &content[offset + 8], sizeof(heartbeat)));
+    }
+}
+
+TEST(ReplayTest, replay_timed_and_as_fast_as_possible)
+{
+    char replay_dir[] = "/tmp/mavlink-router-replay-XXXXXX";
+    char tlog_dir[] = "/tmp/mavlink-router-tlog-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(replay_dir));
+    ASSERT_NE(nullptr, mkdtemp(tlog_dir));
+
+    // Two heartbeats recorded one second apart
+    mavlink_message_t msg;
+    mavlink_heartbeat_t heartbeat{};
+    uint8_t packets[2][MAVLINK_MAX_PACKET_LEN];
+    uint16_t packet_len[2];
+    std::vector<uint8_t> tlog;
+
+    for (int i = 0; i < 2; i++) {
+        const uint64_t timestamp = htobe64(1000000 + i * USEC_PER_SEC);
+        mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+        packet_len[i] = mavlink_msg_to_send_buffer(packets[i], &msg);
+        tlog.insert(tlog.end(), (const uint8_t *)&timestamp,
+                    (const uint8_t *)&timestamp + sizeof(timestamp));
+        tlog.insert(tlog.end(), packets[i], packets[i] + packet_len[i]);
+    }
+
+    const std::string path = std::string(replay_dir) + "/flight.tlog";
+    FILE *f = fopen(path.c_str(), "w");
+    ASSERT_NE(nullptr, f);
+    ASSERT_EQ(tlog.size(), fwrite(tlog.data(), 1, tlog.size(), f));
+    fclose(f);
+
+    {
+        // Replayed messages are routed like received ones, record them
+        struct options opts{};
+        opts.tlog_dir = tlog_dir;
+        Mainloop mainloop;
+        ASSERT_TRUE(mainloop.add_endpoints(mainloop, &opts));
+
+        // At the recorded rate, the second message is not due yet
+        ReplayEndpoint timed;
+        ASSERT_EQ(0, timed.open(path.c_str(), 1.0, false));
+        timed.handle_read();
+        EXPECT_FALSE(timed.is_finished());
+
+        ReplayEndpoint fast;
+        ASSERT_EQ(0, fast.open(path.c_str(), 0, false));
+        for (int i = 0; i < 10 && !fast.is_finished(); i++)
+            fast.handle_read();
+        EXPECT_TRUE(fast.is_finished());
+    }
+    consume_log_dir(replay_dir);
+
+    const std::vector<uint8_t> content = consume_log_dir(tlog_dir);
+    const size_t header_len = sizeof(uint64_t);
+    ASSERT_EQ(3 * header_len + 2 * packet_len[0] + packet_len[1], content.size());
+    size_t offset = header_len;
+    for (int i : {0, 0, 1}) {
+        EXPECT_EQ(0, memcmp(packets[i], &content[offset], packet_len[i]));
+        offset += packet_len[i] + header_len;
+    }
+}
+
+TEST(CaptureTest, capture_filtered_per_interface)
+{
+    Mainloop mainloop;
+    char dir[] = "/tmp/mavlink-router-capture-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+
+    uint8_t heartbeat[] = {MAVLINK_STX, 1, 0, 0, 42, 1, 1, 0, 0, 0, 0x55, 0x12, 0x34};
+    uint8_t command[] = {MAVLINK_STX, 1, 0, 0, 43, 1, 1, 76, 0, 0, 0x55, 0x12, 0x34};
+    struct buffer heartbeat_buf = {sizeof(heartbeat), heartbeat};
+    struct buffer command_buf = {sizeof(command), command};
+
+    struct log_storage_options storage = {};
+    storage.sync_mode = LogSyncMode::none;
+
+    CaptureEndpoint capture(dir, storage);
+    capture.set_msg_filter({MAVLINK_MSG_ID_HEARTBEAT});
+    ASSERT_TRUE(capture.start());
+
+    // Generated by mavlink-router, then sent to an endpoint
+    capture.capture(nullptr, false, &heartbeat_buf);
+    capture.capture(nullptr, false, &command_buf);
+    capture.capture(&capture, true, &heartbeat_buf);
+    capture.stop();
+    EXPECT_FALSE(capture.is_started());
+    ASSERT_TRUE(wait_finished_logs(dir, 1));
+
+    const std::vector<uint8_t> content = consume_log_dir(dir);
+    std::vector<uint32_t> types, packet_interfaces;
+
+    for (size_t offset = 0; offset + 8 <= content.size();) {
+        uint32_t type, len, trailer_len;
+        memcpy(&type, &content[offset], sizeof(type));
+        memcpy(&len, &content[offset + 4], sizeof(len));
+        ASSERT_LE(offset + len, content.size());
+        ASSERT_EQ(0u, len % 4);
+        memcpy(&trailer_len, &content[offset + len - 4], sizeof(trailer_len));
+        EXPECT_EQ(len, trailer_len);
+
+        types.push_back(type);
+        if (type == 6) {
+            uint32_t id, captured_len;
+            memcpy(&id, &content[offset + 8], sizeof(id));
+            memcpy(&captured_len, &content[offset + 20], sizeof(captured_len));
+            EXPECT_EQ(sizeof(heartbeat), captured_len);
+            EXPECT_EQ(0, memcmp(heartbeat, &content[offset + 28], sizeof(heartbeat)));
+            packet_interfaces.push_back(id);
+        }
+        offset += len;
+    }
+
+    // Section header, interfaces of mavlink-router, packet, interfaces of the endpoint, packet
+    EXPECT_EQ(std::vector<uint32_t>({0x0A0D0D0A, 1, 1, 6, 1, 1, 6}), types);
+    EXPECT_EQ(std::vector<uint32_t>({0, 3}), packet_interfaces);
+}
+
+TEST_F(MainLoopTest, udp_endpoint_snapshot_on_connect)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+    static char snapshot_msgs[] = "0";
+    opts.snapshot_msgs = snapshot_msgs;
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+
+    mavlink_message_t msg;
+    mavlink_heartbeat_t heartbeat{};
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buf = {0, data};
+
+    mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+    buf.len = mavlink_msg_to_send_buffer(data, &msg);
+    mainloop.route_msg(&buf, -1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT);
+
+    // Client sends its first message and gets the vehicle heartbeat right away
+    int sock;
+    struct sockaddr_in addr;
+    std::tie(sock, addr) = make_scratch_udp_socket();
+    addr.sin_port = htons(7777);
+    uint8_t client_data[MAVLINK_MAX_PACKET_LEN];
+    mavlink_msg_heartbeat_encode(255, 190, &msg, &heartbeat);
+    const uint16_t len = mavlink_msg_to_send_buffer(client_data, &msg);
+    ::sendto(sock, client_data, len, 0, reinterpret_cast<const struct sockaddr *>(&addr),
+             sizeof(addr));
+
+    mainloop.run_single(100);
+
+    uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+    ssize_t count = ::recv(sock, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+
+    ASSERT_EQ(buf.len, count);
+    EXPECT_EQ(0, std::memcmp(buf.data, recvbuf, count));
+
+    ::close(sock);
+}
+
+TEST_F(MainLoopTest, udp_endpoint_snapshot_alternating_senders)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+    static char snapshot_msgs[] = "0";
+    opts.snapshot_msgs = snapshot_msgs;
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+
+    mavlink_message_t msg;
+    mavlink_heartbeat_t heartbeat{};
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buf = {0, data};
+
+    mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+    buf.len = mavlink_msg_to_send_buffer(data, &msg);
+    mainloop.route_msg(&buf, -1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT);
+
+    int sock[2];
+    struct sockaddr_in addr;
+    std::tie(sock[0], addr) = make_scratch_udp_socket();
+    std::tie(sock[1], addr) = make_scratch_udp_socket();
+    addr.sin_port = htons(7777);
+    uint8_t client_data[MAVLINK_MAX_PACKET_LEN];
+    mavlink_msg_heartbeat_encode(255, 190, &msg, &heartbeat);
+    const uint16_t len = mavlink_msg_to_send_buffer(client_data, &msg);
+
+    // Return whether client @i got anything back after sending a message
+    uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+    auto send_from = [&](int i) {
+        ::sendto(sock[i], client_data, len, 0, reinterpret_cast<const struct sockaddr *>(&addr),
+                 sizeof(addr));
+        mainloop.run_single(100);
+        bool got_msg = false;
+        while (::recv(sock[i], recvbuf, sizeof(recvbuf), MSG_DONTWAIT) > 0)
+            got_msg = true;
+        return got_msg;
+    };
+
+    EXPECT_TRUE(send_from(0));
+
+    // Clients taking turns don't get it on every address change
+    for (int i = 0; i < 4; i++)
+        EXPECT_FALSE(send_from((i + 1) % 2));
+
+    // Once the previous client went silent the new one gets it again
+    usleep(1100 * USEC_PER_MSEC);
+    EXPECT_TRUE(send_from(1));
+
+    ::close(sock[0]);
+    ::close(sock[1]);
+}
+
+TEST_F(MainLoopTest, udp_endpoint_kernel_rx_filter)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+    static char rx_filter[] = "0,268";
+    cfg.rx_filter = rx_filter;
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    UdpEndpoint *udp_endpoint = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[0].get());
+    ASSERT_NE(nullptr, udp_endpoint);
+
+    int sock;
+    struct sockaddr_in addr;
+    std::tie(sock, addr) = make_scratch_udp_socket();
+    addr.sin_port = htons(7777);
+
+    mavlink_message_t msg;
+    uint8_t data[3][MAVLINK_MAX_PACKET_LEN];
+    uint16_t len[3];
+    mavlink_command_ack_t ack{};
+    mavlink_msg_command_ack_encode(1, 1, &msg, &ack);
+    len[0] = mavlink_msg_to_send_buffer(data[0], &msg);
+    mavlink_logging_ack_t logging_ack{};
+    mavlink_msg_logging_ack_encode(1, 1, &msg, &logging_ack);
+    len[1] = mavlink_msg_to_send_buffer(data[1], &msg);
+    mavlink_heartbeat_t heartbeat{};
+    mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+    len[2] = mavlink_msg_to_send_buffer(data[2], &msg);
+
+    for (int i = 0; i < 3; i++)
+        ::sendto(sock, data[i], len[i], 0, reinterpret_cast<const struct sockaddr *>(&addr),
+                 sizeof(addr));
+
+    // COMMAND_ACK never reaches the socket receive queue
+    uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+    ssize_t count = ::recv(udp_endpoint->fd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+    ASSERT_EQ(len[1], count);
+    EXPECT_EQ(0, std::memcmp(data[1], recvbuf, count));
+
+    count = ::recv(udp_endpoint->fd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+    ASSERT_EQ(len[2], count);
+    EXPECT_EQ(0, std::memcmp(data[2], recvbuf, count));
+
+    count = ::recv(udp_endpoint->fd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+    EXPECT_EQ(-1, count);
+
+    ::close(sock);
+}
+
+TEST_F(MainLoopTest, udp_endpoint_group_broadcast)
+{
+    struct endpoint_config cfg[2];
+    static char group[] = "dashboards";
+    for (int i = 0; i < 2; i++) {
+        cfg[i] = make_udp_endpoint_config(7777 + i, false);
+        cfg[i].group = group;
+    }
+    cfg[0].next = &cfg[1];
+    struct options opts = make_single_endpoint_options(&cfg[0]);
+
+    Mainloop mainloop;
+    ASSERT_TRUE(mainloop.add_endpoints(mainloop, &opts));
+    ASSERT_EQ(2, mainloop.endpoints().size());
+
+    UdpEndpoint *first = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[0].get());
+    UdpEndpoint *second = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[1].get());
+    ASSERT_NE(nullptr, first);
+    ASSERT_NE(nullptr, second);
+    ASSERT_NE(nullptr, first->group());
+    EXPECT_EQ(first->group(), second->group());
+
+    int sock[2];
+    struct sockaddr_in addr;
+    std::tie(sock[0], addr) = make_scratch_udp_socket();
+    std::tie(sock[1], second->sockaddr) = make_scratch_udp_socket();
+
+    // GCS on first socket talks to first endpoint, which learns a route to it
+    mavlink_message_t msg;
+    mavlink_heartbeat_t heartbeat{};
+    uint8_t gcs_data[MAVLINK_MAX_PACKET_LEN];
+    mavlink_msg_heartbeat_encode(255, 190, &msg, &heartbeat);
+    struct buffer gcs_buf = {mavlink_msg_to_send_buffer(gcs_data, &msg), gcs_data};
+    addr.sin_port = htons(7777);
+    ::sendto(sock[0], gcs_data, gcs_buf.len, 0, reinterpret_cast<const struct sockaddr *>(&addr),
+             sizeof(addr));
+    mainloop.run_single(100);
+    ASSERT_TRUE(first->has_sys_comp_id(255, 190));
+
+    // GCS broadcast only goes to the other member
+    uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+    EXPECT_EQ(gcs_buf.len, ::recv(sock[1], recvbuf, sizeof(recvbuf), MSG_DONTWAIT));
+    EXPECT_EQ(-1, ::recv(sock[0], recvbuf, sizeof(recvbuf), MSG_DONTWAIT));
+
+    // Vehicle broadcast goes to every member
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+    struct buffer buf = {mavlink_msg_to_send_buffer(data, &msg), data};
+    mainloop.route_msg(&buf, -1, -1, 1, 1, MAVLINK_MSG_ID_HEARTBEAT);
+
+    for (int s : sock) {
+        ssize_t count = ::recv(s, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+        ASSERT_EQ(buf.len, count);
+        EXPECT_EQ(0, std::memcmp(buf.data, recvbuf, count));
+    }
+
+    ::close(sock[0]);
+    ::close(sock[1]);
+}
+
+TEST_F(MainLoopTest, mission_cache_record_serve_invalidate)
+{
+    struct endpoint_config cfg = make_udp_endpoint_config(7777, false);
+    struct options opts = make_single_endpoint_options(&cfg);
+
+    Mainloop mainloop;
+    mainloop.add_endpoints(mainloop, &opts);
+    ASSERT_EQ(1, mainloop.endpoints().size());
+    UdpEndpoint *gcs = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[0].get());
+    ASSERT_NE(nullptr, gcs);
+
+    int sock;
+    std::tie(sock, gcs->sockaddr) = make_scratch_udp_socket();
+
+    MissionCache cache;
+    cache.set_enabled(true);
+
+    mavlink_message_t msg;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buf = {0, data};
+    // GCS 255/190 talks to autopilot 1/1
+    auto from_gcs = [&](uint32_t msg_id) {
+        buf.len = mavlink_msg_to_send_buffer(data, &msg);
+        return cache.handle_msg(gcs, &buf, msg_id, 255, 190, 1, 1);
+    };
+    auto from_autopilot = [&](uint32_t msg_id) {
+        buf.len = mavlink_msg_to_send_buffer(data, &msg);
+        return cache.handle_msg(nullptr, &buf, msg_id, 1, 1, 255, 190);
+    };
+
+    mavlink_mission_request_list_t request_list{};
+    mavlink_mission_count_t count{};
+    mavlink_mission_item_int_t item{};
+    auto download = [&]() {
+        mavlink_msg_mission_request_list_encode(255, 190, &msg, &request_list);
+        EXPECT_FALSE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST_LIST));
+        count.count = 2;
+        mavlink_msg_mission_count_encode(1, 1, &msg, &count);
+        EXPECT_FALSE(from_autopilot(MAVLINK_MSG_ID_MISSION_COUNT));
+        for (uint16_t seq = 0; seq < 2; seq++) {
+            item.seq = seq;
+            item.frame = MAV_FRAME_GLOBAL_RELATIVE_ALT;
+            item.x = 473977420 + seq;
+            item.y = -1223977421;
+            mavlink_msg_mission_item_int_encode(1, 1, &msg, &item);
+            EXPECT_FALSE(from_autopilot(MAVLINK_MSG_ID_MISSION_ITEM_INT));
+        }
+    };
+    // Reply the router sent on behalf of the autopilot
+    uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+    auto received = [&](uint32_t msg_id) {
+        ssize_t len = ::recv(sock, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+        const auto *hdr = reinterpret_cast<struct mavlink_router_mavlink2_header *>(recvbuf);
+        return len > 0 && hdr->sysid == 1 && hdr->compid == 1 && hdr->msgid == msg_id;
+    };
+
+    download();
+
+    // Second download is served from the cache
+    mavlink_msg_mission_request_list_encode(255, 190, &msg, &request_list);
+    EXPECT_TRUE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST_LIST));
+    ASSERT_TRUE(received(MAVLINK_MSG_ID_MISSION_COUNT));
+
+    mavlink_mission_request_int_t request_int{};
+    request_int.seq = 1;
+    mavlink_msg_mission_request_int_encode(255, 190, &msg, &request_int);
+    EXPECT_TRUE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST_INT));
+    ASSERT_TRUE(received(MAVLINK_MSG_ID_MISSION_ITEM_INT));
+
+    // Legacy clients get MISSION_ITEM in degrees
+    mavlink_mission_request_t request{};
+    request.seq = 0;
+    mavlink_msg_mission_request_encode(255, 190, &msg, &request);
+    EXPECT_TRUE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST));
+    ASSERT_TRUE(received(MAVLINK_MSG_ID_MISSION_ITEM));
+    mavlink_mission_item_t legacy_item;
+    memcpy(&legacy_item, recvbuf + sizeof(mavlink_router_mavlink2_header), sizeof(legacy_item));
+    EXPECT_NEAR(47.397742, legacy_item.x, 1e-5);
+    // Closest float to the coordinate, not one off from float math
+    EXPECT_EQ((float)(-1223977421 * 1e-7), legacy_item.y);
+    EXPECT_NEAR(-122.3977421, legacy_item.y, 4e-6);
+
+    // Final ack of the cached download never reaches the autopilot
+    mavlink_mission_ack_t ack{};
+    mavlink_msg_mission_ack_encode(255, 190, &msg, &ack);
+    EXPECT_TRUE(from_gcs(MAVLINK_MSG_ID_MISSION_ACK));
+
+    // Upload drops the cache
+    mavlink_msg_mission_count_encode(255, 190, &msg, &count);
+    EXPECT_FALSE(from_gcs(MAVLINK_MSG_ID_MISSION_COUNT));
+    mavlink_msg_mission_request_list_encode(255, 190, &msg, &request_list);
+    EXPECT_FALSE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST_LIST));
+    mavlink_msg_mission_count_encode(1, 1, &msg, &count);
+    EXPECT_FALSE(from_autopilot(MAVLINK_MSG_ID_MISSION_COUNT));
+
+    // So does an ack sent by the autopilot
+    download();
+    mavlink_msg_mission_ack_encode(1, 1, &msg, &ack);
+    EXPECT_FALSE(from_autopilot(MAVLINK_MSG_ID_MISSION_ACK));
+    mavlink_msg_mission_request_list_encode(255, 190, &msg, &request_list);
+    EXPECT_FALSE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST_LIST));
+
+    // And clearing the mission
+    download();
+    mavlink_mission_clear_all_t clear{};
+    mavlink_msg_mission_clear_all_encode(255, 190, &msg, &clear);
+    EXPECT_FALSE(from_gcs(MAVLINK_MSG_ID_MISSION_CLEAR_ALL));
+    mavlink_msg_mission_request_list_encode(255, 190, &msg, &request_list);
+    EXPECT_FALSE(from_gcs(MAVLINK_MSG_ID_MISSION_REQUEST_LIST));
+    EXPECT_FALSE(received(MAVLINK_MSG_ID_MISSION_COUNT));
+
+    ::close(sock);
+}
+
+TEST_F(MainLoopTest, message_interval_aggregation)
+{
+    struct endpoint_config cfg[3];
+    for (int i = 0; i < 3; i++) {
+        cfg[i] = make_udp_endpoint_config(7777 + i, false);
+        if (i > 0)
+            cfg[i - 1].next = &cfg[i];
+    }
+    struct options opts = make_single_endpoint_options(&cfg[0]);
+
+    Mainloop mainloop;
+    ASSERT_TRUE(mainloop.add_endpoints(mainloop, &opts));
+    ASSERT_EQ(3, mainloop.endpoints().size());
+    UdpEndpoint *ep[3];
+    int sock[3];
+    struct sockaddr_in addr;
+    for (int i = 0; i < 3; i++) {
+        ep[i] = dynamic_cast<UdpEndpoint *>(mainloop.endpoints()[i].get());
+        ASSERT_NE(nullptr, ep[i]);
+        std::tie(sock[i], addr) = make_scratch_udp_socket();
+        if (i < 2)
+            ep[i]->sockaddr = addr;
+    }
+    Endpoint *gcs1 = ep[0], *gcs2 = ep[1];
+
+    // Autopilot 1/1 is behind the third endpoint
+    mavlink_message_t msg;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buf = {0, data};
+    mavlink_heartbeat_t heartbeat{};
+    mavlink_msg_heartbeat_encode(1, 1, &msg, &heartbeat);
+    buf.len = mavlink_msg_to_send_buffer(data, &msg);
+    addr.sin_port = htons(7779);
+    ::sendto(sock[2], data, buf.len, 0, reinterpret_cast<const struct sockaddr *>(&addr),
+             sizeof(addr));
+    mainloop.run_single(100);
+    ASSERT_TRUE(ep[2]->has_sys_comp_id(1, 1));
+
+    // Drop the heartbeat the clients got
+    uint8_t recvbuf[MAVLINK_MAX_PACKET_LEN];
+    for (int i = 0; i < 2; i++) {
+        while (::recv(sock[i], recvbuf, sizeof(recvbuf), MSG_DONTWAIT) > 0)
+            ;
+    }
+
+    MessageIntervals intervals;
+    intervals.set_enabled(true);
+
+    const uint8_t *payload = recvbuf + sizeof(mavlink_router_mavlink2_header);
+    // Interval the autopilot was asked for, 0 if it got nothing
+    auto requested_interval = [&]() {
+        mavlink_command_long_t cmd{};
+        if (::recv(sock[2], recvbuf, sizeof(recvbuf), MSG_DONTWAIT) <= 0)
+            return 0.0f;
+        memcpy(&cmd, payload, sizeof(cmd));
+        EXPECT_EQ(MAV_CMD_SET_MESSAGE_INTERVAL, cmd.command);
+        return cmd.param2;
+    };
+    auto set_interval = [&](Endpoint *e, uint8_t sysid, float interval_us) {
+        mavlink_command_long_t cmd{};
+        cmd.command = MAV_CMD_SET_MESSAGE_INTERVAL;
+        cmd.param1 = MAVLINK_MSG_ID_ATTITUDE;
+        cmd.param2 = interval_us;
+        mavlink_msg_command_long_encode(sysid, 190, &msg, &cmd);
+        buf.len = mavlink_msg_to_send_buffer(data, &msg);
+        return intervals.handle_msg(e, &buf, MAVLINK_MSG_ID_COMMAND_LONG, sysid, 190, 1, 1);
+    };
+    auto send_ack = [&](uint8_t result) {
+        mavlink_command_ack_t ack{};
+        ack.command = MAV_CMD_SET_MESSAGE_INTERVAL;
+        ack.result = result;
+        mavlink_msg_command_ack_encode(1, 1, &msg, &ack);
+        buf.len = mavlink_msg_to_send_buffer(data, &msg);
+        EXPECT_FALSE(intervals.handle_msg(ep[2], &buf, MAVLINK_MSG_ID_COMMAND_ACK, 1, 1, 255, 190));
+    };
+
+    EXPECT_TRUE(set_interval(gcs1, 255, 100000));
+    EXPECT_EQ(100000, requested_interval());
+    send_ack(MAV_RESULT_ACCEPTED);
+
+    // Slower rate is already covered: acknowledged by the router itself
+    EXPECT_TRUE(set_interval(gcs2, 254, 200000));
+    EXPECT_EQ(0, requested_interval());
+    ASSERT_GT(::recv(sock[1], recvbuf, sizeof(recvbuf), MSG_DONTWAIT), 0);
+    EXPECT_EQ(MAVLINK_MSG_ID_COMMAND_ACK,
+              reinterpret_cast<struct mavlink_router_mavlink2_header *>(recvbuf)->msgid);
+
+    // Each endpoint gets the message at the rate it asked for
+    EXPECT_TRUE(intervals.should_send(gcs1, 1, 1, MAVLINK_MSG_ID_ATTITUDE));
+    EXPECT_TRUE(intervals.should_send(gcs2, 1, 1, MAVLINK_MSG_ID_ATTITUDE));
+    usleep(110 * USEC_PER_MSEC);
+    EXPECT_TRUE(intervals.should_send(gcs1, 1, 1, MAVLINK_MSG_ID_ATTITUDE));
+    EXPECT_FALSE(intervals.should_send(gcs2, 1, 1, MAVLINK_MSG_ID_ATTITUDE));
+    EXPECT_TRUE(intervals.should_send(gcs2, 2, 1, MAVLINK_MSG_ID_ATTITUDE));
+    usleep(110 * USEC_PER_MSEC);
+    EXPECT_TRUE(intervals.should_send(gcs2, 1, 1, MAVLINK_MSG_ID_ATTITUDE));
+
+    // Without the fast client the autopilot is asked for the slower rate
+    intervals.remove_endpoint(gcs1);
+    EXPECT_EQ(200000, requested_interval());
+    EXPECT_TRUE(intervals.should_send(gcs1, 1, 1, MAVLINK_MSG_ID_ATTITUDE));
+
+    // Not accepted yet, so not known either: asked again
+    EXPECT_TRUE(set_interval(gcs2, 254, 200000));
+    EXPECT_EQ(200000, requested_interval());
+    send_ack(MAV_RESULT_DENIED);
+    send_ack(MAV_RESULT_ACCEPTED);
+    EXPECT_TRUE(set_interval(gcs2, 254, 200000));
+    EXPECT_EQ(0, requested_interval());
+
+    for (int s : sock)
+        ::close(s);
+}
+
+TEST(MainLoopParseTest, parse_subscribe_dynamic_endpoint) {
+    std::string input = "subscribe GCS 0,30,33";
+    dynamic_command cmd;
+    EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), 0);
+    EXPECT_EQ(cmd.command, dynamic_command::subscribe);
+    EXPECT_EQ(cmd.name, "GCS");
+    ASSERT_EQ(cmd.subscribe_ids.size(), 3);
+    EXPECT_EQ(cmd.subscribe_ids[0], 0);
+    EXPECT_EQ(cmd.subscribe_ids[1], 30);
+    EXPECT_EQ(cmd.subscribe_ids[2], 33);
+
+    input = "subscribe GCS 0,foo";
+    EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), -2); // -SUBSCRIBE_IDS
+
+    input = "unsubscribe GCS";
+    EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), 0);
+    EXPECT_EQ(cmd.command, dynamic_command::unsubscribe);
+}
+
+TEST(MainLoopParseTest, parse_capture) {
+    std::string input = "capture on";
+    dynamic_command cmd;
+    EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), 0);
+    EXPECT_EQ(cmd.command, dynamic_command::capture);
+    EXPECT_TRUE(cmd.capture_enabled);
+
+    input = "capture off";
+    EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), 0);
+    EXPECT_FALSE(cmd.capture_enabled);
+
+    input = "capture maybe";
+    EXPECT_EQ(Mainloop::parse(input.c_str(), cmd), -1); // -CAPTURE_STATE
+}
@@ -0,0 +1,289 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "missioncache.h"
+
+#include <common/log.h>
+
+#include "endpoint.h"
+#include "mainloop.h"
+
+static uint32_t mission_key(uint8_t sysid, uint8_t compid, uint8_t mission_type)
+{
+    return ((uint32_t)sysid << 16) | ((uint32_t)compid << 8) | mission_type;
+}
+
+/*
+ * MISSION_ITEM_INT x/y hold degrees * 1e7 on global frames, meters * 1e4 on
+ * local ones and plain param5/6 on MAV_FRAME_MISSION
+ */
+static void item_int_to_item(const mavlink_mission_item_int_t &in, mavlink_mission_item_t *out)
+{
+    // Scaled in double precision: float can't hold an int32 coordinate exactly
+    double scale;
+
+    switch (in.frame) {
+    case MAV_FRAME_GLOBAL:
+    case MAV_FRAME_GLOBAL_RELATIVE_ALT:
+    case MAV_FRAME_GLOBAL_INT:
+    case MAV_FRAME_GLOBAL_RELATIVE_ALT_INT:
+    case MAV_FRAME_GLOBAL_TERRAIN_ALT:
+    case MAV_FRAME_GLOBAL_TERRAIN_ALT_INT:
+        scale = 1e-7;
+        break;
+    case MAV_FRAME_MISSION:
+        scale = 1.0;
+        break;
+    default:
+        scale = 1e-4;
+        break;
+    }
+
+    out->param1 = in.param1;
+    out->param2 = in.param2;
+    out->param3 = in.param3;
+    out->param4 = in.param4;
+    out->x = (float)(in.x * scale);
+    out->y = (float)(in.y * scale);
+    out->z = in.z;
+    out->seq = in.seq;
+    out->command = in.command;
+    out->target_system = in.target_system;
+    out->target_component = in.target_component;
+    out->frame = in.frame;
+    out->current = in.current;
+    out->autocontinue = in.autocontinue;
+    out->mission_type = in.mission_type;
+}
+
+bool MissionCache::handle_msg(Endpoint *e, const struct buffer *buf, uint32_t msg_id,
+                              uint8_t src_sysid, uint8_t src_compid, int target_sysid,
+                              int target_compid)
+{
+    const uint16_t client = ((uint16_t)src_sysid << 8) | src_compid;
+
+    if (!_enabled)
+        return false;
+
+    switch (msg_id) {
+    case MAVLINK_MSG_ID_MISSION_REQUEST_LIST: {
+        mavlink_mission_request_list_t req;
+        decode_mavlink_payload(buf, &req);
+        if (target_sysid <= 0 || target_compid <= 0)
+            break;
+        return _request_list(e, client, mission_key(target_sysid, target_compid, req.mission_type));
+    }
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT: {
+        mavlink_mission_request_int_t req;
+        decode_mavlink_payload(buf, &req);
+        if (target_sysid <= 0 || target_compid <= 0)
+            break;
+        return _request_item(e, client, mission_key(target_sysid, target_compid, req.mission_type),
+                             req.seq, false);
+    }
+    case MAVLINK_MSG_ID_MISSION_REQUEST: {
+        mavlink_mission_request_t req;
+        decode_mavlink_payload(buf, &req);
+        if (target_sysid <= 0 || target_compid <= 0)
+            break;
+        return _request_item(e, client, mission_key(target_sysid, target_compid, req.mission_type),
+                             req.seq, true);
+    }
+    case MAVLINK_MSG_ID_MISSION_COUNT: {
+        mavlink_mission_count_t count;
+        decode_mavlink_payload(buf, &count);
+
+        // Either an upload to the target...
+        if (target_sysid > 0)
+            _invalidate(target_sysid, target_compid, count.mission_type);
+
+        // ... or the reply to a download from the sender
+        auto it = _missions.find(mission_key(src_sysid, src_compid, count.mission_type));
+        if (it != _missions.end() && it->second.list_requested) {
+            it->second.list_requested = false;
+            it->second.count_known = true;
+            it->second.cached = 0;
+            it->second.items.assign(count.count, {});
+        }
+        break;
+    }
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT: {
+        mavlink_mission_item_int_t item;
+        decode_mavlink_payload(buf, &item);
+
+        auto it = _missions.find(mission_key(src_sysid, src_compid, item.mission_type));
+        if (it == _missions.end() || !it->second.count_known || item.seq >= it->second.items.size())
+            break;
+
+        struct mission &m = it->second;
+        if (!m.items[item.seq].valid) {
+            m.items[item.seq].valid = true;
+            m.cached++;
+            if (m.complete())
+                log_info("Mission cache for %u/%u type %u complete (%zu items)", src_sysid,
+                         src_compid, item.mission_type, m.items.size());
+        }
+        m.items[item.seq].msg = item;
+        break;
+    }
+    case MAVLINK_MSG_ID_MISSION_ACK: {
+        mavlink_mission_ack_t ack;
+        decode_mavlink_payload(buf, &ack);
+
+        // End of a download served from cache: component doesn't know about it
+        if (target_sysid > 0 && target_compid > 0) {
+            auto s = _find_session(e, client,
+                                   mission_key(target_sysid, target_compid, ack.mission_type));
+            if (s != _sessions.end()) {
+                _sessions.erase(s);
+                return true;
+            }
+        }
+
+        // Component acknowledging a write
+        _invalidate(src_sysid, src_compid, ack.mission_type);
+        break;
+    }
+    case MAVLINK_MSG_ID_MISSION_CLEAR_ALL: {
+        mavlink_mission_clear_all_t clear;
+        decode_mavlink_payload(buf, &clear);
+        if (target_sysid > 0)
+            _invalidate(target_sysid, target_compid, clear.mission_type);
+        break;
+    }
+    case MAVLINK_MSG_ID_MISSION_WRITE_PARTIAL_LIST: {
+        mavlink_mission_write_partial_list_t partial;
+        decode_mavlink_payload(buf, &partial);
+        if (target_sysid > 0)
+            _invalidate(target_sysid, target_compid, partial.mission_type);
+        break;
+    }
+    }
+
+    return false;
+}
+
+void MissionCache::_invalidate(uint8_t sysid, int compid, uint8_t mission_type)
+{
+    for (auto &it : _missions) {
+        if ((it.first >> 16) != sysid || (it.first & 0xff) != mission_type
+            || (compid > 0 && ((it.first >> 8) & 0xff) != (uint32_t)compid))
+            continue;
+
+        if (it.second.count_known)
+            log_debug("Mission cache for %u/%u type %u invalidated", sysid,
+                      (it.first >> 8) & 0xff, mission_type);
+
+        it.second.count_known = false;
+        it.second.cached = 0;
+        it.second.items.clear();
+
+        for (auto s = _sessions.begin(); s != _sessions.end();) {
+            if (s->mission_key == it.first)
+                s = _sessions.erase(s);
+            else
+                s++;
+        }
+    }
+}
+
+std::vector<struct MissionCache::session>::iterator
+MissionCache::_find_session(const Endpoint *e, uint16_t client, uint32_t mission_key)
+{
+    for (auto s = _sessions.begin(); s != _sessions.end(); s++) {
+        if (s->e == e && s->client == client && s->mission_key == mission_key)
+            return s;
+    }
+
+    return _sessions.end();
+}
+
+bool MissionCache::_request_list(Endpoint *e, uint16_t client, uint32_t mission_key)
+{
+    struct mission &m = _missions[mission_key];
+    mavlink_mission_count_t count{};
+    mavlink_message_t msg;
+
+    if (!m.complete()) {
+        // Let component answer and record its reply
+        m.list_requested = true;
+        return false;
+    }
+
+    if (_find_session(e, client, mission_key) == _sessions.end())
+        _sessions.push_back({e, client, mission_key});
+
+    count.count = m.items.size();
+    count.target_system = client >> 8;
+    count.target_component = client & 0xff;
+    count.mission_type = mission_key & 0xff;
+    mavlink_msg_mission_count_encode(mission_key >> 16, (mission_key >> 8) & 0xff, &msg, &count);
+    _send_msg(e, &msg);
+
+    return true;
+}
+
+bool MissionCache::_request_item(Endpoint *e, uint16_t client, uint32_t mission_key,
+                                 uint16_t seq, bool legacy)
+{
+    auto it = _missions.find(mission_key);
+    mavlink_message_t msg;
+
+    // Only answer downloads started from cache, others are handled by the component
+    if (it == _missions.end() || _find_session(e, client, mission_key) == _sessions.end())
+        return false;
+
+    if (seq >= it->second.items.size() || !it->second.items[seq].valid)
+        return false;
+
+    mavlink_mission_item_int_t item = it->second.items[seq].msg;
+    item.target_system = client >> 8;
+    item.target_component = client & 0xff;
+    if (legacy) {
+        mavlink_mission_item_t legacy_item;
+        item_int_to_item(item, &legacy_item);
+        mavlink_msg_mission_item_encode(mission_key >> 16, (mission_key >> 8) & 0xff, &msg,
+                                        &legacy_item);
+    } else {
+        mavlink_msg_mission_item_int_encode(mission_key >> 16, (mission_key >> 8) & 0xff, &msg,
+                                            &item);
+    }
+    _send_msg(e, &msg);
+
+    return true;
+}
+
+void MissionCache::_send_msg(Endpoint *e, const mavlink_message_t *msg)
+{
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buffer {
+        0, data
+    };
+
+    buffer.len = mavlink_msg_to_send_buffer(data, msg);
+    Mainloop::get_instance().write_msg(e, &buffer);
+}
+
+void MissionCache::remove_endpoint(const Endpoint *e)
+{
+    for (auto s = _sessions.begin(); s != _sessions.end();) {
+        if (s->e == e)
+            s = _sessions.erase(s);
+        else
+            s++;
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include <common/mavlink.h>
+
+#include "comm.h"
+
+class Endpoint;
+
+/*
+ * Cache of the missions of each system/component, recorded while a client
+ * downloads them. Later downloads of an unchanged mission are answered from
+ * the cache: the router replies to MISSION_REQUEST_LIST, MISSION_REQUEST_INT
+ * (or the legacy MISSION_REQUEST, with the item converted to MISSION_ITEM)
+ * and consumes the final MISSION_ACK so the component never sees them.
+ *
+ * Replies carry the system/component ids of the component but the sequence
+ * numbers of the router's own channel, so clients tracking packet loss per
+ * component may see a jump in its sequence during a cached download.
+ */
+class MissionCache {
+public:
+    void set_enabled(bool enabled) { _enabled = enabled; }
+
+    /*
+     * Update cache with message received from endpoint @e. Return true if the
+     * message was handled by the cache and must not be routed.
+     */
+    bool handle_msg(Endpoint *e, const struct buffer *buf, uint32_t msg_id, uint8_t src_sysid,
+                    uint8_t src_compid, int target_sysid, int target_compid);
+
+    /*
+     * Forget downloads served to endpoint @e, to be called before it's
+     * destroyed.
+     */
+    void remove_endpoint(const Endpoint *e);
+
+private:
+    struct cached_item {
+        bool valid;
+        mavlink_mission_item_int_t msg;
+    };
+
+    struct mission {
+        // MISSION_REQUEST_LIST seen, next MISSION_COUNT is the reply
+        bool list_requested = false;
+        bool count_known = false;
+        uint16_t cached = 0;
+        std::vector<struct cached_item> items;
+
+        bool complete() const { return count_known && cached == items.size(); }
+    };
+
+    // Download served from cache to a client
+    struct session {
+        Endpoint *e;
+        uint16_t client;
+        uint32_t mission_key;
+    };
+
+    bool _enabled = false;
+    // Indexed by sysid, compid and mission type
+    std::map<uint32_t, struct mission> _missions;
+    std::vector<struct session> _sessions;
+
+    void _invalidate(uint8_t sysid, int compid, uint8_t mission_type);
+    std::vector<struct session>::iterator _find_session(const Endpoint *e, uint16_t client,
+                                                        uint32_t mission_key);
+    bool _request_list(Endpoint *e, uint16_t client, uint32_t mission_key);
+    bool _request_item(Endpoint *e, uint16_t client, uint32_t mission_key, uint16_t seq,
+                       bool legacy);
+    void _send_msg(Endpoint *e, const mavlink_message_t *msg);
+};
@@ -0,0 +1,308 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "msginterval.h"
+
+#include <algorithm>
+
+#include <common/log.h>
+#include <common/util.h>
+
+#include "endpoint.h"
+#include "mainloop.h"
+
+// Component not answering MAV_CMD_SET_MESSAGE_INTERVAL in time kept its interval
+#define INTERVAL_ACK_TIMEOUT_MSEC 1500
+// Component silent for this long may have rebooted and lost its intervals
+#define INTERVAL_REBOOT_SILENCE_MSEC 3000
+
+static uint64_t interval_key(uint16_t target, uint32_t msg_id)
+{
+    return ((uint64_t)target << 32) | msg_id;
+}
+
+bool MessageIntervals::handle_msg(Endpoint *e, const struct buffer *buf, uint32_t msg_id,
+                                  uint8_t src_sysid, uint8_t src_compid, int target_sysid,
+                                  int target_compid)
+{
+    float param1, param2;
+    uint16_t command;
+
+    if (!_enabled)
+        return false;
+
+    const uint64_t now = now_usec();
+    _expire_pending(now);
+
+    if (msg_id == MAVLINK_MSG_ID_HEARTBEAT) {
+        _handle_heartbeat(((uint16_t)src_sysid << 8) | src_compid, now);
+        return false;
+    }
+
+    if (msg_id == MAVLINK_MSG_ID_COMMAND_ACK) {
+        _handle_ack(buf, ((uint16_t)src_sysid << 8) | src_compid, now);
+        return false;
+    }
+
+    if (target_sysid <= 0 || target_compid <= 0)
+        return false;
+
+    if (msg_id == MAVLINK_MSG_ID_COMMAND_LONG) {
+        mavlink_command_long_t cmd;
+        decode_mavlink_payload(buf, &cmd);
+        command = cmd.command;
+        param1 = cmd.param1;
+        param2 = cmd.param2;
+    } else if (msg_id == MAVLINK_MSG_ID_COMMAND_INT) {
+        mavlink_command_int_t cmd;
+        decode_mavlink_payload(buf, &cmd);
+        command = cmd.command;
+        param1 = cmd.param1;
+        param2 = cmd.param2;
+    } else {
+        return false;
+    }
+
+    if (command != MAV_CMD_SET_MESSAGE_INTERVAL || param1 < 0)
+        return false;
+
+    const uint16_t requester = ((uint16_t)src_sysid << 8) | src_compid;
+    const uint16_t target = ((uint16_t)target_sysid << 8) | target_compid;
+    const uint32_t interval_msg_id = param1;
+    const int32_t interval_us = param2;
+    struct request *req = nullptr;
+
+    for (auto &r : _requests) {
+        if (r.e == e && r.requester == requester && r.target == target
+            && r.msg_id == interval_msg_id) {
+            req = &r;
+            break;
+        }
+    }
+
+    // 0 asks for the default rate: endpoint doesn't care anymore
+    if (interval_us == 0) {
+        if (req)
+            _requests.erase(_requests.begin() + (req - _requests.data()));
+    } else if (req) {
+        req->interval_us = interval_us;
+    } else {
+        _requests.push_back({e, requester, target, interval_msg_id, interval_us, 0});
+    }
+
+    const int32_t aggregated = _aggregate_interval(target, interval_msg_id);
+    auto it = _intervals.find(interval_key(target, interval_msg_id));
+
+    if (it != _intervals.end() && it->second == aggregated) {
+        // Component already sends at the needed rate, acknowledge ourselves
+        mavlink_command_ack_t ack{};
+        mavlink_message_t msg;
+        uint8_t data[MAVLINK_MAX_PACKET_LEN];
+        struct buffer reply = {0, data};
+
+        ack.command = MAV_CMD_SET_MESSAGE_INTERVAL;
+        ack.result = MAV_RESULT_ACCEPTED;
+        ack.target_system = src_sysid;
+        ack.target_component = src_compid;
+        mavlink_msg_command_ack_encode(target_sysid, target_compid, &msg, &ack);
+        reply.len = mavlink_msg_to_send_buffer(data, &msg);
+        Mainloop::get_instance().write_msg(e, &reply);
+
+        return true;
+    }
+
+    _send_interval(requester, target, interval_msg_id, aggregated);
+
+    return true;
+}
+
+void MessageIntervals::_expire_pending(uint64_t now)
+{
+    for (auto p = _pending.begin(); p != _pending.end();) {
+        if (now - p->sent_us < INTERVAL_ACK_TIMEOUT_MSEC * USEC_PER_MSEC) {
+            p++;
+            continue;
+        }
+
+        // Whatever the component does now is unknown, ask again on next request
+        log_debug("Message %u interval request to %u/%u timed out", p->msg_id, p->target >> 8,
+                  p->target & 0xff);
+        _intervals.erase(interval_key(p->target, p->msg_id));
+        p = _pending.erase(p);
+    }
+}
+
+void MessageIntervals::_handle_ack(const struct buffer *buf, uint16_t src, uint64_t now)
+{
+    mavlink_command_ack_t ack;
+
+    decode_mavlink_payload(buf, &ack);
+    if (ack.command != MAV_CMD_SET_MESSAGE_INTERVAL)
+        return;
+
+    auto p = _pending.begin();
+    while (p != _pending.end() && p->target != src)
+        p++;
+    if (p == _pending.end())
+        return;
+
+    if (ack.result == MAV_RESULT_ACCEPTED) {
+        if (p->interval_us == 0)
+            _intervals.erase(interval_key(src, p->msg_id));
+        else
+            _intervals[interval_key(src, p->msg_id)] = p->interval_us;
+        _last_heartbeat_us[src] = now;
+    } else {
+        log_debug("Message %u interval request rejected by %u/%u (%u)", p->msg_id, src >> 8,
+                  src & 0xff, ack.result);
+    }
+
+    _pending.erase(p);
+}
+
+void MessageIntervals::_handle_heartbeat(uint16_t src, uint64_t now)
+{
+    auto it = _last_heartbeat_us.find(src);
+
+    if (it == _last_heartbeat_us.end())
+        return;
+
+    const uint64_t last = it->second;
+    it->second = now;
+    if (now - last < INTERVAL_REBOOT_SILENCE_MSEC * USEC_PER_MSEC)
+        return;
+
+    // Component back from silence: restore the intervals clients asked for
+    log_info("%u/%u silent for %" PRIu64 " ms, requesting message intervals again", src >> 8,
+             src & 0xff, (now - last) / USEC_PER_MSEC);
+
+    for (auto i = _intervals.begin(); i != _intervals.end();) {
+        if ((i->first >> 32) == src)
+            i = _intervals.erase(i);
+        else
+            i++;
+    }
+
+    // One command per message, for the shortest interval requested
+    std::vector<struct request> requests;
+    for (const auto &r : _requests) {
+        if (r.target != src)
+            continue;
+        auto same_msg = [&r](const struct request &o) { return o.msg_id == r.msg_id; };
+        if (std::none_of(requests.begin(), requests.end(), same_msg))
+            requests.push_back(r);
+    }
+    for (const auto &r : requests)
+        _send_interval(r.requester, src, r.msg_id, _aggregate_interval(src, r.msg_id));
+}
+
+/*
+ * Shortest positive interval requested. Otherwise disable the message if
+ * every endpoint asked so, or go back to default rate.
+ */
+int32_t MessageIntervals::_aggregate_interval(uint16_t target, uint32_t msg_id) const
+{
+    int32_t interval_us = 0;
+
+    for (const auto &r : _requests) {
+        if (r.target != target || r.msg_id != msg_id)
+            continue;
+
+        if (r.interval_us > 0 && (interval_us <= 0 || r.interval_us < interval_us))
+            interval_us = r.interval_us;
+        else if (r.interval_us < 0 && interval_us == 0)
+            interval_us = -1;
+    }
+
+    return interval_us;
+}
+
+void MessageIntervals::_send_interval(uint16_t requester, uint16_t target, uint32_t msg_id,
+                                      int32_t interval_us)
+{
+    mavlink_command_long_t cmd{};
+    mavlink_message_t msg;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer buf = {0, data};
+
+    log_debug("Requesting message %u from %u/%u every %d us", msg_id, target >> 8,
+              target & 0xff, interval_us);
+
+    // Recorded once the component acknowledges it
+    _pending.push_back({target, msg_id, interval_us, now_usec()});
+
+    cmd.command = MAV_CMD_SET_MESSAGE_INTERVAL;
+    cmd.param1 = msg_id;
+    cmd.param2 = interval_us;
+    cmd.target_system = target >> 8;
+    cmd.target_component = target & 0xff;
+    mavlink_msg_command_long_encode(requester >> 8, requester & 0xff, &msg, &cmd);
+    buf.len = mavlink_msg_to_send_buffer(data, &msg);
+
+    Mainloop::get_instance().route_msg(&buf, cmd.target_system, cmd.target_component,
+                                       requester >> 8, requester & 0xff,
+                                       MAVLINK_MSG_ID_COMMAND_LONG);
+}
+
+bool MessageIntervals::should_send(const Endpoint *e, uint8_t src_sysid, uint8_t src_compid,
+                                   uint32_t msg_id)
+{
+    const uint16_t src = ((uint16_t)src_sysid << 8) | src_compid;
+
+    for (auto &r : _requests) {
+        if (r.e != e || r.msg_id != msg_id || r.target != src)
+            continue;
+
+        if (r.interval_us < 0)
+            return false;
+
+        // Allow half of the component interval of jitter
+        const uint64_t now = now_usec();
+        auto it = _intervals.find(interval_key(src, msg_id));
+        const int32_t source_interval_us = it != _intervals.end() ? std::max(it->second, 0) : 0;
+        if (now - r.last_sent_us + source_interval_us / 2 < (uint64_t)r.interval_us)
+            return false;
+
+        r.last_sent_us = now;
+        return true;
+    }
+
+    return true;
+}
+
+void MessageIntervals::remove_endpoint(const Endpoint *e)
+{
+    std::vector<struct request> removed;
+
+    for (auto r = _requests.begin(); r != _requests.end();) {
+        if (r->e == e) {
+            removed.push_back(*r);
+            r = _requests.erase(r);
+        } else {
+            r++;
+        }
+    }
+
+    for (const auto &r : removed) {
+        const int32_t aggregated = _aggregate_interval(r.target, r.msg_id);
+        auto it = _intervals.find(interval_key(r.target, r.msg_id));
+        const int32_t current = it != _intervals.end() ? it->second : 0;
+
+        if (aggregated != current)
+            _send_interval(r.requester, r.target, r.msg_id, aggregated);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include "comm.h"
+
+class Endpoint;
+
+/*
+ * Aggregates MAV_CMD_SET_MESSAGE_INTERVAL sent by several endpoints for the
+ * same message of a component: only the highest rate requested is sent to
+ * the component, and the message is decimated for each endpoint to the rate
+ * it asked for.
+ *
+ * The interval of the component is only considered known once it accepted
+ * the command, and forgotten if it doesn't answer or seems to have rebooted.
+ * Commands sent by the router carry the ids of one of the requesting clients
+ * so the component's COMMAND_ACK is routed back to it, but the sequence
+ * number of the router's own channel.
+ */
+class MessageIntervals {
+public:
+    void set_enabled(bool enabled) { _enabled = enabled; }
+
+    /*
+     * Handle MAV_CMD_SET_MESSAGE_INTERVAL received from endpoint @e, and
+     * COMMAND_ACK and HEARTBEAT of the components it was sent to. Return true
+     * if the message was handled here and must not be routed.
+     */
+    bool handle_msg(Endpoint *e, const struct buffer *buf, uint32_t msg_id, uint8_t src_sysid,
+                    uint8_t src_compid, int target_sysid, int target_compid);
+
+    /*
+     * Return false if message from @src_sysid/@src_compid should be skipped
+     * for endpoint @e to keep the interval it requested.
+     */
+    bool should_send(const Endpoint *e, uint8_t src_sysid, uint8_t src_compid, uint32_t msg_id);
+
+    /*
+     * Drop requests of @e, to be called before it's destroyed. The component
+     * is asked for a lower rate if nobody else needs it.
+     */
+    void remove_endpoint(const Endpoint *e);
+
+private:
+    struct request {
+        Endpoint *e;
+        uint16_t requester;  // sysid/compid of client on endpoint
+        uint16_t target;     // sysid/compid of component sending the message
+        uint32_t msg_id;
+        int32_t interval_us; // -1 if endpoint doesn't want the message
+        uint64_t last_sent_us;
+    };
+
+    // Command sent to a component, waiting for its COMMAND_ACK
+    struct pending {
+        uint16_t target;
+        uint32_t msg_id;
+        int32_t interval_us;
+        uint64_t sent_us;
+    };
+
+    bool _enabled = false;
+    std::vector<struct request> _requests;
+    // Interval accepted by each component, indexed by target and msg id
+    std::map<uint64_t, int32_t> _intervals;
+    // In the order commands were sent, components answer them in order
+    std::vector<struct pending> _pending;
+    // Last HEARTBEAT of components with an accepted interval
+    std::map<uint16_t, uint64_t> _last_heartbeat_us;
+
+    int32_t _aggregate_interval(uint16_t target, uint32_t msg_id) const;
+    void _send_interval(uint16_t requester, uint16_t target, uint32_t msg_id, int32_t interval_us);
+    void _expire_pending(uint64_t now);
+    void _handle_ack(const struct buffer *buf, uint16_t src, uint64_t now);
+    void _handle_heartbeat(uint16_t src, uint64_t now);
+};
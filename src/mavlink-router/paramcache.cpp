@@ -0,0 +1,253 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "paramcache.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <common/log.h>
+
+#include "endpoint.h"
+#include "mainloop.h"
+
+// Max number of cached PARAM_VALUE sent to an endpoint per call to send_pending()
+#define PARAM_CACHE_BURST 5
+
+/*
+ * Replies from cache can't be signed: signed requests are left to the component
+ */
+static bool is_signed(const struct buffer *buf)
+{
+    return buf->data[0] == MAVLINK_STX
+        && (((const struct mavlink_router_mavlink2_header *)buf->data)->incompat_flags
+            & MAVLINK_IFLAG_SIGNED);
+}
+
+bool ParamCache::handle_msg(Endpoint *e, const struct buffer *buf, uint32_t msg_id,
+                            uint8_t src_sysid, uint8_t src_compid, int target_sysid,
+                            int target_compid)
+{
+    if (!_enabled)
+        return false;
+
+    switch (msg_id) {
+    case MAVLINK_MSG_ID_PARAM_VALUE:
+        _store_param(((uint16_t)src_sysid << 8) | src_compid, buf);
+        break;
+    case MAVLINK_MSG_ID_PARAM_SET: {
+        mavlink_param_set_t set;
+        decode_mavlink_payload(buf, &set);
+        // Component will reply with a PARAM_VALUE that caches the new value
+        if (target_sysid > 0)
+            _invalidate_param(target_sysid, target_compid, set.param_id);
+        break;
+    }
+    case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+        if (target_sysid > 0 && !is_signed(buf))
+            return _request_list(e, target_sysid, target_compid);
+        break;
+    case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+        if (target_sysid > 0 && target_compid > 0 && !is_signed(buf))
+            return _request_read(e, buf, target_sysid, target_compid);
+        break;
+    }
+
+    return false;
+}
+
+struct ParamCache::param *ParamCache::_find_param(struct component &c, int index,
+                                                  const char *param_id)
+{
+    if (index >= 0 && index < c.count)
+        return &c.params[index];
+
+    for (auto &p : c.params) {
+        if (p.stored && strncmp(p.value.param_id, param_id, sizeof(p.value.param_id)) == 0)
+            return &p;
+    }
+
+    return nullptr;
+}
+
+void ParamCache::_store_param(uint16_t sys_comp_id, const struct buffer *buf)
+{
+    mavlink_param_value_t value;
+    struct component &c = _components[sys_comp_id];
+
+    decode_mavlink_payload(buf, &value);
+
+    if (value.param_count != c.count) {
+        // Parameters were added or removed: start over
+        log_debug("Parameter cache for %u/%u: %u parameters", sys_comp_id >> 8,
+                  sys_comp_id & 0xff, value.param_count);
+        c.count = value.param_count;
+        c.cached = 0;
+        c.params.clear();
+        c.params.resize(c.count);
+    }
+
+    struct param *p = _find_param(c, value.param_index, value.param_id);
+    if (!p)
+        return;
+
+    if (!p->valid) {
+        p->valid = true;
+        c.cached++;
+        if (c.cached == c.count)
+            log_info("Parameter cache for %u/%u complete (%u parameters)", sys_comp_id >> 8,
+                     sys_comp_id & 0xff, c.count);
+    }
+
+    p->stored = true;
+    p->value = value;
+    // Unsolicited values after a change have no index
+    p->value.param_index = p - c.params.data();
+}
+
+void ParamCache::_invalidate_param(uint8_t sysid, int compid, const char *param_id)
+{
+    for (auto &it : _components) {
+        if ((it.first >> 8) != sysid || (compid > 0 && (it.first & 0xff) != compid))
+            continue;
+
+        struct param *p = _find_param(it.second, -1, param_id);
+        if (p && p->valid) {
+            p->valid = false;
+            it.second.cached--;
+        }
+    }
+}
+
+bool ParamCache::_request_list(Endpoint *e, uint8_t sysid, int compid)
+{
+    std::vector<uint16_t> ids;
+
+    for (const auto &it : _components) {
+        if ((it.first >> 8) != sysid || (compid > 0 && (it.first & 0xff) != compid))
+            continue;
+
+        // Let component answer while any of them is not fully cached
+        if (it.second.count == 0 || it.second.cached != it.second.count)
+            return false;
+
+        ids.push_back(it.first);
+    }
+
+    if (ids.empty())
+        return false;
+
+    for (uint16_t id : ids) {
+        bool found = false;
+
+        for (auto &t : _transfers) {
+            if (t.e == e && t.sys_comp_id == id) {
+                t.next = 0;
+                found = true;
+            }
+        }
+
+        if (!found)
+            _transfers.push_back({e, id, 0});
+
+        log_debug("Sending cached parameters of %u/%u", id >> 8, id & 0xff);
+    }
+
+    return true;
+}
+
+bool ParamCache::_request_read(Endpoint *e, const struct buffer *buf, uint8_t sysid, int compid)
+{
+    mavlink_param_request_read_t req;
+    auto it = _components.find(((uint16_t)sysid << 8) | compid);
+
+    if (it == _components.end())
+        return false;
+
+    decode_mavlink_payload(buf, &req);
+
+    struct param *p = _find_param(it->second, req.param_index, req.param_id);
+    if (!p || !p->valid)
+        return false;
+
+    _send_param(e, it->first, *p);
+
+    return true;
+}
+
+int ParamCache::_send_param(Endpoint *e, uint16_t sys_comp_id, const struct param &p)
+{
+    mavlink_message_t msg;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    struct buffer reply = {0, data};
+
+    mavlink_msg_param_value_encode(sys_comp_id >> 8, sys_comp_id & 0xff, &msg, &p.value);
+    reply.len = mavlink_msg_to_send_buffer(data, &msg);
+
+    return Mainloop::get_instance().write_msg(e, &reply);
+}
+
+bool ParamCache::send_pending()
+{
+    for (auto t = _transfers.begin(); t != _transfers.end();) {
+        auto it = _components.find(t->sys_comp_id);
+        bool failed = false;
+
+        if (it == _components.end()) {
+            t = _transfers.erase(t);
+            continue;
+        }
+
+        auto &params = it->second.params;
+        unsigned int sent = 0;
+
+        // Don't fill rate shaper queue, it would drop other messages
+        while (sent < PARAM_CACHE_BURST && t->next < params.size() && !t->e->has_shaped_msgs()) {
+            auto &p = params[t->next];
+
+            // Parameter being changed: requester will ask for it again
+            if (p.valid) {
+                int r = _send_param(t->e, t->sys_comp_id, p);
+                if (r == -EAGAIN)
+                    break;
+                if (r < 0) {
+                    failed = true;
+                    break;
+                }
+                sent++;
+            }
+            t->next++;
+        }
+
+        if (failed || t->next >= params.size())
+            t = _transfers.erase(t);
+        else
+            t++;
+    }
+
+    return !_transfers.empty();
+}
+
+void ParamCache::remove_endpoint(const Endpoint *e)
+{
+    for (auto t = _transfers.begin(); t != _transfers.end();) {
+        if (t->e == e)
+            t = _transfers.erase(t);
+        else
+            t++;
+    }
+}
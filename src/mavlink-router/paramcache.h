@@ -0,0 +1,96 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include <common/mavlink.h>
+
+#include "comm.h"
+
+class Endpoint;
+
+/*
+ * Cache of parameters of each system/component, filled from PARAM_VALUE
+ * messages routed through us. Once all parameters of a component are known,
+ * PARAM_REQUEST_LIST and PARAM_REQUEST_READ are answered from the cache
+ * instead of being forwarded to the component.
+ *
+ * Cached values are packed again when sent, with the sequence numbers of the
+ * router's own channel and without signature. Signed requests are therefore
+ * always forwarded to the component.
+ */
+class ParamCache {
+public:
+    void set_enabled(bool enabled) { _enabled = enabled; }
+    bool enabled() const { return _enabled; }
+
+    /*
+     * Update cache with message received from endpoint @e. Return true if the
+     * message is a request that will be answered from the cache and must not
+     * be routed.
+     */
+    bool handle_msg(Endpoint *e, const struct buffer *buf, uint32_t msg_id, uint8_t src_sysid,
+                    uint8_t src_compid, int target_sysid, int target_compid);
+
+    /*
+     * Send pending replies to PARAM_REQUEST_LIST, limited to what endpoints
+     * can take right now. Return true if there are still replies to send.
+     */
+    bool send_pending();
+
+    /*
+     * Cancel replies to endpoint @e, to be called before it's destroyed.
+     */
+    void remove_endpoint(const Endpoint *e);
+
+private:
+    struct param {
+        // Cleared while the parameter is being changed
+        bool valid;
+        bool stored;
+        mavlink_param_value_t value;
+    };
+
+    struct component {
+        uint16_t count = 0;
+        uint16_t cached = 0;
+        // Indexed by param_index
+        std::vector<struct param> params;
+    };
+
+    struct transfer {
+        Endpoint *e;
+        uint16_t sys_comp_id;
+        uint16_t next;
+    };
+
+    bool _enabled = false;
+    std::map<uint16_t, struct component> _components;
+    std::vector<struct transfer> _transfers;
+
+    void _store_param(uint16_t sys_comp_id, const struct buffer *buf);
+    void _invalidate_param(uint8_t sysid, int compid, const char *param_id);
+    struct param *_find_param(struct component &c, int index, const char *param_id);
+    bool _request_list(Endpoint *e, uint8_t sysid, int compid);
+    bool _request_read(Endpoint *e, const struct buffer *buf, uint8_t sysid, int compid);
+    int _send_param(Endpoint *e, uint16_t sys_comp_id, const struct param &p);
+};
@@ -0,0 +1,231 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "replayendpoint.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <common/log.h>
+
+// Messages replayed on each wakeup, so other endpoints are still served
+// when replaying as fast as possible
+#define REPLAY_BATCH_SIZE 64
+
+ReplayEndpoint::~ReplayEndpoint()
+{
+    if (_data)
+        munmap(_data, _size);
+}
+
+int ReplayEndpoint::open(const char *path, double speed, bool loop)
+{
+    struct stat st;
+    void *data;
+
+    int file = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        log_error("Could not open %s (%m)", path);
+        return -1;
+    }
+
+    if (fstat(file, &st) < 0 || st.st_size == 0) {
+        log_error("Could not replay %s: empty or unreadable file", path);
+        ::close(file);
+        return -1;
+    }
+
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (data == MAP_FAILED) {
+        log_error("Could not map %s (%m)", path);
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("Unable to create timerfd: %m");
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    _data = (uint8_t *)data;
+    _size = st.st_size;
+    _end = _size;
+    _speed = speed;
+    _loop = loop;
+    _restart();
+
+    if (speed > 0)
+        log_info("Replaying %s at %g times the recorded rate", path, speed);
+    else
+        log_info("Replaying %s as fast as possible", path);
+
+    return 0;
+}
+
+/*
+ * Get timestamp and length of the message at _offset. Return false if there's
+ * no complete message left.
+ */
+bool ReplayEndpoint::_next_record(uint64_t *timestamp, size_t *len)
+{
+    const size_t left = _end - _offset;
+    const uint8_t *msg = _data + _offset + sizeof(*timestamp);
+
+    if (left < sizeof(*timestamp) + sizeof(struct mavlink_router_mavlink1_header))
+        return false;
+
+    if (msg[0] == MAVLINK_STX) {
+        const struct mavlink_router_mavlink2_header *hdr
+            = (const struct mavlink_router_mavlink2_header *)msg;
+        if (left < sizeof(*timestamp) + sizeof(*hdr))
+            return false;
+        *len = sizeof(*hdr) + hdr->payload_len + 2;
+        if (hdr->incompat_flags & MAVLINK_IFLAG_SIGNED)
+            *len += MAVLINK_SIGNATURE_BLOCK_LEN;
+    } else if (msg[0] == MAVLINK_STX_MAVLINK1) {
+        const struct mavlink_router_mavlink1_header *hdr
+            = (const struct mavlink_router_mavlink1_header *)msg;
+        *len = sizeof(*hdr) + hdr->payload_len + 2;
+    } else {
+        // Nothing after it can be trusted, replay stops here
+        log_error("Replay: invalid message at offset %zu", _offset);
+        _end = _offset;
+        return false;
+    }
+
+    if (left < sizeof(*timestamp) + *len)
+        return false;
+
+    memcpy(timestamp, _data + _offset, sizeof(*timestamp));
+    *timestamp = be64toh(*timestamp);
+
+    return true;
+}
+
+usec_t ReplayEndpoint::_due_usec(uint64_t timestamp) const
+{
+    // Timestamps going backwards are replayed right away
+    if (_speed <= 0 || timestamp <= _first_timestamp)
+        return _start_usec;
+
+    return _start_usec + (usec_t)((timestamp - _first_timestamp) / _speed);
+}
+
+void ReplayEndpoint::_restart()
+{
+    uint64_t timestamp;
+    size_t len;
+
+    _offset = 0;
+    _replayed = 0;
+    _start_usec = now_usec();
+    _first_timestamp = _next_record(&timestamp, &len) ? timestamp : 0;
+    _arm_timer(_start_usec);
+}
+
+void ReplayEndpoint::_arm_timer(usec_t due_usec)
+{
+    struct itimerspec ts = {};
+
+    // An expiration of 0 would disarm the timer
+    if (due_usec == 0)
+        due_usec = 1;
+
+    ts.it_value.tv_sec = due_usec / USEC_PER_SEC;
+    ts.it_value.tv_nsec = (due_usec % USEC_PER_SEC) * NSEC_PER_USEC;
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &ts, nullptr);
+}
+
+int ReplayEndpoint::handle_read()
+{
+    uint64_t expirations, timestamp;
+    size_t len;
+
+    // When replaying as fast as possible the timer is never cleared, so
+    // mainloop keeps calling us
+    if (_speed > 0 && read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        log_error("Replay: could not read timer (%m)");
+
+    for (int i = 0; i < REPLAY_BATCH_SIZE; i++) {
+        const size_t offset = _offset;
+
+        Endpoint::handle_read();
+        if (_offset == offset)
+            break;
+    }
+
+    if (_next_record(&timestamp, &len)) {
+        if (_speed > 0)
+            _arm_timer(_due_usec(timestamp));
+        return 0;
+    }
+
+    const unsigned long long elapsed_ms = (now_usec() - _start_usec) / USEC_PER_MSEC;
+
+    if (_loop && _replayed > 0) {
+        log_debug("Replayed %u messages in %llu ms, starting over", _replayed, elapsed_ms);
+        _restart();
+        return 0;
+    }
+
+    log_info("Replayed %u messages in %llu ms", _replayed, elapsed_ms);
+
+    // Disarm timer, nothing left to replay
+    struct itimerspec ts = {};
+    timerfd_settime(fd, 0, &ts, nullptr);
+    if (_speed <= 0)
+        read(fd, &expirations, sizeof(expirations));
+    _finished = true;
+
+    return 0;
+}
+
+ssize_t ReplayEndpoint::_read_msg(uint8_t *buf, size_t len)
+{
+    uint64_t timestamp;
+    size_t msg_len;
+
+    if (!_next_record(&timestamp, &msg_len) || _due_usec(timestamp) > now_usec())
+        return 0;
+
+    if (msg_len > len) {
+        log_error("Replay: message at offset %zu too big", _offset);
+        _end = _offset;
+        return 0;
+    }
+
+    memcpy(buf, _data + _offset + sizeof(timestamp), msg_len);
+    _offset += sizeof(timestamp) + msg_len;
+    _replayed++;
+
+    return msg_len;
+}
+
+int ReplayEndpoint::write_msg(const struct buffer *pbuf)
+{
+    // Nothing to send replies to, drop them
+    return pbuf->len;
+}
@@ -0,0 +1,76 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <common/util.h>
+
+#include "endpoint.h"
+
+/*
+ * Replays a tlog file, as written by TLogEndpoint: messages are read as if
+ * they were received by this endpoint and routed like any other. Messages
+ * routed to it are dropped.
+ *
+ * Messages are replayed following their timestamps, scaled by @speed, or as
+ * fast as possible if @speed is 0. The file is mapped in memory so reading
+ * it doesn't need a system call per message. Its fd is a timerfd expiring
+ * when the next message is due.
+ */
+class ReplayEndpoint : public Endpoint {
+public:
+    ReplayEndpoint()
+        : Endpoint{"Replay"}
+    {
+    }
+    ~ReplayEndpoint() override;
+
+    int open(const char *path, double speed, bool loop);
+    bool is_finished() const { return _finished; }
+
+    int handle_read() override;
+    int write_msg(const struct buffer *pbuf) override;
+    int flush_pending_msgs() override { return -ENOSYS; }
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override;
+
+private:
+    uint8_t *_data = nullptr;
+    size_t _size = 0;
+    // Messages are replayed from _offset until _end, which is before _size
+    // if the file is corrupted
+    size_t _offset = 0;
+    size_t _end = 0;
+    double _speed = 1.0;
+    bool _loop = false;
+    bool _finished = false;
+
+    // Replay of the current pass started at _start_usec with the message
+    // recorded at _first_timestamp
+    usec_t _start_usec = 0;
+    uint64_t _first_timestamp = 0;
+    uint32_t _replayed = 0;
+
+    bool _next_record(uint64_t *timestamp, size_t *len);
+    usec_t _due_usec(uint64_t timestamp) const;
+    void _restart();
+    void _arm_timer(usec_t due_usec);
+};
@@ -0,0 +1,88 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Direct-mapped cache of routing decisions. The endpoints accepting a
+ * message only depend on its (source, target, msgid) tuple and on the
+ * learned routes, filters and set of endpoints, so the decision is reused
+ * for following messages with the same tuple until any of those change.
+ */
+class RouteCache {
+public:
+    static const unsigned int SIZE = 1024;
+    static const unsigned int MAX_ENDPOINTS = 64;
+
+    struct entry {
+        uint64_t key;
+        uint32_t generation;
+        bool unknown;        // no endpoint has the target
+        uint64_t endpoints;  // bit set for each endpoint the message goes to
+    };
+
+    /*
+     * Drop all cached decisions, to be called whenever routes, filters or
+     * endpoints change.
+     */
+    static void invalidate()
+    {
+        // Zeroed entries would match the tuple with key 0 again
+        if (++_generation == 0)
+            _generation = 1;
+    }
+    static uint32_t generation() { return _generation; }
+
+    /*
+     * Return the cached decision for the tuple or nullptr
+     */
+    const struct entry *lookup(int target_sysid, int target_compid, uint8_t src_sysid,
+                               uint8_t src_compid, uint32_t msg_id) const
+    {
+        const uint64_t key = _key(target_sysid, target_compid, src_sysid, src_compid, msg_id);
+        const struct entry &e = _entries[_slot(key)];
+
+        return e.generation == _generation && e.key == key ? &e : nullptr;
+    }
+
+    void store(int target_sysid, int target_compid, uint8_t src_sysid, uint8_t src_compid,
+               uint32_t msg_id, uint64_t endpoints, bool unknown)
+    {
+        const uint64_t key = _key(target_sysid, target_compid, src_sysid, src_compid, msg_id);
+
+        _entries[_slot(key)] = {key, _generation, unknown, endpoints};
+    }
+
+private:
+    static uint32_t _generation;
+    struct entry _entries[SIZE] = {};
+
+    static uint64_t _key(int target_sysid, int target_compid, uint8_t src_sysid,
+                         uint8_t src_compid, uint32_t msg_id)
+    {
+        // Targets are -1 when the message has none
+        return (uint64_t)(msg_id & 0xffffff) << 34 | (uint64_t)((target_sysid + 1) & 0x1ff) << 25
+            | (uint64_t)((target_compid + 1) & 0x1ff) << 16 | (uint64_t)src_sysid << 8 | src_compid;
+    }
+
+    static unsigned int _slot(uint64_t key)
+    {
+        return (key * 0x9e3779b97f4a7c15ULL) >> 54;
+    }
+};
@@ -0,0 +1,236 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "routingrules.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/log.h>
+#include <common/util.h>
+
+#define RULE_DELIM " \t"
+
+enum rule_field { SrcSysid, SrcCompid, TargetSysid, TargetCompid, MsgId, RuleFieldCount };
+
+static const struct {
+    const char *name;
+    uint32_t max;
+} rule_fields[RuleFieldCount] = {
+    {"sysid", UINT8_MAX},
+    {"compid", UINT8_MAX},
+    {"target_sysid", UINT8_MAX},
+    {"target_compid", UINT8_MAX},
+    {"msgid", RoutingRules::MAX_MSG_ID},
+};
+
+struct rule_range {
+    uint32_t first;
+    uint32_t last;
+};
+
+/*
+ * Parse a value list like "1,5-9" into @ranges
+ */
+static int parse_ranges(char *s, uint32_t max, std::vector<struct rule_range> &ranges)
+{
+    char *saveptr = nullptr;
+
+    for (char *tok = strtok_r(s, ",", &saveptr); tok; tok = strtok_r(nullptr, ",", &saveptr)) {
+        unsigned long first, last;
+        char *end;
+
+        errno = 0;
+        first = strtoul(tok, &end, 10);
+        last = first;
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+
+        if (errno || end == tok || *end != '\0' || first > last || last > max)
+            return -EINVAL;
+
+        ranges.push_back({(uint32_t)first, (uint32_t)last});
+    }
+
+    return ranges.empty() ? -EINVAL : 0;
+}
+
+int RoutingRules::_parse_action(const char *name, char *action, struct decision *d)
+{
+    char *saveptr = nullptr;
+    char *verb = strtok_r(action, RULE_DELIM, &saveptr);
+
+    if (!verb) {
+        log_error("Rule %s: missing action", name);
+        return -EINVAL;
+    }
+
+    if (strcaseeq(verb, "allow") || strcaseeq(verb, "drop")) {
+        *d = {0, strcaseeq(verb, "allow")};
+        if (strtok_r(nullptr, RULE_DELIM, &saveptr)) {
+            log_error("Rule %s: '%s' takes no endpoints", name, verb);
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (!strcaseeq(verb, "route") && !strcaseeq(verb, "deny")) {
+        log_error("Rule %s: unknown action '%s'", name, verb);
+        return -EINVAL;
+    }
+
+    *d = {0, strcaseeq(verb, "deny")};
+
+    for (char *tok = strtok_r(nullptr, RULE_DELIM ",", &saveptr); tok;
+         tok = strtok_r(nullptr, RULE_DELIM ",", &saveptr)) {
+        auto it = std::find(_endpoint_names.begin(), _endpoint_names.end(), tok);
+        if (it == _endpoint_names.end()) {
+            if (_endpoint_names.size() == MAX_ENDPOINTS) {
+                log_error("Rule %s: rules can't refer to more than %u endpoints", name,
+                          MAX_ENDPOINTS);
+                return -EINVAL;
+            }
+            it = _endpoint_names.insert(it, tok);
+        }
+        d->endpoints |= 1ULL << (it - _endpoint_names.begin());
+    }
+
+    if (!d->endpoints) {
+        log_error("Rule %s: '%s' needs a list of endpoints", name, verb);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int RoutingRules::add_rule(const char *name, const char *match, const char *action)
+{
+    std::vector<struct rule_range> ranges[RuleFieldCount];
+    bool constrained[RuleFieldCount] = {};
+    struct decision d;
+    char *saveptr = nullptr;
+    char *tok;
+    int ret = 0;
+
+    if (_n_rules == MAX_RULES) {
+        log_error("Rule %s: too many rules, at most %u are supported", name, MAX_RULES);
+        return -EINVAL;
+    }
+
+    char *s = strdup(match);
+    assert_or_return(s, -ENOMEM);
+
+    tok = strtok_r(s, RULE_DELIM, &saveptr);
+    if (!tok)
+        ret = -EINVAL;
+    else if (strcaseeq(tok, "any") && strtok_r(nullptr, RULE_DELIM, &saveptr))
+        ret = -EINVAL;
+    else if (strcaseeq(tok, "any"))
+        tok = nullptr;
+
+    // field values [and field values]...
+    for (bool first = true; tok && ret == 0; first = false) {
+        int field;
+
+        if (!first) {
+            if (!strcaseeq(tok, "and")) {
+                ret = -EINVAL;
+                break;
+            }
+            tok = strtok_r(nullptr, RULE_DELIM, &saveptr);
+            if (!tok) {
+                ret = -EINVAL;
+                break;
+            }
+        }
+
+        for (field = 0; field < RuleFieldCount; field++) {
+            if (strcaseeq(tok, rule_fields[field].name))
+                break;
+        }
+        if (field == RuleFieldCount || constrained[field]) {
+            ret = -EINVAL;
+            break;
+        }
+
+        tok = strtok_r(nullptr, RULE_DELIM, &saveptr);
+        if (!tok || parse_ranges(tok, rule_fields[field].max, ranges[field]) < 0) {
+            ret = -EINVAL;
+            break;
+        }
+        constrained[field] = true;
+
+        tok = strtok_r(nullptr, RULE_DELIM, &saveptr);
+    }
+    free(s);
+
+    if (ret < 0) {
+        log_error("Rule %s: invalid match expression '%s'", name, match);
+        return ret;
+    }
+
+    s = strdup(action);
+    assert_or_return(s, -ENOMEM);
+    ret = _parse_action(name, s, &d);
+    free(s);
+    if (ret < 0)
+        return ret;
+
+    // Compile rule into the lookup tables
+    const uint64_t bit = 1ULL << _n_rules;
+    uint64_t *tables[] = {_src_sysid, _src_compid, _target_sysid, _target_compid};
+
+    for (int field = SrcSysid; field <= TargetCompid; field++) {
+        if (!constrained[field]) {
+            for (unsigned int i = 0; i <= UINT8_MAX; i++)
+                tables[field][i] |= bit;
+            continue;
+        }
+        for (auto &r : ranges[field]) {
+            for (uint32_t i = r.first; i <= r.last; i++)
+                tables[field][i] |= bit;
+        }
+    }
+
+    if (constrained[MsgId]) {
+        for (auto &r : ranges[MsgId]) {
+            if (r.last >= _msg_id.size())
+                _msg_id.resize(r.last + 1, _msg_id_default);
+            for (uint32_t i = r.first; i <= r.last; i++)
+                _msg_id[i] |= bit;
+        }
+    } else {
+        _msg_id_default |= bit;
+        for (auto &v : _msg_id)
+            v |= bit;
+    }
+
+    _decisions[_n_rules++] = d;
+
+    return 0;
+}
+
+uint64_t RoutingRules::endpoint_mask(const std::string &name) const
+{
+    auto it = std::find(_endpoint_names.begin(), _endpoint_names.end(), name);
+    if (it == _endpoint_names.end())
+        return 0;
+
+    return 1ULL << (it - _endpoint_names.begin());
+}
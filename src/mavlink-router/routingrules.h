@@ -0,0 +1,98 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Routing rules from the configuration, like:
+ *
+ *     Match = sysid 1 and compid 100 and msgid 263-266
+ *     Action = route camera
+ *
+ * Rules are compiled into one table per matched field, holding for each
+ * value a bitmask of the rules accepting it. Evaluating a message is a
+ * lookup per field and an AND, so the cost doesn't depend on the number of
+ * rules. The first matching rule decides to which endpoints, among the ones
+ * the message would normally go to, it is sent.
+ */
+class RoutingRules {
+public:
+    static const unsigned int MAX_RULES = 64;
+    static const unsigned int MAX_ENDPOINTS = 64;
+    static const uint32_t MAX_MSG_ID = UINT16_MAX;
+
+    /*
+     * Endpoints allowed by a rule: the ones whose mask intersects
+     * @endpoints, or the other ones if @except is set.
+     */
+    struct decision {
+        uint64_t endpoints;
+        bool except;
+
+        bool allows(uint64_t endpoint_mask) const
+        {
+            return ((endpoint_mask & endpoints) != 0) != except;
+        }
+    };
+
+    /*
+     * Compile a rule and append it after the existing ones. Return 0 on
+     * success or -EINVAL if @match or @action can't be parsed.
+     */
+    int add_rule(const char *name, const char *match, const char *action);
+
+    bool empty() const { return _n_rules == 0; }
+
+    /*
+     * Mask identifying the endpoint called @name in rules, 0 if no rule
+     * refers to it.
+     */
+    uint64_t endpoint_mask(const std::string &name) const;
+
+    decision evaluate(int target_sysid, int target_compid, uint8_t src_sysid, uint8_t src_compid,
+                      uint32_t msg_id) const
+    {
+        const uint64_t rules = _src_sysid[src_sysid] & _src_compid[src_compid]
+            & _target_sysid[target_sysid > 0 ? target_sysid & 0xff : 0]
+            & _target_compid[target_compid > 0 ? target_compid & 0xff : 0]
+            & (msg_id < _msg_id.size() ? _msg_id[msg_id] : _msg_id_default);
+
+        if (!rules)
+            return {0, true};
+
+        return _decisions[__builtin_ctzll(rules)];
+    }
+
+private:
+    unsigned int _n_rules = 0;
+    std::vector<std::string> _endpoint_names;
+    struct decision _decisions[MAX_RULES] = {};
+
+    uint64_t _src_sysid[256] = {};
+    uint64_t _src_compid[256] = {};
+    uint64_t _target_sysid[256] = {};
+    uint64_t _target_compid[256] = {};
+    std::vector<uint64_t> _msg_id;
+    uint64_t _msg_id_default = 0;
+
+    int _parse_action(const char *name, char *action, struct decision *d);
+};
@@ -0,0 +1,76 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "snapshot.h"
+
+#include <algorithm>
+
+#include <common/log.h>
+#include <common/util.h>
+
+#include "endpoint.h"
+#include "mainloop.h"
+
+/*
+ * Messages of a system/component that didn't send any of the selected
+ * messages for this long are not sent, it's probably gone
+ */
+#define SNAPSHOT_TIMEOUT_MSEC 5000
+
+void Snapshot::add_msg_id(uint32_t msg_id)
+{
+    if (std::find(_msg_ids.begin(), _msg_ids.end(), msg_id) == _msg_ids.end())
+        _msg_ids.push_back(msg_id);
+}
+
+void Snapshot::store(const struct buffer *buf, uint8_t src_sysid, uint8_t src_compid,
+                     uint32_t msg_id)
+{
+    if (std::find(_msg_ids.begin(), _msg_ids.end(), msg_id) == _msg_ids.end())
+        return;
+
+    const uint16_t sys_comp_id = ((uint16_t)src_sysid << 8) | src_compid;
+
+    _msgs[((uint64_t)sys_comp_id << 32) | msg_id].assign(buf->data, buf->data + buf->len);
+    _last_seen_ms[sys_comp_id] = now_usec() / USEC_PER_MSEC;
+}
+
+void Snapshot::send(Endpoint *e)
+{
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+    Mainloop &mainloop = Mainloop::get_instance();
+    unsigned int sent = 0;
+
+    for (auto &it : _msgs) {
+        const uint16_t sys_comp_id = it.first >> 32;
+        const uint32_t msg_id = it.first & UINT32_MAX;
+
+        if (now_ms - _last_seen_ms[sys_comp_id] > SNAPSHOT_TIMEOUT_MSEC)
+            continue;
+
+        // Stored messages are state broadcasts, only honor endpoint filter
+        if (!e->accept_msg(-1, -1, sys_comp_id >> 8, sys_comp_id & 0xff, msg_id))
+            continue;
+
+        struct buffer buf = {(unsigned int)it.second.size(), it.second.data()};
+        if (mainloop.write_msg(e, &buf) < 0)
+            break;
+        sent++;
+    }
+
+    log_debug("Sent %u snapshot messages to endpoint [%d]", sent, e->fd);
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include "comm.h"
+
+class Endpoint;
+
+/*
+ * Latest value of selected messages of each system/component, sent to new
+ * clients so they don't have to wait for the next HEARTBEAT, SYS_STATUS,
+ * HOME_POSITION, etc. to know the vehicle state.
+ */
+class Snapshot {
+public:
+    void add_msg_id(uint32_t msg_id);
+    bool enabled() const { return !_msg_ids.empty(); }
+
+    /*
+     * Keep message in @buf if it is one of the selected messages
+     */
+    void store(const struct buffer *buf, uint8_t src_sysid, uint8_t src_compid, uint32_t msg_id);
+
+    /*
+     * Send stored messages of systems/components still alive to endpoint @e
+     */
+    void send(Endpoint *e);
+
+private:
+    std::vector<uint32_t> _msg_ids;
+    // Indexed by sysid, compid and msg id so messages are sent in that order
+    std::map<uint64_t, std::vector<uint8_t>> _msgs;
+    std::map<uint16_t, uint64_t> _last_seen_ms;
+};
@@ -0,0 +1,212 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "steering.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <common/log.h>
+#include <common/util.h>
+
+#include "endpoint.h"
+
+/*
+ * How long replies are steered after the request or the last matching reply
+ */
+#define STEERING_WINDOW_MSEC 1000
+
+static uint16_t get_command(const struct buffer *buf, uint32_t msg_id)
+{
+    switch (msg_id) {
+    case MAVLINK_MSG_ID_COMMAND_LONG: {
+        mavlink_command_long_t cmd;
+        decode_mavlink_payload(buf, &cmd);
+        return cmd.command;
+    }
+    case MAVLINK_MSG_ID_COMMAND_INT: {
+        mavlink_command_int_t cmd;
+        decode_mavlink_payload(buf, &cmd);
+        return cmd.command;
+    }
+    case MAVLINK_MSG_ID_COMMAND_ACK: {
+        mavlink_command_ack_t ack;
+        decode_mavlink_payload(buf, &ack);
+        return ack.command;
+    }
+    }
+
+    return 0;
+}
+
+static uint32_t get_reply_msg_id(uint32_t msg_id)
+{
+    switch (msg_id) {
+    case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+    case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+    case MAVLINK_MSG_ID_PARAM_SET:
+        return MAVLINK_MSG_ID_PARAM_VALUE;
+    case MAVLINK_MSG_ID_COMMAND_LONG:
+    case MAVLINK_MSG_ID_COMMAND_INT:
+        return MAVLINK_MSG_ID_COMMAND_ACK;
+    case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
+        return MAVLINK_MSG_ID_MISSION_COUNT;
+    case MAVLINK_MSG_ID_MISSION_REQUEST:
+        return MAVLINK_MSG_ID_MISSION_ITEM;
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT:
+        return MAVLINK_MSG_ID_MISSION_ITEM_INT;
+    }
+
+    return UINT32_MAX;
+}
+
+void ResponseSteering::track_request(Endpoint *e, const struct buffer *buf, uint32_t msg_id,
+                                     uint8_t src_sysid, int target_sysid, int target_compid)
+{
+    if (!_enabled)
+        return;
+
+    const uint32_t reply_msg_id = get_reply_msg_id(msg_id);
+    // Replies to broadcast requests come from many systems: don't steer them
+    if (reply_msg_id == UINT32_MAX || target_sysid <= 0)
+        return;
+
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+    struct pending req = {
+        e,
+        now_ms + STEERING_WINDOW_MSEC,
+        msg_id,
+        reply_msg_id,
+        get_command(buf, msg_id),
+        -1,
+        {},
+        src_sysid,
+        (uint8_t)target_sysid,
+        (uint8_t)std::max(target_compid, 0),
+        {},
+    };
+    struct pending *slot = &_pending[0];
+
+    if (msg_id == MAVLINK_MSG_ID_PARAM_REQUEST_READ) {
+        mavlink_param_request_read_t read;
+        decode_mavlink_payload(buf, &read);
+        req.param_index = read.param_index;
+        memcpy(req.param_id, read.param_id, sizeof(req.param_id));
+    } else if (msg_id == MAVLINK_MSG_ID_PARAM_SET) {
+        mavlink_param_set_t set;
+        decode_mavlink_payload(buf, &set);
+        memcpy(req.param_id, set.param_id, sizeof(req.param_id));
+    }
+
+    // Reuse entry of the same request, otherwise a free or the oldest one
+    for (auto &p : _pending) {
+        if (p.requester == req.requester && p.msg_id == req.msg_id && p.command == req.command
+            && p.param_index == req.param_index
+            && strncmp(p.param_id, req.param_id, sizeof(p.param_id)) == 0 && p.sysid == req.sysid
+            && p.compid == req.compid) {
+            slot = &p;
+            break;
+        }
+        if (p.expire_ms < slot->expire_ms)
+            slot = &p;
+    }
+
+    *slot = req;
+}
+
+bool ResponseSteering::_param_matches(const struct pending &p, const mavlink_param_value_t &value)
+{
+    switch (p.msg_id) {
+    case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+        // Values sent on their own after a change have no index or one that
+        // was already listed: they are not part of the download
+        return value.param_index < value.param_count
+            && (value.param_index >= p.listed.size() || !p.listed[value.param_index]);
+    case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+        if (p.param_index >= 0)
+            return p.param_index == value.param_index;
+        /* fall through */
+    case MAVLINK_MSG_ID_PARAM_SET:
+        return strncmp(p.param_id, value.param_id, sizeof(p.param_id)) == 0;
+    }
+
+    return false;
+}
+
+Endpoint *ResponseSteering::find_requester(const struct buffer *buf, uint32_t msg_id,
+                                           uint8_t src_sysid, uint8_t src_compid, int target_sysid)
+{
+    if (!_enabled)
+        return nullptr;
+
+    if (msg_id != MAVLINK_MSG_ID_PARAM_VALUE && msg_id != MAVLINK_MSG_ID_COMMAND_ACK
+        && msg_id != MAVLINK_MSG_ID_MISSION_COUNT && msg_id != MAVLINK_MSG_ID_MISSION_ITEM
+        && msg_id != MAVLINK_MSG_ID_MISSION_ITEM_INT)
+        return nullptr;
+
+    const uint64_t now_ms = now_usec() / USEC_PER_MSEC;
+    const uint16_t command = get_command(buf, msg_id);
+    struct pending *match = nullptr;
+    mavlink_param_value_t value;
+
+    if (msg_id == MAVLINK_MSG_ID_PARAM_VALUE)
+        decode_mavlink_payload(buf, &value);
+
+    for (auto &p : _pending) {
+        if (p.requester == nullptr || p.expire_ms < now_ms || p.reply_msg_id != msg_id
+            || p.sysid != src_sysid || (p.compid != 0 && p.compid != src_compid)
+            || p.command != command)
+            continue;
+
+        if (msg_id == MAVLINK_MSG_ID_PARAM_VALUE) {
+            if (!_param_matches(p, value))
+                continue;
+            // A changed value concerns every ground station, not only the one setting it
+            if (p.msg_id == MAVLINK_MSG_ID_PARAM_SET)
+                return nullptr;
+        }
+
+        if (target_sysid > 0 && target_sysid != p.requester_sysid)
+            continue;
+
+        // More than one endpoint waiting for this reply: send it to everybody
+        if (match && match->requester != p.requester)
+            return nullptr;
+
+        match = &p;
+    }
+
+    if (!match)
+        return nullptr;
+
+    match->expire_ms = now_ms + STEERING_WINDOW_MSEC;
+    if (match->msg_id == MAVLINK_MSG_ID_PARAM_REQUEST_LIST) {
+        if (value.param_index >= match->listed.size())
+            match->listed.resize(value.param_count);
+        match->listed[value.param_index] = true;
+    }
+
+    return match->requester;
+}
+
+void ResponseSteering::remove_endpoint(const Endpoint *e)
+{
+    for (auto &p : _pending) {
+        if (p.requester == e)
+            p = {};
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <common/mavlink.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "comm.h"
+
+class Endpoint;
+
+/*
+ * Autopilots answer some requests with messages that are broadcast or
+ * targeted at a system id that may be shared by several ground stations.
+ * This tracks which endpoint sent a request so the reply can be delivered
+ * only to it.
+ */
+class ResponseSteering {
+public:
+    void set_enabled(bool enabled) { _enabled = enabled; }
+
+    /*
+     * Record endpoint @e as requester if message is one of the tracked
+     * requests.
+     */
+    void track_request(Endpoint *e, const struct buffer *buf, uint32_t msg_id, uint8_t src_sysid,
+                       int target_sysid, int target_compid);
+
+    /*
+     * Return the endpoint that requested the reply in @buf or nullptr if the
+     * message should be routed as usual.
+     */
+    Endpoint *find_requester(const struct buffer *buf, uint32_t msg_id, uint8_t src_sysid,
+                             uint8_t src_compid, int target_sysid);
+
+    /*
+     * Forget requests from @e, to be called before it's destroyed.
+     */
+    void remove_endpoint(const Endpoint *e);
+
+private:
+    static const unsigned int MAX_PENDING = 16;
+
+    struct pending {
+        Endpoint *requester;
+        uint64_t expire_ms;
+        uint32_t msg_id;
+        uint32_t reply_msg_id;
+        uint16_t command;
+        int16_t param_index; // -1 to match PARAM_VALUE by param_id
+        char param_id[16];
+        uint8_t requester_sysid;
+        uint8_t sysid;
+        uint8_t compid; // 0 for any component of sysid
+        // PARAM_REQUEST_LIST: indexes of the values already steered
+        std::vector<bool> listed;
+    };
+
+    static bool _param_matches(const struct pending &p, const mavlink_param_value_t &value);
+
+    bool _enabled = false;
+    struct pending _pending[MAX_PENDING] = {};
+};
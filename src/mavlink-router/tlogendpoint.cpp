@@ -0,0 +1,199 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "tlogendpoint.h"
+
+#include <endian.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <common/log.h>
+#include <common/util.h>
+
+#include "mainloop.h"
+
+TLogEndpoint::TLogEndpoint(const char *logs_dir, const struct log_storage_options &storage,
+                           unsigned long max_size, unsigned long max_time)
+    : Endpoint{"TLog"}
+    , _logs_dir{logs_dir}
+    , _storage(storage)
+    , _max_size(max_size)
+    , _max_time(max_time)
+    , _writer{new LogWriter()}
+{
+}
+
+TLogEndpoint::~TLogEndpoint()
+{
+    stop();
+}
+
+void TLogEndpoint::set_msg_filter(const std::vector<uint32_t> &msg_ids)
+{
+    _msg_filter.clear();
+
+    for (uint32_t id : msg_ids) {
+        if (id >= _msg_filter.size())
+            _msg_filter.resize(id + 1);
+        _msg_filter[id] = true;
+    }
+}
+
+bool TLogEndpoint::start()
+{
+    Mainloop &mainloop = Mainloop::get_instance();
+
+    if (_file != -1)
+        return true;
+
+    _file = LogWriter::create_file(_logs_dir, "tlog", _filename, sizeof(_filename));
+    if (_file < 0)
+        return false;
+
+    if (_writer->open(_file, _storage) < 0) {
+        close(_file);
+        _file = -1;
+        return false;
+    }
+    _file_size = 0;
+
+    // Hand data over to the writer thread at least as often as it's synced
+    _flush_timeout = mainloop.add_timeout(
+        _storage.sync_interval ? std::min<unsigned long>(_storage.sync_interval, MSEC_PER_SEC)
+                               : MSEC_PER_SEC,
+        std::bind(&TLogEndpoint::_flush, this), this);
+
+    if (_max_time)
+        _rotate_timeout = mainloop.add_timeout(_max_time * MSEC_PER_SEC,
+                                               std::bind(&TLogEndpoint::_rotate, this), this);
+
+    if (!_flush_timeout || (_max_time && !_rotate_timeout)) {
+        log_error("Unable to add timeout");
+        _close_file();
+        return false;
+    }
+
+    log_info("Recording routed messages on %s/%s", _logs_dir, _filename);
+
+    return true;
+}
+
+void TLogEndpoint::stop()
+{
+    _close_file();
+
+    // Wait for all files to be finished
+    _closing.clear();
+}
+
+/*
+ * Stop recording to the current file, which is finished by the writer
+ * thread in background.
+ */
+void TLogEndpoint::_close_file()
+{
+    if (_file == -1)
+        return;
+
+    Mainloop &mainloop = Mainloop::get_instance();
+    mainloop.del_timeout(_flush_timeout);
+    _flush_timeout = nullptr;
+    mainloop.del_timeout(_rotate_timeout);
+    _rotate_timeout = nullptr;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", _logs_dir, _filename) >= (int)sizeof(path))
+        path[0] = '\0';
+
+    _writer->close_async(path);
+    _closing.push_back(std::move(_writer));
+    _writer.reset(new LogWriter());
+    _file = -1;
+}
+
+/*
+ * Continue recording on a new file, without waiting for the previous one to
+ * be written.
+ */
+bool TLogEndpoint::_switch_file()
+{
+    _close_file();
+    LogWriter::collect(_closing);
+    return start();
+}
+
+void TLogEndpoint::_record(const struct buffer *pbuf)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t timestamp
+        = htobe64((uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / NSEC_PER_USEC);
+    const struct iovec iov[] = {{(void *)&timestamp, sizeof(timestamp)}, {pbuf->data, pbuf->len}};
+    const size_t len = sizeof(timestamp) + pbuf->len;
+
+    if (_max_size && _file_size + len > _max_size && _file_size > 0 && !_switch_file())
+        return;
+
+    if (!_writer->append(iov, 2)) {
+        _dropped++;
+        return;
+    }
+
+    _file_size += len;
+    _stat.write.total++;
+    _stat.write.bytes += len;
+}
+
+int TLogEndpoint::write_msg(const struct buffer *pbuf)
+{
+    // Everything is recorded by record(), nothing is routed here
+    return pbuf->len;
+}
+
+bool TLogEndpoint::_flush()
+{
+    const int err = _writer->get_error();
+
+    if (err)
+        log_error("Unable to write to TLog file %s (%s)", _filename, strerror(err));
+
+    _writer->flush();
+    LogWriter::collect(_closing);
+    return true;
+}
+
+bool TLogEndpoint::_rotate()
+{
+    _switch_file();
+
+    // start() adds a new timeout if it succeeds
+    return false;
+}
+
+void TLogEndpoint::print_statistics()
+{
+    Endpoint::print_statistics();
+
+    if (_dropped)
+        printf("EP %s Dropped: %u\n", _name.c_str(), _dropped);
+}
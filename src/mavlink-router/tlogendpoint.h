@@ -0,0 +1,90 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2017  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "endpoint.h"
+#include "logwriter.h"
+#include "timeout.h"
+
+/*
+ * Records every packet routed by mavlink-router in tlog format: each packet
+ * is preceded by the time it was routed, in microseconds since the Unix
+ * epoch as a big endian 64-bit integer.
+ *
+ * Packets are not routed to it like to other endpoints: Mainloop hands them
+ * over with record() before routing them.
+ */
+class TLogEndpoint : public Endpoint {
+public:
+    TLogEndpoint(const char *logs_dir, const struct log_storage_options &storage,
+                 unsigned long max_size, unsigned long max_time);
+    ~TLogEndpoint();
+
+    bool start();
+    void stop();
+
+    /*
+     * Record only messages with the given ids. All are recorded if empty.
+     */
+    void set_msg_filter(const std::vector<uint32_t> &msg_ids);
+
+    void record(const struct buffer *pbuf, uint32_t msg_id)
+    {
+        if (_file < 0 || (!_msg_filter.empty() && !_should_record(msg_id)))
+            return;
+        _record(pbuf);
+    }
+
+    int write_msg(const struct buffer *pbuf) override;
+    int flush_pending_msgs() override { return -ENOSYS; }
+    void print_statistics() override;
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
+
+private:
+    const char *_logs_dir;
+    struct log_storage_options _storage;
+    unsigned long _max_size;
+    unsigned long _max_time;
+
+    int _file = -1;
+    char _filename[64];
+    uint64_t _file_size = 0;
+    std::unique_ptr<LogWriter> _writer;
+    // Writers of previous files, finishing them in background
+    std::vector<std::unique_ptr<LogWriter>> _closing;
+    std::vector<bool> _msg_filter;
+    uint32_t _dropped = 0;
+
+    Timeout *_flush_timeout = nullptr;
+    Timeout *_rotate_timeout = nullptr;
+
+    bool _should_record(uint32_t msg_id) const
+    {
+        return msg_id < _msg_filter.size() && _msg_filter[msg_id];
+    }
+    void _record(const struct buffer *pbuf);
+    void _close_file();
+    bool _switch_file();
+    bool _flush();
+    bool _rotate();
+};
@@ -19,10 +19,14 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include <common/log.h>
 #include <common/util.h>
 
@@ -78,9 +82,12 @@ bool ULog::start()
     _waiting_header = true;
     _waiting_first_msg_offset = false;
     _expected_seq = 0;
+    _buffer.resize(_storage.ulog_buffer_size ? _storage.ulog_buffer_size
+                                              : ULOG_DEFAULT_BUFFER_SIZE);
     _buffer_len = 0;
     _buffer_index = 0;
-    _buffer_partial_len = 0;
+    _lost_packets = 0;
+    _lost_bytes = 0;
 
     return true;
 }
@@ -92,12 +99,14 @@ void ULog::stop()
         return;
     }
 
+    /* Give the writer a last chance, then whatever is left is lost */
+    _logging_flush();
+    _lost_bytes += _buffer_len;
     _buffer_len = 0;
-    /* Write the last partial message to avoid corrupt the end of the file */
-    while (_buffer_partial_len) {
-        if (!_logging_flush())
-            break;
-    }
+
+    if (_lost_packets || _lost_bytes)
+        log_warning("ULog: %u LOGGING_DATA packets lost, %" PRIu64 " bytes dropped", _lost_packets,
+                    _lost_bytes);
 
     LogEndpoint::stop();
 }
@@ -226,11 +235,11 @@ int ULog::write_msg(const struct buffer *buffer)
 /*
  * Return true if the message with seq should be handled.
  */
-bool ULog::_logging_seq(uint16_t seq, bool *drop)
+bool ULog::_logging_seq(uint16_t seq, uint16_t *lost)
 {
     if (_expected_seq == seq) {
         _expected_seq++;
-        *drop = false;
+        *lost = 0;
         return true;
     }
 
@@ -248,16 +257,71 @@ bool ULog::_logging_seq(uint16_t seq, bool *drop)
         }
     }
 
-    *drop = true;
+    *lost = seq - _expected_seq;
     _expected_seq = seq + 1;
     return true;
 }
 
+/*
+ * Copy @len bytes starting @offset bytes after the beginning of valid data
+ */
+void ULog::_buffer_peek(size_t offset, void *data, size_t len) const
+{
+    const size_t start = (_buffer_index + offset) % _buffer.size();
+    const size_t n = std::min(len, _buffer.size() - start);
+
+    memcpy(data, &_buffer[start], n);
+    memcpy((uint8_t *)data + n, &_buffer[0], len - n);
+}
+
+void ULog::_buffer_push(const uint8_t *data, size_t len)
+{
+    const size_t end = (_buffer_index + _buffer_len) % _buffer.size();
+    const size_t n = std::min(len, _buffer.size() - end);
+
+    memcpy(&_buffer[end], data, n);
+    memcpy(&_buffer[0], data + n, len - n);
+    _buffer_len += len;
+}
+
+/*
+ * Length of the complete ULog messages at the beginning of the buffer
+ */
+size_t ULog::_buffer_complete_len() const
+{
+    size_t len = 0;
+
+    while (_buffer_len - len >= sizeof(struct ulog_msg_header)) {
+        struct ulog_msg_header header;
+
+        _buffer_peek(len, &header, sizeof(header));
+        const size_t full_msg_size = header.msg_size + sizeof(struct ulog_msg_header);
+        if (full_msg_size > _buffer_len - len)
+            break;
+        len += full_msg_size;
+    }
+
+    return len;
+}
+
+/*
+ * Drop the message being reassembled, the rest of it will never arrive
+ */
+void ULog::_drop_partial_msg()
+{
+    const size_t complete_len = _buffer_complete_len();
+
+    _lost_bytes += _buffer_len - complete_len;
+    _buffer_len = complete_len;
+    _waiting_first_msg_offset = true;
+}
+
 void ULog::_logging_data_process(mavlink_logging_data_t *msg)
 {
-    bool drops = false;
+    uint16_t lost;
+    uint8_t begin = 0;
 
-    if (!_logging_seq(msg->sequence, &drops))
+    if (!_logging_seq(msg->sequence, &lost))
         return;
 
     /* Waiting for ULog header? */
@@ -279,115 +343,81 @@ void ULog::_logging_data_process(mavlink_logging_data_t *msg)
             return;
         }
 
-        _buffer_partial_len = ULOG_HEADER_SIZE;
-        memcpy(_buffer_partial, msg->data, ULOG_HEADER_SIZE);
+        /* Ring is empty when logging starts */
+        _writer.append(msg->data, ULOG_HEADER_SIZE);
 
-        memmove(msg->data, &msg->data[ULOG_HEADER_SIZE], msg->length);
-        msg->length -= ULOG_HEADER_SIZE;
+        begin = ULOG_HEADER_SIZE;
         _waiting_header = false;
+        /* Sequence starts on the header, nothing was lost before it */
+        lost = 0;
     }
 
-    if (drops) {
+    if (lost) {
+        _lost_packets += lost;
         _logging_flush();
-
-        _buffer_len = 0;
-        _buffer_index = 0;
-        _waiting_first_msg_offset = true;
-    }
-
-    /*
-     * Do not cause a buffer overflow, it should only happens if a ULog message
-     * don't fit in _msg_buffer
-     */
-    if ((_buffer_len + msg->length) > BUFFER_LEN) {
-        log_warning("Buffer full, dropping everything on buffer");
-
-        _buffer_len = 0;
-        _waiting_first_msg_offset = true;
+        _drop_partial_msg();
     }
 
-    /*
-     * ULog message fits on _buffer but it need move all valid data to
-     * the being of buffer.
-     */
-    if ((_buffer_index + _buffer_len + msg->length) > BUFFER_LEN) {
-        memmove(_buffer, &_buffer[_buffer_index], _buffer_len);
-        _buffer_index = 0;
-    }
-
-    uint8_t begin = 0;
-
     if (_waiting_first_msg_offset) {
-        if (msg->first_message_offset == NO_FIRST_MSG_OFFSET) {
+        if (msg->first_message_offset == NO_FIRST_MSG_OFFSET
+            || msg->first_message_offset > msg->length) {
             /* no useful information in this message */
+            _lost_bytes += msg->length - begin;
             return;
         }
 
         _waiting_first_msg_offset = false;
-        begin = msg->first_message_offset;
+        if (msg->first_message_offset > begin) {
+            _lost_bytes += msg->first_message_offset - begin;
+            begin = msg->first_message_offset;
+        }
     }
 
-    if (!msg->length)
+    if (msg->length <= begin)
         return;
 
-    msg->length = msg->length - begin;
-    memcpy(&_buffer[_buffer_index + _buffer_len], &msg->data[begin], msg->length);
-    _buffer_len += msg->length;
+    const size_t len = msg->length - begin;
+
+    if (len > _buffer.size() - _buffer_len) {
+        /* Make room by handing complete messages over to the writer */
+        _logging_flush();
+
+        if (len > _buffer.size() - _buffer_len) {
+            const size_t partial_len = _buffer_len - _buffer_complete_len();
+
+            log_warning("ULog buffer full, dropping %zu bytes", partial_len + len);
+            _drop_partial_msg();
+            _lost_bytes += len;
+            return;
+        }
+    }
+
+    _buffer_push(&msg->data[begin], len);
     _logging_flush();
 }
 
 bool ULog::_logging_flush()
 {
-    while (_buffer_partial_len) {
-        const ssize_t r = write(_file, _buffer_partial, _buffer_partial_len);
-        if (r == 0 || (r == -1 && errno == EAGAIN))
-            return true;
-        if (r < 0) {
-            log_error("Unable to write to ULog file: (%m)");
-            return false;
-        }
-
-        _buffer_partial_len -= r;
-        memmove(_buffer_partial, &_buffer_partial[r], _buffer_partial_len);
-    }
+    while (_buffer_len >= sizeof(struct ulog_msg_header)) {
+        struct ulog_msg_header header;
 
-    while (_buffer_len >= sizeof(struct ulog_msg_header) && !_buffer_partial_len) {
-        struct ulog_msg_header *header = (struct ulog_msg_header *)&_buffer[_buffer_index];
-        const uint16_t full_msg_size = header->msg_size + sizeof(struct ulog_msg_header);
+        _buffer_peek(0, &header, sizeof(header));
+        const size_t full_msg_size = header.msg_size + sizeof(struct ulog_msg_header);
 
         if (full_msg_size > _buffer_len) {
             break;
         }
 
-        const ssize_t r = write(_file, header, full_msg_size);
-        if (r == full_msg_size) {
-            _buffer_len -= full_msg_size;
-            _buffer_index += full_msg_size;
-            continue;
-        }
-        if (r == 0 || (r == -1 && errno == EAGAIN))
-            break;
-        if (r < 0) {
-            log_error("Unable to write to ULog file: (%m)");
-            return false;
-        }
-
-        /* Handle partial write */
-        _buffer_partial_len = full_msg_size - r;
+        /* Message may wrap around the end of the ring */
+        const size_t n = std::min(full_msg_size, _buffer.size() - _buffer_index);
+        const struct iovec iov[] = {{&_buffer[_buffer_index], n}, {&_buffer[0], full_msg_size - n}};
 
-        if (_buffer_partial_len > sizeof(_buffer_partial)) {
-            _buffer_partial_len = 0;
-            log_error("Partial buffer is not big enough to store the "
-                      "ULog entry(type=%c len=%u), ULog file is now corrupt.",
-                      header->msg_type, full_msg_size);
-            break;
-        }
-
-        memcpy(_buffer_partial, &_buffer[_buffer_index + r], _buffer_partial_len);
+        /* Writer is behind, keep message until it catches up */
+        if (!_writer.append(iov, 2))
+            return false;
 
+        _buffer_index = (_buffer_index + full_msg_size) % _buffer.size();
         _buffer_len -= full_msg_size;
-        _buffer_index += full_msg_size;
-        break;
     }
 
     return true;
@@ -17,14 +17,19 @@
  */
 #pragma once
 
+#include <vector>
+
 #include "logendpoint.h"
 
-#define BUFFER_LEN 2048
+#define ULOG_DEFAULT_BUFFER_SIZE 16384
+#define ULOG_MIN_BUFFER_SIZE 2048
 
 class ULog : public LogEndpoint {
 public:
-    ULog(const char *logs_dir, LogMode mode, unsigned long min_free_space, unsigned long max_files, bool heartbeat)
+    ULog(const char *logs_dir, LogMode mode, unsigned long min_free_space, unsigned long max_files,
+         bool heartbeat)
         : LogEndpoint{"ULog", logs_dir, mode, min_free_space, max_files, heartbeat}
+        , _buffer(ULOG_DEFAULT_BUFFER_SIZE)
     {
     }
 
@@ -45,14 +50,25 @@ private:
     bool _waiting_header = true;
     bool _waiting_first_msg_offset = false;
 
-    uint8_t _buffer[BUFFER_LEN];
-    uint16_t _buffer_len = 0;
+    /*
+     * Ring buffer where ULog messages are reassembled from LOGGING_DATA
+     * payloads until they are complete and queued to the writer. Sized from
+     * the storage options on start().
+     */
+    std::vector<uint8_t> _buffer;
     /* Where valid data starts on buffer */
-    uint16_t _buffer_index = 0;
-    uint8_t _buffer_partial[BUFFER_LEN / 2];
-    uint16_t _buffer_partial_len = 0;
+    size_t _buffer_index = 0;
+    size_t _buffer_len = 0;
+
+    uint32_t _lost_packets = 0;
+    uint64_t _lost_bytes = 0;
+
+    void _buffer_peek(size_t offset, void *data, size_t len) const;
+    void _buffer_push(const uint8_t *data, size_t len);
+    size_t _buffer_complete_len() const;
+    void _drop_partial_msg();
 
-    bool _logging_seq(uint16_t seq, bool *drop);
+    bool _logging_seq(uint16_t seq, uint16_t *lost);
     void _logging_data_process(mavlink_logging_data_t *msg);
     bool _logging_flush();
 };